@@ -0,0 +1,86 @@
+/* Guest program for kvmserver_bench. As a request VM it listens on a TCP
+   port and waits for connections, and kvmserver_bench calls the bench_*
+   functions directly. With the "storage" argument it is the storage VM. */
+#include <netinet/in.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define BENCH_MAX_PAGES 4096
+
+extern size_t sys_kvmserverguest_remote_resume(void* buffer, ssize_t len);
+extern size_t sys_kvmserverguest_storage_wait_paused(void** req, ssize_t len);
+
+asm(".global sys_kvmserverguest_remote_resume\n"
+	".type sys_kvmserverguest_remote_resume, @function\n"
+	"sys_kvmserverguest_remote_resume:\n"
+	"	mov $0x10001, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n");
+
+asm(".global sys_kvmserverguest_storage_wait_paused\n"
+	".type sys_kvmserverguest_storage_wait_paused, @function\n"
+	"sys_kvmserverguest_storage_wait_paused:\n"
+	".cfi_startproc\n"
+	"	mov $0x10002, %eax\n"
+	"	out %eax, $0\n"
+	"	wrfsbase %rdi\n"
+	"	ret\n"
+	".cfi_endproc\n");
+
+static char pages[BENCH_MAX_PAGES * 4096];
+
+/* Dirty the first n pages of a buffer */
+__attribute__((used, noinline))
+void bench_touch(unsigned n)
+{
+	if (n > BENCH_MAX_PAGES)
+		n = BENCH_MAX_PAGES;
+	for (unsigned i = 0; i < n; i++)
+		((volatile char*)pages)[i * 4096] = (char)i;
+}
+
+/* A system call that kvmserver handles without a host system call */
+__attribute__((used, noinline))
+void bench_syscalls(unsigned n)
+{
+	for (unsigned i = 0; i < n; i++)
+		syscall(SYS_getpid);
+}
+
+/* Round trips to the storage VM */
+__attribute__((used, noinline))
+void bench_storage(unsigned n)
+{
+	char buffer[64];
+	for (unsigned i = 0; i < n; i++)
+		sys_kvmserverguest_remote_resume(buffer, sizeof(buffer));
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && strcmp(argv[1], "storage") == 0) {
+		ssize_t ret = 0;
+		while (1) {
+			void* req = NULL;
+			sys_kvmserverguest_storage_wait_paused(&req, ret);
+			ret = 0;
+		}
+	}
+
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+		return 1;
+	while (1) {
+		const int client = accept(fd, NULL, NULL);
+		if (client >= 0)
+			close(client);
+	}
+}
@@ -0,0 +1,204 @@
+/**
+ * Microbenchmarks of kvmserver internals. Each benchmark takes a number
+ * of samples after a warmup, and reports the median time of one
+ * operation together with the spread of the samples, so that builds
+ * can be compared on the same machine.
+**/
+#include <CLI/CLI.hpp>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "mmap_file.hpp"
+#include "path_index.hpp"
+#include "vm.hpp"
+
+struct Benchmark {
+	std::string name;
+	unsigned ops; /* Operations in one sample */
+	std::function<void()> setup; /* Not timed, before each sample */
+	std::function<void()> run;
+};
+
+static volatile uintptr_t sink; /* Keeps results from being optimized away */
+
+static std::string format_ns(double ns)
+{
+	char buffer[32];
+	if (ns < 1e3)
+		snprintf(buffer, sizeof(buffer), "%.1fns", ns);
+	else if (ns < 1e6)
+		snprintf(buffer, sizeof(buffer), "%.2fus", ns / 1e3);
+	else
+		snprintf(buffer, sizeof(buffer), "%.2fms", ns / 1e6);
+	return buffer;
+}
+
+static void measure(const Benchmark& bench, unsigned samples, unsigned warmup)
+{
+	std::vector<double> ns;
+	ns.reserve(samples);
+	for (unsigned i = 0; i < warmup + samples; i++) {
+		if (bench.setup)
+			bench.setup();
+		const auto start = std::chrono::steady_clock::now();
+		bench.run();
+		const auto end = std::chrono::steady_clock::now();
+		if (i >= warmup)
+			ns.push_back(std::chrono::duration<double, std::nano>(end - start).count() / bench.ops);
+	}
+	std::sort(ns.begin(), ns.end());
+	auto percentile = [&] (double p) { return ns[std::min<size_t>(ns.size() - 1, p * ns.size())]; };
+	const double median = percentile(0.5);
+	// The median absolute deviation is not thrown off by a few slow samples
+	std::vector<double> deviations;
+	deviations.reserve(ns.size());
+	for (double value : ns)
+		deviations.push_back(std::fabs(value - median));
+	std::nth_element(deviations.begin(), deviations.begin() + deviations.size() / 2, deviations.end());
+	const double mad = deviations[deviations.size() / 2];
+
+	printf("%-20s %10s %10s %10s %10s %7.1f%%\n", bench.name.c_str(),
+		format_ns(ns.front()).c_str(), format_ns(median).c_str(),
+		format_ns(percentile(0.9)).c_str(), format_ns(percentile(0.99)).c_str(),
+		100.0 * mad / median);
+	fflush(stdout);
+}
+
+static struct sockaddr_storage make_address(int family, const char* address, uint16_t port)
+{
+	struct sockaddr_storage storage {};
+	if (family == AF_INET) {
+		auto* addr = reinterpret_cast<struct sockaddr_in*>(&storage);
+		addr->sin_family = AF_INET;
+		addr->sin_port = htons(port);
+		inet_pton(AF_INET, address, &addr->sin_addr);
+	} else {
+		auto* addr = reinterpret_cast<struct sockaddr_in6*>(&storage);
+		addr->sin6_family = AF_INET6;
+		addr->sin6_port = htons(port);
+		inet_pton(AF_INET6, address, &addr->sin6_addr);
+	}
+	return storage;
+}
+
+int main(int argc, char* argv[])
+{
+	CLI::App app{"Microbenchmarks of kvmserver internals"};
+	unsigned samples = 200;
+	unsigned warmup = 20;
+	std::string guest = KVMSERVER_BENCH_GUEST;
+	std::string filter;
+	app.add_option("-s,--samples", samples, "Timed samples of each benchmark")->capture_default_str();
+	app.add_option("-w,--warmup", warmup, "Samples taken before timing")->capture_default_str();
+	app.add_option("-g,--guest", guest, "The bundled guest program")->capture_default_str();
+	app.add_option("filter", filter, "Only run benchmarks whose name contains this");
+	try {
+		app.parse(argc, argv);
+	} catch (const CLI::ParseError& e) {
+		return app.exit(e);
+	}
+	if (samples == 0) {
+		fprintf(stderr, "Error: --samples must be at least 1\n");
+		return 1;
+	}
+
+	try {
+		// The guest is both the request VM and the storage VM, with
+		// permissions that give the lookups realistic tables
+		std::vector<std::string> args {
+			"kvmserver",
+			"--allow-read=/usr,/etc,/lib,/proc/self",
+			"--allow-write=/tmp,/var/cache",
+			"--allow-connect=10.0.0.0/8:80-443,172.16.0.0/12:5432,192.168.0.0/16,[fd00::]/8,[::1]:8000-8100",
+			"--allow-listen",
+			"run", guest, "++",
+			"storage", guest, "storage",
+		};
+		std::vector<char*> config_argv;
+		for (auto& arg : args)
+			config_argv.push_back(arg.data());
+		const Configuration config = Configuration::FromArgs(config_argv.size(), config_argv.data());
+
+		VirtualMachine::init_kvm();
+		MmapFile binary(config.main_filename);
+		MmapFile storage_binary(config.storage_filename);
+
+		VirtualMachine storage_vm(storage_binary.view(), config, true);
+		std::mutex storage_vm_mutex;
+		storage_vm.machine().cpu().remote_serializer = &storage_vm_mutex;
+		storage_vm.initialize(nullptr, false);
+		if (!storage_vm.is_waiting_for_requests()) {
+			fprintf(stderr, "The storage VM did not wait for requests\n");
+			return 1;
+		}
+		VirtualMachine vm(binary.view(), config);
+		vm.machine().remote_connect(storage_vm.machine());
+		vm.initialize(nullptr, false);
+		if (!vm.is_waiting_for_requests()) {
+			fprintf(stderr, "The guest program did not wait for requests\n");
+			return 1;
+		}
+		const auto touch = vm.machine().address_of("bench_touch");
+		const auto syscalls = vm.machine().address_of("bench_syscalls");
+		const auto storage_calls = vm.machine().address_of("bench_storage");
+		const float timeout = config.max_req_time;
+
+		VirtualMachine fork(vm, 0, false);
+		std::vector<Benchmark> benchmarks;
+		benchmarks.push_back({"fork", 1, nullptr, [&] {
+			VirtualMachine other(vm, 1, false);
+		}});
+		for (unsigned pages : { 1u, 16u, 256u, 4096u }) {
+			benchmarks.push_back({"reset/" + std::to_string(pages), 1,
+				[&, pages] { fork.machine().timed_vmcall(touch, timeout, pages); },
+				[&] { fork.reset_to(vm); }});
+		}
+		benchmarks.push_back({"syscall", 1000, nullptr, [&] {
+			fork.machine().timed_vmcall(syscalls, timeout, 1000u);
+		}});
+		benchmarks.push_back({"storage", 100, nullptr, [&] {
+			fork.machine().timed_vmcall(storage_calls, timeout, 100u);
+		}});
+
+		const PathIndex path_index(config.allowed_paths);
+		const std::vector<std::string> paths {
+			"/usr/lib/x86_64-linux-gnu/libc.so.6", "/etc/resolv.conf", "/tmp/upload/part-1",
+			"/usr/share/../lib/os-release", "/home/user/.ssh/id_rsa", "relative/path",
+		};
+		benchmarks.push_back({"path_lookup", (unsigned)paths.size(), nullptr, [&] {
+			for (const auto& path : paths) {
+				std::string lookup = path;
+				sink = uintptr_t(path_index.lookup(lookup, "/tmp", PathIndex::Readable));
+			}
+		}});
+
+		const std::vector<struct sockaddr_storage> addresses {
+			make_address(AF_INET, "10.1.2.3", 443), make_address(AF_INET, "10.1.2.3", 8080),
+			make_address(AF_INET, "172.20.0.1", 5432), make_address(AF_INET, "8.8.8.8", 53),
+			make_address(AF_INET6, "fd12::1", 80), make_address(AF_INET6, "2001:db8::1", 443),
+		};
+		benchmarks.push_back({"network_access", (unsigned)addresses.size(), nullptr, [&] {
+			for (const auto& address : addresses)
+				sink = config.allowed_connect.contains(address);
+		}});
+
+		printf("%-20s %10s %10s %10s %10s %8s\n", "benchmark", "min", "median", "p90", "p99", "mad");
+		for (const auto& bench : benchmarks) {
+			if (bench.name.find(filter) != std::string::npos)
+				measure(bench, samples, warmup);
+		}
+	} catch (const tinykvm::MachineException& me) {
+		fprintf(stderr, "Error: %s Data: 0x%lX\n", me.what(), me.data());
+		return 1;
+	} catch (const std::exception& e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
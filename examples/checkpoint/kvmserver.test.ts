@@ -0,0 +1,44 @@
+import { assertEquals } from "@std/assert";
+import { kvmServerCommand, waitForLine } from "../testutil.ts";
+
+// Forks start by returning from kvmserverguest_checkpoint(), so state
+// written before the call is there, and the call returned once per reset.
+const variants: { name: string; ephemeral: boolean }[] = [
+  { name: "checkpoint", ephemeral: false },
+  { name: "checkpoint with ephemeral forks", ephemeral: true },
+];
+
+for (const { name, ephemeral } of variants) {
+  Deno.test(name, async () => {
+    const command = kvmServerCommand({
+      program: "./target/test",
+      cwd: import.meta.dirname,
+      ephemeral,
+      threads: 2,
+      allowAll: true,
+      extra: ["--wait-for-checkpoint"],
+    });
+    await using proc = command.spawn();
+    let method = "";
+    await Promise.race([
+      waitForLine(proc.stdout, (line) => {
+        if (!line.startsWith("Program")) return false;
+        method = line.split(" ")[3];
+        return true;
+      }),
+      proc.status.then(({ code }) => {
+        throw new Error(`Status code: ${code}`);
+      }),
+    ]);
+    assertEquals(method, "checkpoint");
+    using client = Deno.createHttpClient({ poolMaxIdlePerHost: 0 });
+    for (let i = 0; i < 4; i++) {
+      const response = await fetch("http://127.0.0.1:8000/", { client });
+      assertEquals(response.status, 200);
+      assertEquals(
+        await response.text(),
+        "loaded=modules checkpoint=0 returns=1",
+      );
+    }
+  });
+}
@@ -0,0 +1,56 @@
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Listens on the port given as argument, prepares some state and calls
+// kvmserverguest_checkpoint(). Every response shows the state, what the
+// checkpoint returned, and how many times it has returned in this VM.
+
+extern int kvmserverguest_checkpoint(void);
+
+static char loaded[32] = "nothing";
+static int checkpoint_result = -1;
+static int returns = 0;
+
+int main(int argc, char** argv)
+{
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	const int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(argc > 1 ? atoi(argv[1]) : 8000);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		perror("listen");
+		return 1;
+	}
+	strcpy(loaded, "modules");
+	checkpoint_result = kvmserverguest_checkpoint();
+	returns++;
+
+	while (1) {
+		const int client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			perror("accept");
+			return 1;
+		}
+		char request[4096];
+		if (read(client, request, sizeof(request)) < 0) {
+			perror("read");
+		}
+		char body[128];
+		const int len = snprintf(body, sizeof(body), "loaded=%s checkpoint=%d returns=%d",
+			loaded, checkpoint_result, returns);
+		char response[256];
+		const int total = snprintf(response, sizeof(response),
+			"HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s", len, body);
+		if (write(client, response, total) < 0) {
+			perror("write");
+		}
+		close(client);
+	}
+}
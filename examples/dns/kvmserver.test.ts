@@ -0,0 +1,95 @@
+import { assertEquals } from "@std/assert";
+import dgram from "node:dgram";
+import { Buffer } from "node:buffer";
+import { KVMSERVER } from "../testutil.ts";
+
+const ADDRESS = [192, 0, 2, 1];
+
+// Answers A queries for found.test, and NXDOMAIN with a SOA record
+// (TTL 300, MINIMUM 30) for every other name. Counts queries by name.
+async function nameserver() {
+  const socket = dgram.createSocket("udp4");
+  const queries: Record<string, number> = {};
+  socket.on("message", (query: Buffer, client: dgram.RemoteInfo) => {
+    let end = 12;
+    const labels: string[] = [];
+    while (query[end] !== 0) {
+      labels.push(query.subarray(end + 1, end + 1 + query[end]).toString());
+      end += 1 + query[end];
+    }
+    end += 5; // The root label, type and class
+    const name = labels.join(".").toLowerCase();
+    queries[name] = (queries[name] ?? 0) + 1;
+    const found = name === "found.test";
+    const header = Buffer.alloc(12);
+    query.copy(header, 0, 0, 2);
+    header.writeUInt16BE(found ? 0x8180 : 0x8183, 2);
+    header.writeUInt16BE(1, 4);
+    header.writeUInt16BE(found ? 1 : 0, 6);
+    header.writeUInt16BE(found ? 0 : 1, 8);
+    const record = found
+      ? Buffer.from([0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, ...ADDRESS])
+      : Buffer.from([
+        ...[0xc0, 12, 0, 6, 0, 1, 0, 0, 1, 44, 0, 22, 0, 0],
+        ...[0, 0, 0, 1, 0, 0, 0, 60, 0, 0, 0, 60, 0, 0, 0, 60, 0, 0, 0, 30],
+      ]);
+    socket.send(
+      Buffer.concat([header, query.subarray(12, end), record]),
+      client.port,
+      client.address,
+    );
+  });
+  await new Promise<void>((resolve) => socket.bind(0, "127.0.0.1", resolve));
+  return {
+    port: socket.address().port,
+    queries,
+    [Symbol.dispose]: () => socket.close(),
+  };
+}
+
+const names = ["found.test", "FOUND.test", "missing.test", "missing.test"];
+// Names differ in case only, the cache shares their answer
+const variants: { name: string; options: string[]; queries: number }[] = [
+  { name: "glibc resolver", options: [], queries: 2 },
+  {
+    name: "glibc resolver with dns cache",
+    options: ["--dns-cache"],
+    queries: 1,
+  },
+];
+
+for (const { name, options, queries } of variants) {
+  Deno.test(name, async () => {
+    using server = await nameserver();
+    const address = `127.0.0.1:${server.port}`;
+    const command = new Deno.Command(KVMSERVER, {
+      args: [
+        `--allow-connect=${address}`,
+        `--dns-nameserver=${address}`,
+        ...options,
+        "run",
+        "./target/test",
+        String(server.port),
+        ...names,
+      ],
+      cwd: import.meta.dirname,
+    });
+    const result = await command.output();
+    const stdout = new TextDecoder("latin1").decode(result.stdout);
+    console.log(stdout);
+    assertEquals(result.code, 0, "code");
+    const answers = stdout.trim().split("\n")
+      .filter((line) => /^\S+\.test /.test(line))
+      .map((line) => line.split(" ").slice(0, 2));
+    assertEquals(answers, [
+      ["found.test", ADDRESS.join(".")],
+      ["FOUND.test", ADDRESS.join(".")],
+      ["missing.test", "not-found"],
+      ["missing.test", "not-found"],
+    ]);
+    assertEquals(server.queries, {
+      "found.test": queries,
+      "missing.test": queries,
+    });
+  });
+}
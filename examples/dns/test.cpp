@@ -0,0 +1,49 @@
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <cstdio>
+#include <cstdlib>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <resolv.h>
+
+// Resolves each name with the glibc resolver, using the nameserver on
+// 127.0.0.1 and the port given as the first argument
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <port> <name>...\n", argv[0]);
+		return 1;
+	}
+	struct __res_state state {};
+	if (res_ninit(&state) < 0) {
+		fprintf(stderr, "res_ninit failed\n");
+		return 1;
+	}
+	state.nscount = 1;
+	state.nsaddr_list[0].sin_family = AF_INET;
+	state.nsaddr_list[0].sin_port = htons(atoi(argv[1]));
+	state.nsaddr_list[0].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	state.retry = 1;
+	state.retrans = 2;
+
+	for (int i = 2; i < argc; i++) {
+		unsigned char answer[NS_PACKETSZ];
+		const int len = res_nquery(&state, argv[i], ns_c_in, ns_t_a, answer, sizeof(answer));
+		if (len < 0) {
+			printf("%s %s\n", argv[i], state.res_h_errno == HOST_NOT_FOUND ? "not-found" : "failed");
+			continue;
+		}
+		ns_msg msg;
+		ns_rr rr;
+		if (ns_initparse(answer, len, &msg) < 0 || ns_parserr(&msg, ns_s_an, 0, &rr) < 0
+			|| ns_rr_type(rr) != ns_t_a || ns_rr_rdlen(rr) != 4) {
+			printf("%s invalid\n", argv[i]);
+			continue;
+		}
+		char address[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, ns_rr_rdata(rr), address, sizeof(address));
+		printf("%s %s %u\n", argv[i], address, ns_rr_ttl(rr));
+	}
+	res_nclose(&state);
+	return 0;
+}
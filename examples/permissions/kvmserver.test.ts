@@ -0,0 +1,201 @@
+import { assertEquals } from "@std/assert";
+import { KVMSERVER } from "../testutil.ts";
+
+// Runs ./target/test with the operations, twice so that cached lookups
+// are checked too, and returns whether each one was allowed.
+async function check(
+  options: string[],
+  operations: string[],
+): Promise<Record<string, string>> {
+  const program = new URL(import.meta.resolve("./target/test")).pathname;
+  const command = new Deno.Command(KVMSERVER, {
+    args: [...options, "run", program, ...operations, ...operations],
+  });
+  const result = await command.output();
+  const stdout = new TextDecoder("latin1").decode(result.stdout);
+  console.log(stdout);
+  assertEquals(result.code, 0, "code");
+  const results: Record<string, string> = {};
+  for (const line of stdout.trim().split("\n")) {
+    const match = line.match(/^(\S+) (allowed|denied)$/);
+    if (match === null) continue;
+    const [, operation, verdict] = match;
+    assertEquals(
+      results[operation] ?? verdict,
+      verdict,
+      `${operation} changed on repeat`,
+    );
+    results[operation] = verdict;
+  }
+  return results;
+}
+
+// The expected results are those of the checks that the path index and
+// the network allowlist replaced, plus the new prefix and range syntax.
+Deno.test("path permissions", async () => {
+  const root = await Deno.makeTempDir({ prefix: "kvmserver-permissions-" });
+  try {
+    for (const dir of ["public/upload", "public2", "secret", "scratch"]) {
+      await Deno.mkdir(`${root}/${dir}`, { recursive: true });
+    }
+    for (const file of ["public/file", "public/upload/file", "public2/file"]) {
+      await Deno.writeTextFile(`${root}/${file}`, "file");
+    }
+    await Deno.writeTextFile(`${root}/secret/file`, "secret");
+    const options = [
+      `--allow-read=${root}/public`,
+      `--allow-write=${root}/public/upload`,
+      `--scratch=${root}/scratch`,
+      `--cwd=${root}`,
+    ];
+    const expected: Record<string, string> = {
+      [`read:${root}/public/file`]: "allowed",
+      [`read:${root}/public/./file`]: "allowed",
+      [`read:${root}//public/file`]: "allowed",
+      [`read:${root}/secret/../public/file`]: "allowed",
+      [`read:${root}/secret/file`]: "denied",
+      [`read:${root}/public/../secret/file`]: "denied",
+      [`read:${root}/public/upload/../../secret/file`]: "denied",
+      // A sibling that shares the name as a string prefix
+      [`read:${root}/public2/file`]: "denied",
+      // A write-only path falls back to its readable parent
+      [`read:${root}/public/upload/file`]: "allowed",
+      [`write:${root}/public/upload/new`]: "allowed",
+      [`write:${root}/public/upload/../new`]: "denied",
+      [`write:${root}/public/new`]: "denied",
+      [`write:${root}/secret/new`]: "denied",
+      // Relative to --cwd
+      ["read:public/file"]: "allowed",
+      ["read:./public/upload/../file"]: "allowed",
+      ["read:secret/file"]: "denied",
+      ["read:public/../secret/file"]: "denied",
+      ["write:public/upload/relative"]: "allowed",
+      ["write:public/relative"]: "denied",
+      // Scratch paths are remapped into a directory of the VM
+      [`write:${root}/scratch/new`]: "allowed",
+      [`read:${root}/scratch/new`]: "allowed",
+      [`write:${root}/scratch/../new`]: "denied",
+    };
+    assertEquals(await check(options, Object.keys(expected)), expected);
+    // Only the remapped scratch directory was written to
+    const written: string[] = [];
+    for await (const entry of Deno.readDir(`${root}/scratch`)) {
+      written.push(entry.name);
+    }
+    assertEquals(written, []);
+    await Deno.stat(`${root}/public/upload/new`);
+    await Deno.stat(`${root}/public/upload/relative`);
+  } finally {
+    await Deno.remove(root, { recursive: true });
+  }
+});
+
+const networkVariants: {
+  name: string;
+  options: string[];
+  expected: Record<string, string>;
+}[] = [
+  {
+    name: "address with any port",
+    options: ["--allow-connect=127.0.0.1"],
+    expected: {
+      "connect:127.0.0.1:1": "allowed",
+      "connect:127.0.0.1:65535": "allowed",
+      "connect:127.0.0.2:1": "denied",
+      "connect:[::1]:1": "denied",
+    },
+  },
+  {
+    name: "any address with a port",
+    options: ["--allow-connect=:9"],
+    expected: {
+      "connect:127.0.0.1:9": "allowed",
+      "connect:10.1.2.3:9": "allowed",
+      "connect:[::1]:9": "allowed",
+      "connect:127.0.0.1:10": "denied",
+      "connect:[::1]:10": "denied",
+    },
+  },
+  {
+    name: "unspecified address",
+    options: ["--allow-connect=0.0.0.0:9,[::]"],
+    expected: {
+      "connect:127.0.0.1:9": "allowed",
+      "connect:10.1.2.3:9": "allowed",
+      "connect:127.0.0.1:10": "denied",
+      "connect:[::1]:10": "allowed",
+      "connect:[fd00::1]:1": "allowed",
+    },
+  },
+  {
+    name: "allow all",
+    options: ["--allow-net"],
+    expected: {
+      "connect:127.0.0.1:1": "allowed",
+      "connect:10.1.2.3:65535": "allowed",
+      "connect:[::1]:1": "allowed",
+    },
+  },
+  {
+    name: "no network access",
+    options: [],
+    expected: {
+      "connect:127.0.0.1:1": "denied",
+      "connect:[::1]:1": "denied",
+    },
+  },
+  {
+    name: "port range",
+    options: ["--allow-connect=127.0.0.1:8000-8100"],
+    expected: {
+      "connect:127.0.0.1:7999": "denied",
+      "connect:127.0.0.1:8000": "allowed",
+      "connect:127.0.0.1:8050": "allowed",
+      "connect:127.0.0.1:8100": "allowed",
+      "connect:127.0.0.1:8101": "denied",
+      "connect:127.0.0.2:8000": "denied",
+    },
+  },
+  {
+    name: "IPv4 prefix",
+    options: ["--allow-connect=127.0.0.0/8"],
+    expected: {
+      "connect:127.0.0.1:1": "allowed",
+      "connect:127.1.2.3:1": "allowed",
+      "connect:126.255.255.254:1": "denied",
+      "connect:128.0.0.1:1": "denied",
+    },
+  },
+  {
+    name: "IPv4 /32 and /0",
+    options: ["--allow-connect=127.0.0.1/32:9,0.0.0.0/0:10"],
+    expected: {
+      "connect:127.0.0.1:9": "allowed",
+      "connect:127.0.0.2:9": "denied",
+      "connect:127.0.0.2:10": "allowed",
+      "connect:10.1.2.3:10": "allowed",
+      "connect:10.1.2.3:11": "denied",
+      "connect:[::1]:10": "denied",
+    },
+  },
+  {
+    name: "IPv6 addresses and prefixes",
+    options: ["--allow-connect=[::1]:9,[fd00::]/8,::2,[::]/0:10"],
+    expected: {
+      "connect:[::1]:9": "allowed",
+      "connect:[::1]:10": "allowed",
+      "connect:[::1]:11": "denied",
+      "connect:[::2]:11": "allowed",
+      "connect:[::3]:11": "denied",
+      "connect:[fd12::1]:1": "allowed",
+      "connect:[fe00::1]:1": "denied",
+      "connect:127.0.0.1:9": "denied",
+    },
+  },
+];
+
+for (const { name, options, expected } of networkVariants) {
+  Deno.test(`network permissions: ${name}`, async () => {
+    assertEquals(await check(options, Object.keys(expected)), expected);
+  });
+}
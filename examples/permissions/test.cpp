@@ -0,0 +1,90 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Tries each operation given as an argument and prints whether it was
+// allowed, e.g. read:/etc/hostname, write:data/file, connect:[::1]:8000
+
+static bool try_open(const char* path, int flags)
+{
+	const int fd = open(path, flags, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+static bool try_connect(const std::string& target, bool& valid)
+{
+	const size_t colon = target.rfind(':');
+	if (colon == std::string::npos) {
+		valid = false;
+		return false;
+	}
+	std::string address = target.substr(0, colon);
+	const int port = atoi(target.c_str() + colon + 1);
+	struct sockaddr_storage addr {};
+	socklen_t addrlen;
+	if (address.size() >= 2 && address.front() == '[' && address.back() == ']') {
+		address = address.substr(1, address.size() - 2);
+		auto* sin6 = reinterpret_cast<struct sockaddr_in6*>(&addr);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		valid = inet_pton(AF_INET6, address.c_str(), &sin6->sin6_addr) == 1;
+		addrlen = sizeof(*sin6);
+	} else {
+		auto* sin = reinterpret_cast<struct sockaddr_in*>(&addr);
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		valid = inet_pton(AF_INET, address.c_str(), &sin->sin_addr) == 1;
+		addrlen = sizeof(*sin);
+	}
+	if (!valid) {
+		return false;
+	}
+	const int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		valid = false;
+		return false;
+	}
+	// Nothing needs to listen: refused or unreachable is still allowed
+	const int res = connect(fd, reinterpret_cast<struct sockaddr*>(&addr), addrlen);
+	const int error = errno;
+	close(fd);
+	return res == 0 || (error != EPERM && error != EACCES);
+}
+
+int main(int argc, char** argv)
+{
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const size_t colon = arg.find(':');
+		const std::string op = arg.substr(0, colon);
+		const std::string target = colon != std::string::npos ? arg.substr(colon + 1) : "";
+		bool valid = true;
+		bool allowed = false;
+		if (op == "read") {
+			allowed = try_open(target.c_str(), O_RDONLY);
+		} else if (op == "write") {
+			allowed = try_open(target.c_str(), O_WRONLY | O_CREAT);
+		} else if (op == "connect") {
+			allowed = try_connect(target, valid);
+		} else {
+			valid = false;
+		}
+		if (!valid) {
+			fprintf(stderr, "Invalid operation: %s\n", arg.c_str());
+			return 1;
+		}
+		printf("%s %s\n", arg.c_str(), allowed ? "allowed" : "denied");
+	}
+	return 0;
+}
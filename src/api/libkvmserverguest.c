@@ -1,9 +1,30 @@
+#include <stdint.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Resume storage VM with provided data shared two-ways. */
 extern size_t sys_kvmserverguest_remote_resume(void* buffer, ssize_t len);
 /* Wait for remote resume (in storage) */
 extern size_t sys_kvmserverguest_storage_wait_paused(void** req, ssize_t len);
+/* Keep a memory range intact across ephemeral resets of this VM. */
+extern int sys_kvmserverguest_persist_range(void* addr, size_t len);
+/* Host-side cache shared by all VMs. Get returns the value length. */
+extern ssize_t sys_kvmserverguest_cache_get(const void* key, size_t keylen, void* buffer, size_t buflen);
+extern int sys_kvmserverguest_cache_put(const void* key, size_t keylen, const void* value, size_t len, unsigned ttl_ms);
+extern int sys_kvmserverguest_cache_invalidate(const void* key, size_t keylen);
+/* Signal that the program is fully initialized (main VM only) */
+extern int sys_kvmserverguest_checkpoint(void);
+/* Scaling from this VM's TSC to host clocks, -ENOTSUP when disabled */
+struct kvmserverguest_clock_params {
+	uint64_t tsc_base;
+	uint64_t tsc_valid_until; /* Zeroed by the host on fork and reset */
+	uint64_t mult;            /* Nanoseconds per tick, 32.32 fixed point */
+	int64_t  mono_base;
+	int64_t  real_base;
+};
+extern int sys_kvmserverguest_clock_calibrate(struct kvmserverguest_clock_params* params, uint64_t tsc);
 
 size_t kvmserverguest_remote_resume(void *buffer, ssize_t len) {
 	return sys_kvmserverguest_remote_resume(buffer, len);
@@ -14,6 +35,79 @@ size_t kvmserverguest_storage_wait_paused(void** req, ssize_t len)
 	return sys_kvmserverguest_storage_wait_paused(req, len);
 }
 
+int kvmserverguest_persist_range(void* addr, size_t len)
+{
+	return sys_kvmserverguest_persist_range(addr, len);
+}
+
+ssize_t kvmserverguest_cache_get(const void* key, size_t keylen, void* buffer, size_t buflen)
+{
+	return sys_kvmserverguest_cache_get(key, keylen, buffer, buflen);
+}
+
+int kvmserverguest_cache_put(const void* key, size_t keylen, const void* value, size_t len, unsigned ttl_ms)
+{
+	return sys_kvmserverguest_cache_put(key, keylen, value, len, ttl_ms);
+}
+
+int kvmserverguest_cache_invalidate(const void* key, size_t keylen)
+{
+	return sys_kvmserverguest_cache_invalidate(key, keylen);
+}
+
+int kvmserverguest_checkpoint(void)
+{
+	return sys_kvmserverguest_checkpoint();
+}
+
+static struct kvmserverguest_clock_params clock_params;
+static int64_t clock_last_mono;
+static int clock_disabled;
+
+static inline uint64_t clock_rdtsc(void)
+{
+	uint32_t lo, hi;
+	__asm__ volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* CLOCK_MONOTONIC and CLOCK_REALTIME without leaving the VM when the
+   host runs with --paravirt-clock, other clocks use the system call. */
+int kvmserverguest_clock_gettime(clockid_t clock, struct timespec* ts)
+{
+	const int realtime = (clock == CLOCK_REALTIME || clock == CLOCK_REALTIME_COARSE);
+	if (clock_disabled || !(realtime || clock == CLOCK_MONOTONIC || clock == CLOCK_MONOTONIC_COARSE))
+		return syscall(SYS_clock_gettime, clock, ts);
+
+	const uint64_t tsc = clock_rdtsc();
+	if (tsc >= clock_params.tsc_valid_until || tsc < clock_params.tsc_base) {
+		if (sys_kvmserverguest_clock_calibrate(&clock_params, tsc) < 0) {
+			clock_disabled = 1;
+			return syscall(SYS_clock_gettime, clock, ts);
+		}
+	}
+	const int64_t elapsed = (int64_t)(((unsigned __int128)(tsc - clock_params.tsc_base) * clock_params.mult) >> 32);
+	int64_t ns;
+	if (realtime) {
+		ns = clock_params.real_base + elapsed;
+	} else {
+		/* Recalibration must never make the clock go backwards */
+		ns = clock_params.mono_base + elapsed;
+		if (ns < clock_last_mono)
+			ns = clock_last_mono;
+		else
+			clock_last_mono = ns;
+	}
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+	return 0;
+}
+#ifdef KVMSERVERGUEST_PRELOAD
+/* Only the preload build interposes the libc function */
+int clock_gettime(clockid_t clock, struct timespec* ts)
+	__attribute__((alias("kvmserverguest_clock_gettime")));
+#endif
+
 asm(".global sys_kvmserverguest_remote_resume\n"
 	".type sys_kvmserverguest_remote_resume, @function\n"
 	"sys_kvmserverguest_remote_resume:\n"
@@ -30,3 +124,45 @@ asm(".global sys_kvmserverguest_storage_wait_paused\n"
 	"   wrfsbase %rdi\n"
 	"	ret\n"
 	".cfi_endproc\n");
+
+asm(".global sys_kvmserverguest_persist_range\n"
+	".type sys_kvmserverguest_persist_range, @function\n"
+	"sys_kvmserverguest_persist_range:\n"
+	"	mov $0x10003, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n");
+
+asm(".global sys_kvmserverguest_cache_get\n"
+	".type sys_kvmserverguest_cache_get, @function\n"
+	"sys_kvmserverguest_cache_get:\n"
+	"	mov $0x10004, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n");
+
+asm(".global sys_kvmserverguest_cache_put\n"
+	".type sys_kvmserverguest_cache_put, @function\n"
+	"sys_kvmserverguest_cache_put:\n"
+	"	mov $0x10005, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n");
+
+asm(".global sys_kvmserverguest_cache_invalidate\n"
+	".type sys_kvmserverguest_cache_invalidate, @function\n"
+	"sys_kvmserverguest_cache_invalidate:\n"
+	"	mov $0x10006, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n");
+
+asm(".global sys_kvmserverguest_checkpoint\n"
+	".type sys_kvmserverguest_checkpoint, @function\n"
+	"sys_kvmserverguest_checkpoint:\n"
+	"	mov $0x10007, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n");
+
+asm(".global sys_kvmserverguest_clock_calibrate\n"
+	".type sys_kvmserverguest_clock_calibrate, @function\n"
+	"sys_kvmserverguest_clock_calibrate:\n"
+	"	mov $0x10008, %eax\n"
+	"	out %eax, $0\n"
+	"	ret\n");
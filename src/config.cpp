@@ -1,11 +1,14 @@
 #include "config.hpp"
 #include <CLI/CLI.hpp>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <limits.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <optional>
+#include <sstream>
 #include <linux/un.h>
 #include <thread>
 #include <unistd.h>
@@ -121,79 +124,124 @@ std::string lookup_program(const std::string& program)
 	throw CLI::ValidationError("program: Not an executable", program);
 }
 
+static NetworkAllowlist::PortRange parse_ports(const std::string& ports, const std::string& value)
+{
+	// A single port (0 meaning any port) or an inclusive range first-last
+	auto parse_port = [&](const std::string& port) -> uint16_t {
+		if (port.empty() || port.find_first_not_of("0123456789") != std::string::npos) {
+			throw CLI::ValidationError("Invalid port", value);
+		}
+		unsigned long parsed;
+		try {
+			parsed = std::stoul(port);
+		} catch (...) {
+			throw CLI::ValidationError("Invalid port", value);
+		}
+		if (parsed > std::numeric_limits<in_port_t>::max()) {
+			throw CLI::ValidationError("Invalid port", value);
+		}
+		return parsed;
+	};
+	const size_t dash = ports.find('-');
+	if (dash == std::string::npos) {
+		const uint16_t port = parse_port(ports);
+		if (port == 0) {
+			return NetworkAllowlist::PortRange{};
+		}
+		return NetworkAllowlist::PortRange{port, port};
+	}
+	const uint16_t first = parse_port(ports.substr(0, dash));
+	const uint16_t last = parse_port(ports.substr(dash + 1));
+	if (first > last) {
+		throw CLI::ValidationError("Invalid port range", value);
+	}
+	return NetworkAllowlist::PortRange{first, last};
+}
+
 static bool parse_addresses(
 	const std::vector<std::string>& config,
-	std::vector<struct sockaddr_storage>& allowed_ipv4,
-	std::vector<struct sockaddr_storage>& allowed_ipv6,
+	NetworkAllowlist& allowed,
 	const bool verbose
 ) {
 	for (const auto& value : config) {
 		if (value.empty() || value == "false") {
 			continue;
 		}
-		uint port = 0;
 		std::string address(value);
 		if (value == "true") {
 			address = "";
 		}
-		size_t maybe_colon = address.find_last_not_of("0123456789");
-		if (maybe_colon != std::string::npos && value[maybe_colon] == ':') {
-			uint parsed_port;
-			try {
-				port = std::stoul(address.substr(maybe_colon + 1, std::string::npos));
-			} catch (...) {
-				throw CLI::ValidationError("Invalid port", value);
-			}
-			address = address.substr(0, maybe_colon);
-		}
-
-		if (port > std::numeric_limits<in_port_t>::max()) {
-			throw CLI::ValidationError("Invalid port", value);
+		// Split off the port (range) after the last colon, unless the
+		// colon belongs to an IPv6 address
+		NetworkAllowlist::PortRange ports;
+		const size_t colon = address.rfind(':');
+		const size_t bracket = address.rfind(']');
+		if (colon != std::string::npos &&
+			(bracket != std::string::npos ? colon > bracket : address.find(':') == colon)) {
+			ports = parse_ports(address.substr(colon + 1), value);
+			address = address.substr(0, colon);
 		}
+		const bool any_port = ports.first == 0 && ports.last == std::numeric_limits<in_port_t>::max();
 
 		if (address == "") {
-			if (port == 0) {
-				allowed_ipv4.clear();
-				allowed_ipv6.clear();
-			}
-			auto& storage = allowed_ipv4.emplace_back((struct sockaddr_storage) {});
-			storage.ss_family = AF_INET;
-			reinterpret_cast<sockaddr_in*>(&storage)->sin_port = htons(port);
-			storage = allowed_ipv6.emplace_back((struct sockaddr_storage) {});
-			storage.ss_family = AF_INET6;
-			reinterpret_cast<sockaddr_in6*>(&storage)->sin6_port = htons(port);
-			if (port == 0) {
+			if (any_port) {
+				allowed.clear();
+				allowed.add_any(ports);
 				return true;
-			};
+			}
+			allowed.add_any(ports);
 			continue;
 		}
 
+		// Optional prefix length, e.g. 10.0.0.0/8 or [fd00::]/8
+		std::optional<unsigned> prefix_len;
+		const size_t slash = address.rfind('/');
+		if (slash != std::string::npos) {
+			const std::string prefix = address.substr(slash + 1);
+			if (prefix.empty() || prefix.size() > 3 || prefix.find_first_not_of("0123456789") != std::string::npos) {
+				throw CLI::ValidationError("Invalid prefix length", value);
+			}
+			prefix_len = std::stoul(prefix);
+			address = address.substr(0, slash);
+		}
+
 		// IPv6
-		if (address.front() == '[') {
-			if (address.back() != ']') {
-				throw CLI::ValidationError("Invalid ipv6 address", value);
+		const bool bracketed = address.front() == '[';
+		if (bracketed && address.back() != ']') {
+			throw CLI::ValidationError("Invalid ipv6 address", value);
+		}
+		in6_addr sin6_addr;
+		const std::string ipv6_address = bracketed ? address.substr(1, address.size() - 2) : address;
+		if (inet_pton(AF_INET6, ipv6_address.c_str(), &sin6_addr) > 0) {
+			if (prefix_len.value_or(128) > 128) {
+				throw CLI::ValidationError("Invalid IPv6 prefix length", value);
 			}
-			std::string new_address(address.substr(1, value.length() - 2));
-			auto& storage = allowed_ipv6.emplace_back((struct sockaddr_storage) {});
-			sockaddr_in6* addr = reinterpret_cast<sockaddr_in6*>(&storage);
-			addr->sin6_family = AF_INET6;
-			if (inet_pton(AF_INET6, new_address.c_str(), &addr->sin6_addr) <= 0) {
-				throw CLI::ValidationError("Invalid IPv6 address", value);
+			// The unspecified address allows every address
+			if (!prefix_len && IN6_IS_ADDR_UNSPECIFIED(&sin6_addr)) {
+				prefix_len = 0;
 			}
-			addr->sin6_port = htons(port);
+			allowed.add(AF_INET6, &sin6_addr, prefix_len.value_or(128), ports);
 			continue;
+		} else if (bracketed) {
+			throw CLI::ValidationError("Invalid IPv6 address", value);
 		}
 
 		// IPv4
 		in_addr sin_addr;
 		if (inet_pton(AF_INET, address.c_str(), &sin_addr) > 0) {
-			auto& storage = allowed_ipv4.emplace_back((struct sockaddr_storage) {});
-			sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(&storage);
-			addr->sin_family = AF_INET;
-			addr->sin_addr = sin_addr;
-			addr->sin_port = htons(port);
+			if (prefix_len.value_or(32) > 32) {
+				throw CLI::ValidationError("Invalid IPv4 prefix length", value);
+			}
+			// The unspecified address allows every address
+			if (!prefix_len && sin_addr.s_addr == INADDR_ANY) {
+				prefix_len = 0;
+			}
+			allowed.add(AF_INET, &sin_addr, prefix_len.value_or(32), ports);
 			continue;
 		}
+		if (prefix_len) {
+			throw CLI::ValidationError("Prefix length requires an IP address", value);
+		}
 
 		// Resolve the domain name to an IP address
 		struct addrinfo hints = {};
@@ -204,44 +252,136 @@ static bool parse_addresses(
 			throw CLI::ValidationError("Invalid domain name", value);
 		}
 		for (struct addrinfo* res = head; res != nullptr; res = res->ai_next) {
+			const void* addr;
 			if (res->ai_family == AF_INET) {
-				auto& storage = allowed_ipv4.emplace_back((struct sockaddr_storage) {});
-				sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(&storage);
-				addr->sin_family = AF_INET;
-				addr->sin_addr = reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr;
-				addr->sin_port = htons(port);
-				if (verbose) {
-					std::string found;
-					found.reserve(64);
-					inet_ntop(AF_INET, reinterpret_cast<void*>(&addr->sin_addr), found.data(), found.capacity());
-					printf("Resolved %s to %s\n", address.c_str(), found.c_str());
-				}
+				addr = &reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr;
+				allowed.add(AF_INET, addr, 32, ports);
 			} else if (res->ai_family == AF_INET6) {
-				auto& storage = allowed_ipv6.emplace_back((struct sockaddr_storage) {});
-				sockaddr_in6* addr = reinterpret_cast<sockaddr_in6*>(&storage);
-				addr->sin6_family = AF_INET6;
-				addr->sin6_addr = reinterpret_cast<sockaddr_in6*>(res->ai_addr)->sin6_addr;
-				addr->sin6_port = htons(port);
-				if (verbose) {
-					std::string found;
-					found.reserve(64);
-					inet_ntop(AF_INET6, reinterpret_cast<void*>(&addr->sin6_addr), found.data(), found.capacity());
-					printf("Resolved %s to %s\n", address.c_str(), found.c_str());
-				}
+				addr = &reinterpret_cast<sockaddr_in6*>(res->ai_addr)->sin6_addr;
+				allowed.add(AF_INET6, addr, 128, ports);
 			} else {
+				freeaddrinfo(head);
 				throw CLI::ValidationError("Invalid address family for domain", value);
 			}
+			if (verbose) {
+				char found[INET6_ADDRSTRLEN];
+				inet_ntop(res->ai_family, addr, found, sizeof(found));
+				printf("Resolved %s to %s\n", address.c_str(), found);
+			}
 		}
 		freeaddrinfo(head);
 	}
 	return false;
 }
 
+static void parse_upstreams(
+	const std::vector<std::string>& config,
+	std::vector<struct sockaddr_storage>& upstreams,
+	const bool verbose
+) {
+	for (const auto& value : config) {
+		// host:port or [ipv6]:port
+		const size_t colon = value.rfind(':');
+		if (colon == std::string::npos || colon == 0) {
+			throw CLI::ValidationError("Upstream requires host:port", value);
+		}
+		std::string host = value.substr(0, colon);
+		const std::string port = value.substr(colon + 1);
+		if (port.empty() || port.find_first_not_of("0123456789") != std::string::npos) {
+			throw CLI::ValidationError("Invalid port", value);
+		}
+		if (host.front() == '[' && host.back() == ']') {
+			host = host.substr(1, host.size() - 2);
+		}
+
+		struct addrinfo hints = {};
+		struct addrinfo* head;
+		hints.ai_family = AF_UNSPEC; // IPv4 or IPv6
+		hints.ai_socktype = SOCK_STREAM; // TCP
+		hints.ai_flags = AI_NUMERICSERV;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &head) != 0) {
+			throw CLI::ValidationError("Invalid upstream", value);
+		}
+		for (struct addrinfo* res = head; res != nullptr; res = res->ai_next) {
+			if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
+				continue;
+			struct sockaddr_storage addr {};
+			memcpy(&addr, res->ai_addr, res->ai_addrlen);
+			upstreams.push_back(addr);
+			if (verbose) {
+				char found[INET6_ADDRSTRLEN];
+				const void* inaddr = (res->ai_family == AF_INET)
+					? (const void*)&reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr
+					: (const void*)&reinterpret_cast<sockaddr_in6*>(res->ai_addr)->sin6_addr;
+				inet_ntop(res->ai_family, inaddr, found, sizeof(found));
+				printf("Pooling upstream %s as %s\n", value.c_str(), found);
+			}
+		}
+		freeaddrinfo(head);
+	}
+}
+
+/* A nameserver address with an optional port, e.g. 10.0.0.2, [::1]:53 or 127.0.0.1:5353 */
+static bool parse_nameserver(std::string address, struct sockaddr_storage& addr)
+{
+	unsigned long port = 53;
+	const size_t colon = address.rfind(':');
+	const size_t bracket = address.rfind(']');
+	if (colon != std::string::npos &&
+		(bracket != std::string::npos ? colon > bracket : address.find(':') == colon)) {
+		const std::string digits = address.substr(colon + 1);
+		if (digits.empty() || digits.size() > 5 || digits.find_first_not_of("0123456789") != std::string::npos) {
+			return false;
+		}
+		port = std::stoul(digits);
+		if (port == 0 || port > std::numeric_limits<in_port_t>::max()) {
+			return false;
+		}
+		address.resize(colon);
+	}
+	if (address.size() >= 2 && address.front() == '[' && address.back() == ']') {
+		address = address.substr(1, address.size() - 2);
+	}
+	// Scoped link-local addresses are not supported
+	addr = {};
+	auto& addr4 = reinterpret_cast<struct sockaddr_in&>(addr);
+	auto& addr6 = reinterpret_cast<struct sockaddr_in6&>(addr);
+	if (inet_pton(AF_INET, address.c_str(), &addr4.sin_addr) > 0) {
+		addr4.sin_family = AF_INET;
+		addr4.sin_port = htons(port);
+	} else if (inet_pton(AF_INET6, address.c_str(), &addr6.sin6_addr) > 0) {
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_port = htons(port);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static void parse_nameservers(
+	const std::filesystem::path& resolv_conf,
+	std::vector<struct sockaddr_storage>& nameservers
+) {
+	std::ifstream file(resolv_conf);
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream words(line);
+		std::string keyword, address;
+		if (!(words >> keyword >> address) || keyword != "nameserver") {
+			continue;
+		}
+		struct sockaddr_storage addr;
+		if (parse_nameserver(address, addr)) {
+			nameservers.push_back(addr);
+		}
+	}
+}
+
 static void ensure_path(
 	std::filesystem::path src,
 	std::filesystem::path dst,
 	std::map<std::filesystem::path, Configuration::VirtualPath, Configuration::ComparePathSegments>& allowed_paths,
-	bool readable, bool writable, bool symlink
+	bool readable, bool writable, bool symlink, bool scratch = false
 ) {
 	if (src.is_relative()) {
 		src = std::filesystem::current_path() / src;
@@ -260,6 +400,7 @@ static void ensure_path(
 			.readable = readable,
 			.writable = writable,
 			.symlink = symlink,
+			.scratch = scratch,
 		});
 		return;
 	}
@@ -274,6 +415,9 @@ static void ensure_path(
 	if (symlink) {
 		vpath.symlink = true;
 	}
+	if (scratch) {
+		vpath.scratch = true;
+	}
 }
 
 static void fake_path(
@@ -302,6 +446,9 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	std::vector<std::string> allow_net;
 	std::vector<std::string> allow_connect;
 	std::vector<std::string> allow_listen;
+	std::vector<std::string> upstream_pool;
+	std::vector<std::string> dns_nameservers;
+	std::vector<std::string> scratch;
 
 	CLI::App app{"kvmserver"};
 	app.set_config("-c,--config", "kvmserver.toml", "Read a toml file");
@@ -315,12 +462,23 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	app.add_option("-t,--threads", config.concurrency, "Number of request VMs (0 to use cpu count)")->capture_default_str();
 	app.add_flag("-e,--ephemeral", config.ephemeral, "Use ephemeral VMs");
 	auto& warmup = *app.add_option("-w,--warmup", config.warmup_connect_requests, "Number of warmup requests")->capture_default_str();
+	app.add_flag("--wait-for-checkpoint", config.wait_for_checkpoint, "Capture the program when it calls kvmserverguest_checkpoint()")->excludes(&warmup);
 
 	app.add_flag("-v,--verbose", config.verbose, "Enable verbose output")->group("Verbose");
 	app.add_flag("--verbose-syscalls", config.verbose_syscalls, "Enable verbose syscall output")->group("Verbose");
 	app.add_flag("--verbose-mmap-syscalls", config.verbose_mmap_syscalls, "Enable verbose mmap syscall output")->group("Verbose");
 	app.add_flag("--verbose-thread-syscalls", config.verbose_thread_syscalls, "Enable verbose thread syscall output")->group("Verbose");
 	app.add_flag("--verbose-pagetables", config.verbose_pagetable, "Enable verbose pagetable output")->group("Verbose");
+	app.add_option("--syscall-stats-interval", config.syscall_stats_interval, "Seconds between system call reports (0 to only report on SIGUSR1)")->capture_default_str()->group("Verbose");
+	const std::map<std::string, Logger::Level> log_levels {
+		{"error", Logger::Error}, {"warning", Logger::Warning}, {"info", Logger::Info}, {"debug", Logger::Debug},
+	};
+	app.add_option("--log-level", config.log_level, "Log messages up to this level (error, warning, info, debug)")
+		->transform(CLI::CheckedTransformer(log_levels, CLI::ignore_case))->group("Verbose");
+	app.add_option("--metrics-socket", config.metrics_socket, "Serve Prometheus metrics over HTTP on this unix socket")->group("Verbose");
+	app.add_option("--profile", config.profile_filename, "Sample the guest stacks of forked VMs into this file as folded stacks")->group("Verbose");
+	app.add_option("--profile-frequency", config.profile_frequency, "Samples per second per VM while profiling")->capture_default_str()->group("Verbose");
+	app.add_option("--trace-startup", config.trace_startup, "Write the startup phases of every thread to this file in Chrome trace format")->group("Verbose");
 
 	app.add_flag("--allow-all", [&](bool allow_all) {
 		if (allow_all) {
@@ -333,9 +491,10 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	app.add_flag("--allow-read{/}", allow_read, "Allow filesystem read access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 	app.add_flag("--allow-write{/}", allow_write, "Allow filesystem write access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 	app.add_flag("--allow-env{*}", allow_env, "Allow access to environment variables. Optionally specify accessible environment variables (e.g. --allow-env=USER,PATH,API_*).")->delimiter(',')->excludes("--allow-all")->group("Permissions");
-	app.add_flag("--allow-net", allow_net, "Allow network access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
+	app.add_flag("--allow-net", allow_net, "Allow network access. Optionally specify addresses, CIDR prefixes and port ranges (e.g. --allow-net=10.0.0.0/8:8000-8100,[::1]:443).")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 	app.add_flag("--allow-connect", allow_connect, "Allow outgoing network access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 	app.add_flag("--allow-listen", allow_listen, "Allow incoming network access")->delimiter(',')->excludes("--allow-all")->group("Permissions");
+	app.add_option("--scratch", scratch, "Writable paths backed by memory, discarded after each request")->delimiter(',')->group("Permissions");
 	app.add_flag("--volume", volume, "<host-path>:<guest-path>[:r?w?=r]")->delimiter(',')->excludes("--allow-all")->group("Permissions");
 
 	app.add_option("--max-boot-time", config.max_boot_time)->capture_default_str()->group("Advanced");
@@ -344,16 +503,31 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	app.add_option("--max-address-space", config.max_address_space)->capture_default_str()->group("Advanced");
 	app.add_option("--max-request-memory", config.max_req_mem)->capture_default_str()->group("Advanced");
 	app.add_option("--limit-request-memory", config.limit_req_mem)->capture_default_str()->group("Advanced");
+	app.add_option("--max-persistent-memory", config.max_persistent_mem)->capture_default_str()->group("Advanced");
 	app.add_option("--shared-memory", config.shared_memory)->capture_default_str()->group("Advanced");
+	app.add_option("--shared-cache-size", config.shared_cache_size, "Megabytes for the host-side cache shared by all VMs")->capture_default_str()->group("Advanced");
+	app.add_option("--open-file-cache", config.open_file_cache, "Number of read-only files kept open on the host for all VMs")->capture_default_str()->group("Advanced");
+	app.add_flag("--batch-client-writes", config.batch_client_writes, "Coalesce small writes to the client until the program makes another system call")->group("Advanced");
+	app.add_flag("--buffer-guest-output", config.buffer_guest_output, "Buffer what forked VMs write to stdout and stderr, and write it in batches")->group("Advanced");
+	app.add_flag("--prefix-guest-output", config.prefix_guest_output, "Prefix each line of buffered guest output with the VM and request number")->group("Advanced");
+	app.add_flag("--paravirt-clock", config.paravirt_clock, "Answer clock_gettime() in dynamic guests from the TSC, without leaving the VM")->group("Advanced");
+	app.add_flag("--dns-cache", config.dns_cache, "Cache DNS lookups to the nameservers in /etc/resolv.conf for all VMs")->group("Advanced");
+	app.add_option("--dns-nameserver", dns_nameservers, "Nameservers of --dns-cache instead of those in /etc/resolv.conf (e.g. 127.0.0.1:5353)")->delimiter(',')->group("Advanced");
+	app.add_option("--upstream-pool", upstream_pool, "Keep idle connections to these host:port upstreams across resets")->delimiter(',')->group("Advanced");
+	app.add_option("--upstream-pool-idle", config.upstream_pool_idle, "Idle connections kept per pooled upstream")->capture_default_str()->group("Advanced");
 	app.add_option("--heap-address-hint", config.heap_address_hint)->capture_default_str()->group("Advanced");
-	app.add_option("--hugepage-arena-size", config.hugepage_arena_size)->capture_default_str()->group("Advanced");
-	app.add_option("--hugepage-requests-arena", config.hugepage_requests_arena)->capture_default_str()->group("Advanced");
+	app.add_option("--hugepage-arena-size", config.hugepage_arena_size, "Megabytes of hugepages reserved for the main VM memory")->capture_default_str()->group("Advanced");
+	app.add_option("--hugepage-requests-arena", config.hugepage_requests_arena, "Megabytes of hugepages reserved by each request VM for its working memory")->capture_default_str()->group("Advanced");
 	app.add_flag("!--no-executable-heap", config.executable_heap)->capture_default_str()->group("Advanced");
 	app.add_flag("!--no-mmap-backed-files", config.mmap_backed_files)->group("Advanced");
-	app.add_flag("--hugepages", config.hugepages)->group("Advanced");
-	app.add_flag("!--no-split-hugepages", config.split_hugepages)->group("Advanced");
-	app.add_flag("--transparent-hugepages", config.transparent_hugepages)->group("Advanced");
+	app.add_flag("--hugepages", config.hugepages, "Back guest memory with hugepages where it is aligned")->group("Advanced");
+	app.add_flag("!--no-split-hugepages", config.split_hugepages, "Copy whole hugepages on write in request VMs instead of splitting them")->group("Advanced");
+	app.add_flag("--transparent-hugepages", config.transparent_hugepages, "Advise the kernel to back guest memory with transparent hugepages")->group("Advanced");
 	app.add_flag("!--no-ephemeral-keep-working-memory", config.ephemeral_keep_working_memory)->group("Advanced");
+	app.add_flag("--prefault-master", config.prefault_master, "Fault in all memory of the main VM at startup, before forking")->group("Advanced");
+	app.add_flag("--mlock-master", config.mlock_master, "Prefault and lock the memory of the main VM, so it is never reclaimed")->group("Advanced");
+	app.add_option("--memory-budget", config.memory_budget, "Release the working memory of idle ephemeral VMs when kvmserver uses more megabytes than this")->capture_default_str()->group("Advanced");
+	app.add_option("--memory-pressure", config.memory_pressure, "Release the working memory of idle ephemeral VMs when host memory pressure is above this percentage")->check(CLI::Range(0.0f, 100.0f))->capture_default_str()->group("Advanced");
 
 	// This allows ++ to be used as an escape from subcommand positionals.
 	app.add_subcommand("++", "")->silent()->group("")->fallthrough();
@@ -384,9 +558,29 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 		config.main_filename = lookup_program(config.main_filename);
 	});
 
+	// Run with the built-in load generator
+	auto &bench = *app.add_subcommand("bench", "Run and benchmark with the built-in HTTP load generator");
+	bench.excludes(&run);
+	bench.configurable();
+	bench.positionals_at_end();
+	bench.validate_positionals();
+	bench.add_option("program", config.main_filename, "Program")->required();
+	bench.add_option("args", config.main_arguments, "Program arguments")->check(!CLI::IsMember({"++"}));
+	bench.add_option("--connections", config.bench_connections, "Concurrent connections, each with its own thread")->capture_default_str()->check(CLI::Range(1, 4096));
+	bench.add_option("--duration", config.bench_duration, "Seconds to send requests for")->capture_default_str()->check(CLI::PositiveNumber);
+	bench.add_option("--rate", config.bench_rate, "Requests per second over all connections, 0 sends the next request when the response is complete")->capture_default_str();
+	bench.add_option("--path", config.bench_path, "Path to send requests to")->capture_default_str();
+	run_common(bench);
+	bench.callback([&]() {
+		if (bench.count() > 1) {
+			throw CLI::ValidationError("bench subcommand may only be called once");
+		}
+		config.bench = true;
+		config.main_filename = lookup_program(config.main_filename);
+	});
+
 	// Storage VM
 	auto &storage = *app.add_subcommand("storage", "Storage VM");
-	storage.needs(&run);
 	storage.configurable();
 	storage.positionals_at_end();
 	storage.validate_positionals();
@@ -406,6 +600,9 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 		if (storage.count() > 1) {
 			throw CLI::ValidationError("storage subcommand may only be used once");
 		}
+		if (run.count() == 0 && bench.count() == 0) {
+			throw CLI::ValidationError("storage subcommand requires run or bench");
+		}
 		config.storage = true;
 		config.storage_filename = lookup_program(config.storage_filename);
 	});
@@ -413,6 +610,7 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	// Create snapshot
 	auto &snapshot = *app.add_subcommand("snapshot", "Create snapshot");
 	snapshot.excludes(&run);
+	snapshot.excludes(&bench);
 	snapshot.excludes(&storage);
 	snapshot.configurable();
 	snapshot.positionals_at_end();
@@ -432,6 +630,7 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 	// Run snapshot
 	auto &snaprun = *app.add_subcommand("snaprun", "Run snapshot");
 	snaprun.excludes(&run);
+	snaprun.excludes(&bench);
 	snaprun.excludes(&snapshot);
 	snaprun.excludes(&storage);
 	snaprun.excludes(&warmup);
@@ -480,6 +679,13 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 			&_binary_libkvmserverguest_so_start,
 			&_binary_libkvmserverguest_so_end - &_binary_libkvmserverguest_so_start);
 		fake_path("/lib/libkvmserverguest.so", libkvmserverguest_so, config.allowed_paths);
+		if (config.paravirt_clock) {
+			extern const char _binary_libkvmserverguest_preload_so_start, _binary_libkvmserverguest_preload_so_end;
+			std::string_view libkvmserverguest_preload_so(
+				&_binary_libkvmserverguest_preload_so_start,
+				&_binary_libkvmserverguest_preload_so_end - &_binary_libkvmserverguest_preload_so_start);
+			fake_path("/lib/libkvmserverguest-preload.so", libkvmserverguest_preload_so, config.allowed_paths);
+		}
 
 		for (const std::string& triple : volume) {
 			auto parts = split(triple, ':');
@@ -519,6 +725,15 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 				ensure_path(src, dst, config.allowed_paths, r, w, false);
 			}
 		}
+		// Scratch paths are rewritten into the scratch directory of each VM
+		for (const std::string& path : scratch) {
+			ensure_path(path, path, config.allowed_paths, true, true, false, true);
+			config.scratch_paths.push_back(
+				(std::filesystem::absolute(path) / "").lexically_normal().parent_path());
+		}
+		if (!config.scratch_paths.empty()) {
+			config.scratch_root = "/dev/shm/kvmserver-" + std::to_string(getpid());
+		}
 		// Rewrite the path to the real path of the executable
 		// TODO: reverse map real to virtual.
 		ensure_path("/proc/self/exe", config.main_filename, config.allowed_paths, false, false, true);
@@ -552,30 +767,61 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 		) {
 			config.environ.emplace_back("USER=nobody");
 		}
+		if (config.prefix_guest_output) {
+			config.buffer_guest_output = true;
+		}
+		if (config.mlock_master) {
+			config.prefault_master = true;
+		}
+		if (config.paravirt_clock) {
+			// The preload build of the guest library interposes clock_gettime()
+			auto it = std::find_if(config.environ.begin(), config.environ.end(),
+				[](auto& value) { return value.starts_with("LD_PRELOAD="); });
+			if (it == config.environ.end()) {
+				config.environ.emplace_back("LD_PRELOAD=/lib/libkvmserverguest-preload.so");
+			} else {
+				*it += ":/lib/libkvmserverguest-preload.so";
+			}
+		}
 
 		bool skip_allow_connect_listen = parse_addresses(
 			allow_net,
-			config.allowed_connect_ipv4,
-			config.allowed_connect_ipv6,
+			config.allowed_connect,
 			config.verbose
 		);
-		config.allowed_listen_ipv4 = config.allowed_connect_ipv4;
-		config.allowed_listen_ipv6 = config.allowed_connect_ipv6;
+		config.allowed_listen = config.allowed_connect;
 		if (!skip_allow_connect_listen) {
 			parse_addresses(
 				allow_connect,
-				config.allowed_connect_ipv4,
-				config.allowed_connect_ipv6,
+				config.allowed_connect,
 				config.verbose
 			);
 			parse_addresses(
 				allow_listen,
-				config.allowed_listen_ipv4,
-				config.allowed_listen_ipv6,
+				config.allowed_listen,
 				config.verbose
 			);
 		}
 
+		parse_upstreams(upstream_pool, config.upstream_pool, config.verbose);
+		for (const auto& value : dns_nameservers) {
+			struct sockaddr_storage addr;
+			if (!parse_nameserver(value, addr)) {
+				throw CLI::ValidationError("Invalid nameserver", value);
+			}
+			config.dns_nameservers.push_back(addr);
+		}
+		if (config.dns_cache && config.dns_nameservers.empty()) {
+			parse_nameservers("/etc/resolv.conf", config.dns_nameservers);
+			if (config.dns_nameservers.empty()) {
+				throw CLI::ValidationError("--dns-cache", "No nameservers found in /etc/resolv.conf");
+			}
+		}
+
+		if ((config.memory_budget != 0 || config.memory_pressure > 0.0f) && !config.ephemeral) {
+			throw CLI::ValidationError("--memory-budget", "Only the working memory of ephemeral VMs is released, use --ephemeral");
+		}
+
 		// The address space must at least be as large as the main memory
 		config.max_address_space = std::max(config.max_address_space, config.max_main_memory);
 
@@ -584,9 +830,14 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
 		config.max_main_memory = config.max_main_memory * (1ULL << 20);
 		config.max_req_mem = config.max_req_mem * (1UL << 20);
 		config.limit_req_mem = config.limit_req_mem * (1UL << 20);
+		config.max_persistent_mem = config.max_persistent_mem * (1UL << 20);
 		config.shared_memory = config.shared_memory * (1UL << 20);
+		config.shared_cache_size = config.shared_cache_size * (1UL << 20);
 		config.dylink_address_hint = config.dylink_address_hint * (1UL << 20);
 		config.heap_address_hint = config.heap_address_hint * (1UL << 20);
+		config.hugepage_arena_size = config.hugepage_arena_size * (1ULL << 20);
+		config.hugepage_requests_arena = config.hugepage_requests_arena * (1ULL << 20);
+		config.memory_budget = config.memory_budget * (1ULL << 20);
 	});
 
 	try {
@@ -595,6 +846,10 @@ Configuration Configuration::FromArgs(int argc, char* argv[])
     std::exit(app.exit(e));
 	}
 
+	if (app.count("--log-level") == 0 && (config.verbose || config.verbose_syscalls)) {
+		config.log_level = Logger::Debug;
+	}
+
 	if (*print_config) {
 		std::cout<<app.config_to_str(false, true);
 		std::exit(0);
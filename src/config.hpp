@@ -1,8 +1,9 @@
 #pragma once
 #include <filesystem>
 #include <map>
+#include "logger.hpp"
+#include "network_allowlist.hpp"
 #include <string>
-#include <sys/socket.h> // for sockaddr_storage
 #include <tinykvm/common.hpp>
 #include <vector>
 
@@ -16,6 +17,11 @@ struct Configuration
 	uint16_t warmup_connect_requests = 0; /* Warmup requests, individual connections */
 	uint16_t warmup_intra_connect_requests = 1; /* Send N requests while connected */
 	std::string warmup_path = "/"; /* Path to send requests to */
+	bool     bench = false; /* Run the built-in load generator against the program */
+	uint32_t bench_connections = 16;
+	float    bench_duration = 10.0f; /* Seconds */
+	uint32_t bench_rate = 0; /* Requests per second, or 0 for a closed loop */
+	std::string bench_path = "/";
 
 	float    max_boot_time = 20.0f; /* Seconds */
 	float    max_req_time  = 8.0f; /* Seconds */
@@ -24,12 +30,23 @@ struct Configuration
 	uint64_t max_main_memory = 8 * 1024; /* Megabytes */
 	uint32_t max_req_mem   = 128; /* Megabytes of memory for request VMs */
 	uint32_t limit_req_mem = 128; /* Megabytes to keep after request */
+	uint32_t max_persistent_mem = 16; /* Megabytes of guest memory kept across resets */
 	uint32_t shared_memory = 0; /* Megabytes */
+	uint32_t shared_cache_size = 0; /* Megabytes for the host-side shared cache */
+	uint32_t open_file_cache = 0; /* Read-only files kept open on the host */
+	uint32_t syscall_stats_interval = 0; /* Seconds between system call reports */
+	std::string metrics_socket; /* Unix socket serving Prometheus metrics */
+	std::string profile_filename; /* Folded guest stacks of forked VMs */
+	uint32_t profile_frequency = 99; /* Samples per second per VM */
+	std::string trace_startup; /* Chrome trace of the startup phases */
+	uint32_t upstream_pool_idle = 8; /* Idle connections kept per pooled upstream */
 	uint64_t dylink_address_hint = 2; /* Image base address hint */
 	uint64_t heap_address_hint = 256; /* Address hint for the heap */
 	uint64_t storage_dylink_address_hint = 0x2000200000; /* Image base address hint for storage VMs */
-	uint64_t hugepage_arena_size = 0; /* Megabytes */
-	uint64_t hugepage_requests_arena = 0; /* Megabytes */
+	uint64_t hugepage_arena_size = 0; /* Megabytes for the main VM */
+	uint64_t hugepage_requests_arena = 0; /* Megabytes for each request VM */
+	uint64_t memory_budget = 0; /* Megabytes of resident memory before idle forks are trimmed */
+	float    memory_pressure = 0.0f; /* Host memory pressure (%) before idle forks are trimmed */
 	bool     storage = false; /* Enable a single non-ephemeral storage VM */
 	bool     storage_1_to_1 = false; /* Each request VM gets its own storage VM */
 	bool     storage_ipre_permanent = false; /* Permanent IPRE resume */
@@ -40,11 +57,20 @@ struct Configuration
 	bool     transparent_hugepages = false;
 	bool     ephemeral = false;
 	bool     ephemeral_keep_working_memory = true;
+	bool     prefault_master = false; /* Fault in the main VM memory before forking */
+	bool     mlock_master = false; /* Also keep it from being reclaimed */
+	bool     batch_client_writes = false; /* Coalesce small writes to the client */
+	bool     buffer_guest_output = false; /* Write stdout and stderr of forks in batches */
+	bool     prefix_guest_output = false; /* Prefix each line with the VM and request */
+	bool     dns_cache = false; /* Cache UDP DNS lookups on the host */
+	bool     paravirt_clock = false; /* Answer clock_gettime() inside the guest */
+	bool     wait_for_checkpoint = false; /* Fork only after the guest calls checkpoint */
 	bool     verbose = false;
 	bool     verbose_syscalls = false;
 	bool     verbose_mmap_syscalls = false;
 	bool     verbose_thread_syscalls = false;
 	bool     verbose_pagetable = false;
+	Logger::Level log_level = Logger::Info; /* Debug with --verbose */
 
 	std::vector<std::string> environ;
 	std::vector<std::string> main_arguments;
@@ -71,23 +97,26 @@ struct Configuration
 		bool readable = false;
 		bool writable = false;
 		bool symlink = false; /* Treated as a symlink path, to be resolved */
+		bool scratch = false; /* Backed by a per-VM directory, wiped on reset */
 	};
 
 	friend std::ostream& operator<<(std::ostream& os, const VirtualPath& v) {
 		os<< "VirtualPath{ .real_path=" << v.real_path
 			<< ", .virtual_path=" << v.virtual_path
-			<< ", " << (v.readable ? "r": "") << (v.writable ? "w": "") << (v.symlink ? "s": "")
+			<< ", " << (v.readable ? "r": "") << (v.writable ? "w": "") << (v.symlink ? "s": "") << (v.scratch ? "t": "")
 			<< " }";
     return os;
 	}
 
 	std::map<std::filesystem::path, VirtualPath, ComparePathSegments> allowed_paths;
 	std::string current_working_directory;
+	std::vector<std::filesystem::path> scratch_paths;
+	std::string scratch_root; /* Holds the scratch directory of each VM */
 
-	std::vector<struct sockaddr_storage> allowed_connect_ipv4;
-	std::vector<struct sockaddr_storage> allowed_listen_ipv4;
-	std::vector<struct sockaddr_storage> allowed_connect_ipv6;
-	std::vector<struct sockaddr_storage> allowed_listen_ipv6;
+	NetworkAllowlist allowed_connect;
+	NetworkAllowlist allowed_listen;
+	std::vector<struct sockaddr_storage> upstream_pool;
+	std::vector<struct sockaddr_storage> dns_nameservers; /* From --dns-nameserver or /etc/resolv.conf */
 
 	static Configuration FromArgs(int argc, char* argv[]);
 };
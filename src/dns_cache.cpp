@@ -0,0 +1,393 @@
+#include "dns_cache.hpp"
+#include "settings.hpp"
+#include "sockaddr.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+static constexpr size_t DNS_HEADER_SIZE = 12;
+static constexpr size_t DNS_MAX_MESSAGE = 65535;
+static constexpr size_t DNS_MAX_PENDING = 4096;
+static constexpr uint16_t DNS_TYPE_SOA = 6;
+static constexpr uint16_t DNS_TYPE_OPT = 41;
+static constexpr auto DNS_QUERY_TIMEOUT = std::chrono::seconds(5);
+
+static uint16_t read16(const std::string& msg, size_t off)
+{
+	return uint16_t(uint8_t(msg[off]) << 8 | uint8_t(msg[off + 1]));
+}
+static void write16(std::string& msg, size_t off, uint16_t value)
+{
+	msg[off] = char(value >> 8);
+	msg[off + 1] = char(value);
+}
+static uint32_t read32(const std::string& msg, size_t off)
+{
+	return uint32_t(read16(msg, off)) << 16 | read16(msg, off + 2);
+}
+static void write32(std::string& msg, size_t off, uint32_t value)
+{
+	write16(msg, off, value >> 16);
+	write16(msg, off + 2, value);
+}
+
+/* Returns the offset after a possibly compressed name, or 0 if malformed */
+static size_t skip_name(const std::string& msg, size_t off)
+{
+	while (off < msg.size()) {
+		const uint8_t len = msg[off];
+		if ((len & 0xC0) == 0xC0)
+			return (off + 2 <= msg.size()) ? off + 2 : 0;
+		if (len & 0xC0)
+			return 0;
+		if (len == 0)
+			return off + 1;
+		off += 1 + len;
+	}
+	return 0;
+}
+
+/* Returns the length of the single question, including type and class, or 0 */
+static size_t question_length(const std::string& msg)
+{
+	if (msg.size() < DNS_HEADER_SIZE || read16(msg, 4) != 1)
+		return 0;
+	const size_t end = skip_name(msg, DNS_HEADER_SIZE);
+	if (end == 0 || end + 4 > msg.size())
+		return 0;
+	return end + 4 - DNS_HEADER_SIZE;
+}
+
+/* The question with the name lowercased, as sent with 0x20 randomization */
+static std::string lowercase_question(const std::string& msg, size_t qlen)
+{
+	std::string question = msg.substr(DNS_HEADER_SIZE, qlen);
+	for (size_t i = 0; i < qlen - 4; i++) {
+		if (question[i] >= 'A' && question[i] <= 'Z')
+			question[i] += 'a' - 'A';
+	}
+	return question;
+}
+
+/* Calls func(type, ttl_offset) for every resource record. False if malformed.
+   The record data follows the TTL and its 16-bit length, within the message. */
+template <typename Func>
+static bool for_each_record(const std::string& msg, size_t qlen, Func func)
+{
+	const unsigned records = read16(msg, 6) + read16(msg, 8) + read16(msg, 10);
+	size_t off = DNS_HEADER_SIZE + qlen;
+	for (unsigned i = 0; i < records; i++) {
+		off = skip_name(msg, off);
+		if (off == 0 || off + 10 > msg.size())
+			return false;
+		const size_t next = off + 10 + read16(msg, off + 8);
+		if (next > msg.size())
+			return false;
+		func(read16(msg, off), off + 4);
+		off = next;
+	}
+	return true;
+}
+
+/* Removes the options, such as cookies, from the OPT record of a message */
+static void strip_edns_options(std::string& msg, size_t qlen)
+{
+	size_t rdlength_off = 0;
+	for_each_record(msg, qlen, [&] (uint16_t type, size_t ttl_off) {
+		if (type == DNS_TYPE_OPT)
+			rdlength_off = ttl_off + 4;
+	});
+	if (rdlength_off != 0) {
+		msg.erase(rdlength_off + 2, read16(msg, rdlength_off));
+		write16(msg, rdlength_off, 0);
+	}
+}
+
+DnsCache::DnsCache(const std::vector<struct sockaddr_storage>& nameservers, bool verbose)
+	: m_rng(std::random_device{}()), m_verbose(verbose)
+{
+	m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (m_wakeup_fd < 0) {
+		throw std::runtime_error("DNS cache: " + std::string(strerror(errno)));
+	}
+	for (const auto& addr : nameservers)
+	{
+		Nameserver& ns = m_nameservers.emplace_back();
+		ns.addr = addr;
+		struct sockaddr_storage local = loopback_address(addr.ss_family);
+		ns.local_fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		ns.upstream_fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (ns.local_fd < 0 || ns.upstream_fd < 0 ||
+			bind(ns.local_fd, reinterpret_cast<struct sockaddr*>(&local), address_length(local)) < 0 ||
+			connect(ns.upstream_fd, reinterpret_cast<const struct sockaddr*>(&addr), address_length(addr)) < 0) {
+			throw std::runtime_error("DNS cache: nameserver socket: " + std::string(strerror(errno)));
+		}
+		socklen_t len = sizeof(ns.local_addr);
+		getsockname(ns.local_fd, reinterpret_cast<struct sockaddr*>(&ns.local_addr), &len);
+	}
+	m_thread = std::thread(&DnsCache::resolver_loop, this);
+}
+
+DnsCache::~DnsCache()
+{
+	m_stop = true;
+	const uint64_t one = 1;
+	if (write(m_wakeup_fd, &one, sizeof(one)) < 0) {
+		perror("DNS cache: wakeup");
+	}
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	for (auto& ns : m_nameservers) {
+		close(ns.local_fd);
+		close(ns.upstream_fd);
+	}
+	close(m_wakeup_fd);
+}
+
+bool DnsCache::restore_source(struct sockaddr_storage& addr) const
+{
+	for (const auto& ns : m_nameservers) {
+		if (same_address(addr, ns.local_addr)) {
+			memcpy(&addr, &ns.addr, address_length(ns.addr));
+			return true;
+		}
+	}
+	return false;
+}
+
+bool DnsCache::redirect(int fd, struct sockaddr_storage& addr) const
+{
+	for (const auto& ns : m_nameservers) {
+		if (same_address(addr, ns.addr)) {
+			// Only UDP lookups are cached, TCP goes straight to the nameserver
+			int type = 0;
+			socklen_t len = sizeof(type);
+			if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_DGRAM)
+				return false;
+			memcpy(&addr, &ns.local_addr, address_length(ns.local_addr));
+			return true;
+		}
+	}
+	return false;
+}
+
+void DnsCache::resolver_loop()
+{
+	std::vector<struct pollfd> fds;
+	fds.push_back({m_wakeup_fd, POLLIN, 0});
+	for (const auto& ns : m_nameservers) {
+		fds.push_back({ns.local_fd, POLLIN, 0});
+		fds.push_back({ns.upstream_fd, POLLIN, 0});
+	}
+	std::string buffer(DNS_MAX_MESSAGE, '\0');
+
+	while (!m_stop)
+	{
+		const int n = poll(fds.data(), fds.size(), 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("DNS cache: poll");
+			return;
+		}
+		for (size_t ns = 0; ns < m_nameservers.size(); ns++) {
+			if (fds[1 + ns * 2].revents & POLLIN) {
+				struct sockaddr_storage client;
+				socklen_t client_len = sizeof(client);
+				ssize_t len;
+				while ((len = recvfrom(m_nameservers[ns].local_fd, buffer.data(), buffer.size(), 0,
+						reinterpret_cast<struct sockaddr*>(&client), &client_len)) >= 0) {
+					handle_query(ns, buffer.data(), len, client, client_len);
+					client_len = sizeof(client);
+				}
+			}
+			if (fds[2 + ns * 2].revents & POLLIN) {
+				ssize_t len;
+				while ((len = recv(m_nameservers[ns].upstream_fd, buffer.data(), buffer.size(), 0)) >= 0) {
+					handle_response(ns, std::string(buffer.data(), len));
+				}
+			}
+		}
+		expire_pending();
+	}
+}
+
+void DnsCache::handle_query(size_t ns, const char* data, size_t len,
+	const struct sockaddr_storage& client, socklen_t client_len)
+{
+	std::string query(data, len);
+	const size_t qlen = question_length(query);
+	if (qlen == 0 || (read16(query, 2) & 0x8000) != 0) {
+		return; // Not a query with one question
+	}
+	const uint16_t flags = read16(query, 2);
+	// Standard queries without answers are cached, keyed on the question,
+	// the RD and CD flags and the EDNS header. EDNS options, such as
+	// cookies, differ between identical queries and are left out.
+	std::string key;
+	if ((flags & 0x7800) == 0 && read16(query, 6) == 0 && read16(query, 8) == 0) {
+		key = lowercase_question(query, qlen);
+		key += char((flags >> 8) & 0x01); // RD
+		key += char(flags & 0x10);        // CD
+		bool other_records = false;
+		const bool valid = for_each_record(query, qlen, [&] (uint16_t type, size_t ttl_off) {
+			if (type == DNS_TYPE_OPT) {
+				key.append(query, ttl_off - 2, 6); // UDP size, extended RCODE, version and flags
+			} else {
+				other_records = true;
+			}
+		});
+		if (!valid || other_records) {
+			key.clear(); // Such as signed queries
+		}
+	}
+	const uint16_t client_id = read16(query, 0);
+	const Nameserver& nameserver = m_nameservers[ns];
+
+	if (!key.empty()) {
+		auto it = m_entries.find(key);
+		if (it != m_entries.end()) {
+			const auto now = clock_type::now();
+			if (now < it->second.expires) {
+				std::string response = it->second.response;
+				const uint32_t elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - it->second.stored).count();
+				write16(response, 0, client_id);
+				response.replace(DNS_HEADER_SIZE, qlen, query, DNS_HEADER_SIZE, qlen);
+				for_each_record(response, qlen, [&] (uint16_t type, size_t ttl_off) {
+					if (type != DNS_TYPE_OPT) {
+						const uint32_t ttl = read32(response, ttl_off);
+						write32(response, ttl_off, (ttl > elapsed) ? ttl - elapsed : 0);
+					}
+				});
+				sendto(nameserver.local_fd, response.data(), response.size(), 0,
+					reinterpret_cast<const struct sockaddr*>(&client), client_len);
+				return;
+			}
+			m_entries.erase(it);
+		}
+		// Share the lookup already in flight
+		auto pit = m_pending_keys.find(key);
+		if (pit != m_pending_keys.end()) {
+			m_pending[pit->second].waiters.push_back(Waiter{client, client_len, client_id, query.substr(DNS_HEADER_SIZE, qlen)});
+			return;
+		}
+	}
+	if (m_pending.size() >= DNS_MAX_PENDING) {
+		return; // The resolver in the guest will retry
+	}
+
+	uint16_t id;
+	do {
+		id = m_rng();
+	} while (m_pending.count(id) != 0);
+	write16(query, 0, id);
+	if (send(nameserver.upstream_fd, query.data(), query.size(), 0) < 0) {
+		if (m_verbose) {
+			fprintf(stderr, "DNS cache: send failed: %s\n", strerror(errno));
+		}
+		return;
+	}
+	Pending& pending = m_pending[id];
+	pending.nameserver = ns;
+	pending.key = key;
+	pending.question = lowercase_question(query, qlen);
+	pending.waiters.push_back(Waiter{client, client_len, client_id, query.substr(DNS_HEADER_SIZE, qlen)});
+	pending.sent = clock_type::now();
+	if (!key.empty()) {
+		m_pending_keys.emplace(std::move(key), id);
+	}
+}
+
+void DnsCache::handle_response(size_t ns, std::string response)
+{
+	const size_t qlen = question_length(response);
+	if (qlen == 0 || (read16(response, 2) & 0x8000) == 0) {
+		return;
+	}
+	auto it = m_pending.find(read16(response, 0));
+	if (it == m_pending.end() || it->second.nameserver != ns ||
+		lowercase_question(response, qlen) != it->second.question) {
+		return; // Unsolicited, late or spoofed
+	}
+	Pending pending = std::move(it->second);
+	m_pending.erase(it);
+	if (!pending.key.empty()) {
+		m_pending_keys.erase(pending.key);
+		// Shared answers must not carry the options of one query
+		strip_edns_options(response, qlen);
+	}
+
+	for (const auto& waiter : pending.waiters) {
+		std::string reply = response;
+		write16(reply, 0, waiter.id);
+		reply.replace(DNS_HEADER_SIZE, qlen, waiter.question);
+		sendto(m_nameservers[ns].local_fd, reply.data(), reply.size(), 0,
+			reinterpret_cast<const struct sockaddr*>(&waiter.client), waiter.client_len);
+	}
+	if (!pending.key.empty()) {
+		store(pending.key, response);
+	}
+}
+
+void DnsCache::store(const std::string& key, const std::string& response)
+{
+	const uint16_t flags = read16(response, 2);
+	const uint16_t rcode = flags & 0xF;
+	if ((flags & 0x0200) != 0 || (rcode != 0 && rcode != 3)) {
+		return; // Truncated or failed
+	}
+	// The smallest TTL decides. Negative answers use their SOA record,
+	// and the smaller of its TTL and MINIMUM field (RFC 2308).
+	const size_t qlen = question_length(response);
+	const bool negative = read16(response, 6) == 0;
+	uint32_t ttl = settings::DNS_CACHE_MAX_TTL;
+	bool has_records = false;
+	const bool valid = for_each_record(response, qlen, [&] (uint16_t type, size_t ttl_off) {
+		if (type != DNS_TYPE_OPT) {
+			ttl = std::min(ttl, read32(response, ttl_off));
+			has_records = true;
+		}
+		const uint16_t rdlength = read16(response, ttl_off + 4);
+		if (type == DNS_TYPE_SOA && negative && rdlength >= 20) {
+			ttl = std::min(ttl, read32(response, ttl_off + 6 + rdlength - 4));
+		}
+	});
+	if (!valid || !has_records || ttl == 0) {
+		return;
+	}
+
+	const auto now = clock_type::now();
+	if (m_entries.size() >= settings::DNS_CACHE_MAX_ENTRIES) {
+		std::erase_if(m_entries, [&] (const auto& entry) {
+			return now >= entry.second.expires;
+		});
+		if (m_entries.size() >= settings::DNS_CACHE_MAX_ENTRIES) {
+			m_entries.erase(m_entries.begin());
+		}
+	}
+	m_entries.insert_or_assign(key, Entry{response, now, now + std::chrono::seconds(ttl)});
+	if (m_verbose) {
+		printf("DNS cache: stored answer for %zu seconds (%zu entries)\n", size_t(ttl), m_entries.size());
+	}
+}
+
+void DnsCache::expire_pending()
+{
+	const auto now = clock_type::now();
+	for (auto it = m_pending.begin(); it != m_pending.end(); ) {
+		if (now - it->second.sent >= DNS_QUERY_TIMEOUT) {
+			if (!it->second.key.empty()) {
+				m_pending_keys.erase(it->second.key);
+			}
+			it = m_pending.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
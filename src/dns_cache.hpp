@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A DNS resolution cache shared by all VMs. Connected UDP sockets to
+ * a known nameserver are redirected to a local port, where queries are
+ * answered from the cache with decremented TTLs. Misses are forwarded
+ * to the nameserver, and identical queries in flight share one lookup.
+ * The guest sees replies as coming from the nameserver it connected to.
+**/
+struct DnsCache
+{
+	/* Rewrites addr to the cache when fd is a UDP socket to a known nameserver */
+	bool redirect(int fd, struct sockaddr_storage& addr) const;
+	/* Rewrites addr to the nameserver when it is the local address of the cache */
+	bool restore_source(struct sockaddr_storage& addr) const;
+
+	DnsCache(const std::vector<struct sockaddr_storage>& nameservers, bool verbose);
+	~DnsCache();
+
+private:
+	using clock_type = std::chrono::steady_clock;
+	struct Nameserver {
+		struct sockaddr_storage addr;
+		struct sockaddr_storage local_addr;
+		int local_fd = -1;    // Receives queries from VMs
+		int upstream_fd = -1; // Connected to the nameserver
+	};
+	struct Entry {
+		std::string response;
+		clock_type::time_point stored;
+		clock_type::time_point expires;
+	};
+	struct Waiter {
+		struct sockaddr_storage client;
+		socklen_t client_len;
+		uint16_t id;
+		std::string question; // As sent, to preserve its letter case
+	};
+	struct Pending {
+		size_t nameserver;
+		std::string key; // Empty when the query is not cacheable
+		std::string question;
+		std::vector<Waiter> waiters;
+		clock_type::time_point sent;
+	};
+
+	void resolver_loop();
+	void handle_query(size_t ns, const char* query, size_t len,
+		const struct sockaddr_storage& client, socklen_t client_len);
+	void handle_response(size_t ns, std::string response);
+	void store(const std::string& key, const std::string& response);
+	void expire_pending();
+
+	std::vector<Nameserver> m_nameservers;
+	std::unordered_map<std::string, Entry> m_entries;
+	std::unordered_map<uint16_t, Pending> m_pending; // By upstream query ID
+	std::unordered_map<std::string, uint16_t> m_pending_keys;
+	std::mt19937 m_rng;
+	const bool m_verbose;
+	int m_wakeup_fd = -1;
+	std::atomic<bool> m_stop = false;
+	std::thread m_thread;
+};
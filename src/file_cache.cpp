@@ -0,0 +1,100 @@
+#include "file_cache.hpp"
+
+#include <fcntl.h>
+#include <mutex>
+#include <unistd.h>
+static constexpr auto FILE_CACHE_REVALIDATE = std::chrono::seconds(1);
+static constexpr auto FILE_CACHE_RETIRE_DELAY = std::chrono::seconds(10);
+
+FileCache::~FileCache()
+{
+	for (auto& [path, entry] : m_files) {
+		close(entry.fd);
+	}
+	for (auto& retired : m_retired) {
+		close(retired.fd);
+	}
+}
+
+bool FileCache::same_file(const struct stat& a, const struct stat& b) noexcept
+{
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size
+		&& a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec
+		&& a.st_ctim.tv_sec == b.st_ctim.tv_sec && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+void FileCache::retire(int fd, clock_type::time_point now)
+{
+	std::erase_if(m_retired, [&] (const Retired& retired) {
+		if (now - retired.when < FILE_CACHE_RETIRE_DELAY)
+			return false;
+		close(retired.fd);
+		return true;
+	});
+	m_retired.push_back(Retired{fd, now});
+}
+
+bool FileCache::substitute(std::string& path)
+{
+	const auto now = clock_type::now();
+	{
+		std::shared_lock lock(m_mtx);
+		auto it = m_files.find(path);
+		if (it != m_files.end() && now - it->second.validated < FILE_CACHE_REVALIDATE) {
+			path = it->second.proc_path;
+			return true;
+		}
+	}
+
+	// Revalidate or open the file outside of the lock
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+		return false; // The real open reports any error
+	}
+	{
+		std::unique_lock lock(m_mtx);
+		auto it = m_files.find(path);
+		if (it != m_files.end()) {
+			if (same_file(it->second.st, st)) {
+				it->second.validated = now;
+				path = it->second.proc_path;
+				return true;
+			}
+			retire(it->second.fd, now);
+			m_files.erase(it);
+		}
+	}
+	// O_NONBLOCK avoids hanging on a FIFO that replaced the file
+	const int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+
+	std::unique_lock lock(m_mtx);
+	auto it = m_files.find(path);
+	if (it != m_files.end()) {
+		close(fd); // Another VM opened it first
+		it->second.validated = now;
+		path = it->second.proc_path;
+		return true;
+	}
+	if (m_files.size() >= m_max_files) {
+		auto victim = m_files.begin();
+		retire(victim->second.fd, now);
+		m_files.erase(victim);
+	}
+	Entry entry {
+		.fd = fd,
+		.proc_path = "/proc/self/fd/" + std::to_string(fd),
+		.st = st,
+		.validated = now,
+	};
+	std::string proc_path = entry.proc_path;
+	m_files.emplace(std::move(path), std::move(entry));
+	path = std::move(proc_path);
+	return true;
+}
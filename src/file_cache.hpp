@@ -0,0 +1,46 @@
+#pragma once
+#include <chrono>
+#include <shared_mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Read-only files kept open on the host and shared by all VMs. A guest
+ * open of a cached file is redirected to /proc/self/fd/N, which gives
+ * the guest its own file description without a path walk of the real
+ * file system. Entries are revalidated with stat() at most once per
+ * second, and replaced when the file changed.
+**/
+struct FileCache
+{
+	/* Rewrites a resolved real path to its cached descriptor.
+	   Returns false when the path is not a regular file. */
+	bool substitute(std::string& path);
+
+	FileCache(size_t max_files) : m_max_files(max_files) {}
+	~FileCache();
+
+private:
+	using clock_type = std::chrono::steady_clock;
+	struct Entry {
+		int fd;
+		std::string proc_path;
+		struct stat st;
+		clock_type::time_point validated;
+	};
+	struct Retired {
+		int fd;
+		clock_type::time_point when;
+	};
+	static bool same_file(const struct stat& a, const struct stat& b) noexcept;
+	void retire(int fd, clock_type::time_point now);
+
+	mutable std::shared_mutex m_mtx;
+	std::unordered_map<std::string, Entry> m_files;
+	// Descriptors are closed a while after they were replaced, as a
+	// guest may still be about to open the path handed out earlier
+	std::vector<Retired> m_retired;
+	const size_t m_max_files;
+};
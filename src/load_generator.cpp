@@ -0,0 +1,319 @@
+#include "load_generator.hpp"
+
+#include "settings.hpp"
+#include "syscall_stats.hpp"
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <strings.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+
+LoadGenerator::LoadGenerator(const struct sockaddr_storage& addr, socklen_t addrlen, Options options)
+	: m_addr(addr), m_addrlen(addrlen), m_options(std::move(options)),
+	  m_request("GET " + m_options.path + " HTTP/1.1\r\nHost: localhost\r\nUser-Agent: kvmserver-bench\r\n\r\n")
+{
+}
+
+int LoadGenerator::connect_socket() const
+{
+	const int fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	const struct timeval timeout { settings::BENCH_IO_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (connect(fd, reinterpret_cast<const struct sockaddr*>(&m_addr), m_addrlen) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Receive more of the response, false when the connection ended */
+static bool fill(int fd, std::string& buffer)
+{
+	char data[16384];
+	while (true) {
+		const ssize_t len = recv(fd, data, sizeof(data), 0);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0 || buffer.size() + len > settings::BENCH_MAX_RESPONSE) {
+			return false;
+		}
+		buffer.append(data, len);
+		return true;
+	}
+}
+
+static bool header_is(std::string_view headers, const char* name, const char* value)
+{
+	const size_t name_len = strlen(name);
+	size_t line = headers.find("\r\n");
+	while (line != std::string_view::npos && line + 2 < headers.size()) {
+		const size_t start = line + 2;
+		line = headers.find("\r\n", start);
+		const std::string_view header = headers.substr(start, line - start);
+		if (header.size() > name_len && header[name_len] == ':'
+			&& strncasecmp(header.data(), name, name_len) == 0) {
+			std::string_view field = header.substr(name_len + 1);
+			while (!field.empty() && field.front() == ' ') {
+				field.remove_prefix(1);
+			}
+			if (value == nullptr || (field.size() >= strlen(value)
+				&& strncasecmp(field.data(), value, strlen(value)) == 0)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static long content_length(std::string_view headers)
+{
+	const char* name = "\r\ncontent-length:";
+	for (size_t i = 0; i + strlen(name) <= headers.size(); i++) {
+		if (strncasecmp(headers.data() + i, name, strlen(name)) == 0) {
+			return strtol(headers.data() + i + strlen(name), nullptr, 10);
+		}
+	}
+	return -1;
+}
+
+int LoadGenerator::exchange(int fd, std::string& buffer, bool& keep_alive, bool& received) const
+{
+	received = false;
+	keep_alive = false;
+	size_t sent = 0;
+	while (sent < m_request.size()) {
+		const ssize_t len = send(fd, m_request.data() + sent, m_request.size() - sent, MSG_NOSIGNAL);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			return -1;
+		}
+		sent += len;
+	}
+
+	buffer.clear();
+	size_t header_end;
+	while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+		if (!fill(fd, buffer)) {
+			return -1;
+		}
+		received = true;
+	}
+	const std::string_view headers(buffer.data(), header_end + 2);
+	if (headers.size() < 12 || headers.substr(0, 7) != "HTTP/1.") {
+		return -1;
+	}
+	const int status = atoi(headers.data() + 9);
+	const bool http10 = headers[7] == '0';
+	keep_alive = http10 ? header_is(headers, "connection", "keep-alive")
+		: !header_is(headers, "connection", "close");
+	size_t pos = header_end + 4;
+
+	if (status == 204 || status == 304 || (status >= 100 && status < 200)) {
+		// No body
+	} else if (header_is(headers, "transfer-encoding", "chunked")) {
+		while (true) {
+			size_t eol;
+			while ((eol = buffer.find("\r\n", pos)) == std::string::npos) {
+				if (!fill(fd, buffer)) {
+					return -1;
+				}
+			}
+			const size_t size = strtoul(buffer.c_str() + pos, nullptr, 16);
+			pos = eol + 2;
+			if (size == 0) {
+				// Skip the trailers until the empty line
+				while (true) {
+					while ((eol = buffer.find("\r\n", pos)) == std::string::npos) {
+						if (!fill(fd, buffer)) {
+							return -1;
+						}
+					}
+					const bool empty = (eol == pos);
+					pos = eol + 2;
+					if (empty) {
+						break;
+					}
+				}
+				break;
+			}
+			while (buffer.size() < pos + size + 2) {
+				if (!fill(fd, buffer)) {
+					return -1;
+				}
+			}
+			pos += size + 2;
+		}
+	} else if (const long length = content_length(headers); length >= 0) {
+		while (buffer.size() < pos + length) {
+			if (!fill(fd, buffer)) {
+				return -1;
+			}
+		}
+	} else {
+		// The body ends when the connection closes
+		while (fill(fd, buffer)) {
+		}
+		keep_alive = false;
+	}
+	return status;
+}
+
+void LoadGenerator::client(Client& client, unsigned index)
+{
+	using namespace std::chrono;
+	const auto interval = (m_options.rate > 0) ?
+		nanoseconds(1'000'000'000ull * m_options.connections / m_options.rate) : nanoseconds(0);
+	// Spread the schedules of the connections over one interval
+	auto due = m_start + interval * index / m_options.connections;
+	std::string buffer;
+	int fd = -1;
+	while (true) {
+		if (interval.count() > 0) {
+			if (due >= m_end) {
+				break;
+			}
+			std::this_thread::sleep_until(due);
+		} else if (steady_clock::now() >= m_end) {
+			break;
+		}
+		const auto start = (interval.count() > 0) ? due : steady_clock::now();
+		due += interval;
+
+		int status = -1;
+		// A kept-alive connection may have been closed by the program
+		// while idle, which is not an error, so try once more
+		for (int attempt = 0; attempt < 2 && status < 0; attempt++) {
+			const bool reused = (fd >= 0);
+			if (fd < 0) {
+				fd = connect_socket();
+				client.connects++;
+				if (fd < 0) {
+					break;
+				}
+			}
+			bool keep_alive, received;
+			status = exchange(fd, buffer, keep_alive, received);
+			if (status < 0 || !keep_alive) {
+				close(fd);
+				fd = -1;
+			}
+			if (status < 0 && (!reused || received)) {
+				break;
+			}
+		}
+		if (status < 0) {
+			client.errors++;
+			if (fd < 0 && interval.count() == 0) {
+				// Do not spin while the program is not accepting
+				std::this_thread::sleep_for(milliseconds(1));
+			}
+			continue;
+		}
+		const uint64_t nanos = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+		client.latencies[LatencyHistogram::index(nanos)]++;
+		client.requests++;
+		if (status < 200 || status >= 300) {
+			client.non_2xx++;
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+static std::string format_nanos(uint64_t nanos)
+{
+	char buffer[32];
+	if (nanos < 1'000'000) {
+		snprintf(buffer, sizeof(buffer), "%.1fus", nanos / 1e3);
+	} else if (nanos < 1'000'000'000) {
+		snprintf(buffer, sizeof(buffer), "%.2fms", nanos / 1e6);
+	} else {
+		snprintf(buffer, sizeof(buffer), "%.2fs", nanos / 1e9);
+	}
+	return buffer;
+}
+
+void LoadGenerator::run(FILE* out, const Metrics* metrics)
+{
+	const Metrics::Totals before = (metrics != nullptr) ? metrics->totals() : Metrics::Totals{};
+	// Every system call of a guest is a VM exit handled by kvmserver
+	auto exits_before = std::make_unique<SyscallStats::Totals>();
+	auto exits_after = std::make_unique<SyscallStats::Totals>();
+	SyscallStats::totals(*exits_before);
+	m_clients.clear();
+	for (unsigned i = 0; i < m_options.connections; i++) {
+		m_clients.push_back(std::make_unique<Client>());
+	}
+	m_start = std::chrono::steady_clock::now();
+	m_end = m_start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::duration<float>(m_options.duration));
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < m_options.connections; i++) {
+		threads.emplace_back(&LoadGenerator::client, this, std::ref(*m_clients[i]), i);
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+
+	Client total;
+	for (const auto& client : m_clients) {
+		total.requests += client->requests;
+		total.errors += client->errors;
+		total.non_2xx += client->non_2xx;
+		total.connects += client->connects;
+		for (unsigned b = 0; b < LatencyHistogram::BUCKETS; b++) {
+			total.latencies[b] += client->latencies[b];
+		}
+	}
+	auto quantile = [&] (double q) -> uint64_t {
+		const uint64_t rank = std::max<uint64_t>(1, q * total.requests + 0.5);
+		uint64_t seen = 0;
+		for (unsigned b = 0; b < LatencyHistogram::BUCKETS; b++) {
+			seen += total.latencies[b];
+			if (seen >= rank) {
+				return LatencyHistogram::highest(b);
+			}
+		}
+		return 0;
+	};
+
+	fprintf(out, "Benchmark of %s for %.1fs with %u connections, %s\n",
+		m_options.path.c_str(), elapsed, m_options.connections,
+		(m_options.rate > 0) ? ("open loop at " + std::to_string(m_options.rate) + " req/s").c_str() : "closed loop");
+	fprintf(out, "  Requests:  %lu (%.1f/s), errors: %lu, non-2xx: %lu, connects: %lu\n",
+		(unsigned long)total.requests, total.requests / elapsed, (unsigned long)total.errors,
+		(unsigned long)total.non_2xx, (unsigned long)total.connects);
+	if (total.requests > 0) {
+		fprintf(out, "  Latency:   min %s  p50 %s  p90 %s  p99 %s  p99.9 %s  max %s\n",
+			format_nanos(quantile(0.0)).c_str(), format_nanos(quantile(0.5)).c_str(),
+			format_nanos(quantile(0.9)).c_str(), format_nanos(quantile(0.99)).c_str(),
+			format_nanos(quantile(0.999)).c_str(), format_nanos(quantile(1.0)).c_str());
+	}
+	if (metrics != nullptr) {
+		const Metrics::Totals after = metrics->totals();
+		fprintf(out, "  kvmserver: requests: %lu, resets: %lu, request timeouts: %lu, request errors: %lu\n",
+			(unsigned long)(after.requests - before.requests), (unsigned long)(after.resets - before.resets),
+			(unsigned long)(after.request_timeouts - before.request_timeouts),
+			(unsigned long)(after.request_errors - before.request_errors));
+	}
+	SyscallStats::totals(*exits_after);
+	uint64_t exits = 0;
+	for (unsigned i = 0; i < SyscallStats::SYSCALLS; i++) {
+		exits += exits_after->count[i] - exits_before->count[i];
+	}
+	fprintf(out, "  VM exits:  %lu system calls (%.1f per request), by system call:\n",
+		(unsigned long)exits, (total.requests > 0) ? double(exits) / total.requests : 0.0);
+	SyscallStats::report(out, *exits_after, *exits_before);
+	fflush(out);
+}
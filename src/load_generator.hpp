@@ -0,0 +1,56 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+#include "metrics.hpp"
+
+/**
+ * The HTTP/1.1 load generator of `kvmserver bench`. Every connection has
+ * a thread of its own that sends GET requests over keep-alive, and
+ * connects again whenever the program closes the connection.
+ *
+ * Without a rate each request is sent as soon as the previous response
+ * is complete (closed loop). With a rate, requests are sent on a fixed
+ * schedule (open loop) and latency is measured from the time a request
+ * was due, so a server that stalls is not hidden by the client waiting.
+**/
+class LoadGenerator
+{
+public:
+	struct Options {
+		unsigned connections;
+		float duration; /* Seconds */
+		unsigned rate; /* Requests per second over all connections, or 0 */
+		std::string path;
+	};
+	LoadGenerator(const struct sockaddr_storage& addr, socklen_t addrlen, Options options);
+	/* Run for the whole duration and print the results, together with
+	   the change in the counters of the forked VMs when there are any */
+	void run(FILE* out, const Metrics* metrics);
+
+private:
+	struct alignas(64) Client {
+		uint64_t requests = 0;
+		uint64_t errors = 0;
+		uint64_t non_2xx = 0;
+		uint64_t connects = 0;
+		std::vector<uint64_t> latencies = std::vector<uint64_t>(LatencyHistogram::BUCKETS);
+	};
+	void client(Client& client, unsigned index);
+	int connect_socket() const;
+	/* Send a request and read the whole response, returning the status
+	   code, or -1 on failure with received telling whether any of the
+	   response arrived */
+	int exchange(int fd, std::string& buffer, bool& keep_alive, bool& received) const;
+
+	const struct sockaddr_storage m_addr;
+	const socklen_t m_addrlen;
+	const Options m_options;
+	const std::string m_request;
+	std::chrono::steady_clock::time_point m_start;
+	std::chrono::steady_clock::time_point m_end;
+	std::vector<std::unique_ptr<Client>> m_clients;
+};
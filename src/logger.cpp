@@ -0,0 +1,186 @@
+#include "logger.hpp"
+
+#include "settings.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+/* Single producer (the owning thread), single consumer (the writer) */
+struct Ring
+{
+	struct Slot {
+		uint64_t sequence;
+		Logger::Level level;
+		uint16_t length;
+		char text[settings::LOG_MESSAGE_SIZE];
+	};
+	std::array<Slot, settings::LOG_RING_SLOTS> slots;
+	std::atomic<uint64_t> head {0};
+	std::atomic<uint64_t> tail {0};
+	std::atomic<uint64_t> dropped {0};
+	std::atomic<bool> owned {true};
+	// Rate limit state, only used by the owning thread
+	int64_t window_start = 0;
+	unsigned window_count = 0;
+};
+struct Message {
+	uint64_t sequence;
+	Logger::Level level;
+	std::string text;
+};
+
+std::atomic<Logger::Level> max_level {Logger::Info};
+std::atomic<bool> lossless {false};
+std::atomic<uint64_t> sequence {0};
+std::mutex rings_mutex; /* Registration and draining */
+std::mutex write_mutex; /* The writer thread and flush() */
+std::vector<std::unique_ptr<Ring>> rings;
+std::once_flag writer_started;
+
+/* Releases the ring of a thread when it exits, for reuse by another */
+struct RingOwner {
+	Ring* ring = nullptr;
+	~RingOwner() { if (ring) ring->owned.store(false, std::memory_order_release); }
+};
+thread_local RingOwner ring_owner;
+
+uint64_t drain(std::vector<Message>& out)
+{
+	uint64_t dropped = 0;
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	for (auto& ring : rings) {
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		const uint64_t head = ring->head.load(std::memory_order_acquire);
+		for (; tail < head; tail++) {
+			const auto& slot = ring->slots[tail % ring->slots.size()];
+			out.push_back({slot.sequence, slot.level, std::string(slot.text, slot.length)});
+		}
+		ring->tail.store(tail, std::memory_order_release);
+		dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+	}
+	return dropped;
+}
+
+bool write_messages()
+{
+	std::lock_guard<std::mutex> lock(write_mutex);
+	std::vector<Message> messages;
+	const uint64_t dropped = drain(messages);
+	// Each ring is in order, but the rings have to be merged
+	std::sort(messages.begin(), messages.end(),
+		[] (const Message& a, const Message& b) { return a.sequence < b.sequence; });
+	for (const auto& message : messages) {
+		FILE* out = (message.level <= Logger::Warning) ? stderr : stdout;
+		fwrite(message.text.data(), 1, message.text.size(), out);
+	}
+	if (dropped > 0) {
+		fprintf(stderr, "Logger: %lu messages were dropped\n", (unsigned long)dropped);
+	}
+	if (!messages.empty() || dropped > 0) {
+		fflush(stdout);
+		fflush(stderr);
+		return true;
+	}
+	return false;
+}
+
+Ring& thread_ring()
+{
+	if (ring_owner.ring != nullptr) {
+		return *ring_owner.ring;
+	}
+	std::call_once(writer_started, [] {
+		std::thread([] {
+			while (true) {
+				if (!write_messages()) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(settings::LOG_WRITE_INTERVAL_MS));
+				}
+			}
+		}).detach();
+		atexit(Logger::flush);
+	});
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	for (auto& ring : rings) {
+		// Reuse the ring of a thread that has exited, once it is drained
+		bool expected = false;
+		if (ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire)
+			&& ring->owned.compare_exchange_strong(expected, true)) {
+			ring_owner.ring = ring.get();
+			return *ring;
+		}
+	}
+	rings.push_back(std::make_unique<Ring>());
+	ring_owner.ring = rings.back().get();
+	return *ring_owner.ring;
+}
+} // namespace
+
+void Logger::log(Level level, const char* format, ...)
+{
+	if (!enabled(level)) {
+		return;
+	}
+	Ring& ring = thread_ring();
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	if (ts.tv_sec != ring.window_start) {
+		ring.window_start = ts.tv_sec;
+		ring.window_count = 0;
+	}
+	const uint64_t head = ring.head.load(std::memory_order_relaxed);
+	const bool keep = lossless.load(std::memory_order_relaxed);
+	if (!keep && (ring.window_count >= settings::LOG_RATE_LIMIT
+		|| head - ring.tail.load(std::memory_order_acquire) >= ring.slots.size())) {
+		ring.dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	while (head - ring.tail.load(std::memory_order_acquire) >= ring.slots.size()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	ring.window_count++;
+
+	auto& slot = ring.slots[head % ring.slots.size()];
+	va_list args;
+	va_start(args, format);
+	const int length = vsnprintf(slot.text, sizeof(slot.text), format, args);
+	va_end(args);
+	slot.length = std::clamp<int>(length, 0, sizeof(slot.text) - 1);
+	if (length >= int(sizeof(slot.text))) {
+		slot.text[slot.length - 1] = '\n'; // Truncated
+	}
+	slot.level = level;
+	slot.sequence = sequence.fetch_add(1, std::memory_order_relaxed);
+	ring.head.store(head + 1, std::memory_order_release);
+}
+
+void Logger::set_level(Level level) noexcept
+{
+	max_level.store(level, std::memory_order_relaxed);
+}
+
+void Logger::set_lossless(bool keep) noexcept
+{
+	lossless.store(keep, std::memory_order_relaxed);
+}
+
+bool Logger::enabled(Level level) noexcept
+{
+	return level <= max_level.load(std::memory_order_relaxed);
+}
+
+void Logger::flush()
+{
+	write_messages();
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+
+/**
+ * Logging for the fork threads. Messages are formatted into a ring
+ * owned by the calling thread and written by a background thread, so
+ * a slow stdout or stderr never delays a request or a reset. Errors
+ * and warnings go to stderr, the rest to stdout, in the order they
+ * were logged. A thread that fills its ring or logs faster than the
+ * rate limit loses messages, and the writer reports how many, unless
+ * logging is lossless. Then the thread waits for the writer instead.
+**/
+struct Logger
+{
+	enum Level : int { Error, Warning, Info, Debug };
+
+	static void log(Level level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+	/* Messages above this level are discarded */
+	static void set_level(Level level) noexcept;
+	static bool enabled(Level level) noexcept;
+	/* Keep every message, for complete system call traces */
+	static void set_lossless(bool lossless) noexcept;
+	/* Write everything logged so far, before exiting */
+	static void flush();
+};
@@ -1,15 +1,135 @@
 #include <atomic>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <filesystem>
 #include "mmap_file.hpp"
+#include "shared_cache.hpp"
+#include "upstream_pool.hpp"
+#include "dns_cache.hpp"
+#include "file_cache.hpp"
+#include "load_generator.hpp"
+#include "logger.hpp"
+#include "memory_trimmer.hpp"
+#include "metrics.hpp"
+#include "profiler.hpp"
+#include "output_capture.hpp"
+#include "paravirt_clock.hpp"
+#include "startup_trace.hpp"
 #include <thread>
+#include <unistd.h>
 #include "vm.hpp"
 static std::array<std::atomic<uint64_t>, 64> reset_counters;
+static std::atomic<unsigned> forks_ready = 0;
+static std::atomic<unsigned> forks_done = 0;
+
+/* Every fork thread calls this once, whether its VM was created or not */
+static void fork_created(const Configuration& config, bool success)
+{
+	if (success) {
+		forks_ready++;
+	}
+	if (++forks_done == config.concurrency) {
+		StartupTrace::write(); // Startup is complete
+	}
+}
+
+/* The scratch directories of every VM, removed when the process exits */
+static std::string scratch_root;
+static void remove_scratch_root()
+{
+	std::error_code ec;
+	std::filesystem::remove_all(scratch_root, ec);
+}
+
+/* A killed kvmserver leaves its scratch directories behind in memory,
+   so they are removed by the next one to start */
+static void remove_stale_scratch_roots(const Configuration& config)
+{
+	const std::filesystem::path root(config.scratch_root);
+	const std::string prefix = "kvmserver-";
+	std::error_code ec;
+	for (const auto& dir : std::filesystem::directory_iterator(root.parent_path(), ec)) {
+		const std::string name = dir.path().filename().string();
+		if (!name.starts_with(prefix)) {
+			continue;
+		}
+		const pid_t pid = atoi(name.c_str() + prefix.size());
+		if (pid > 0 && pid != getpid() && kill(pid, 0) < 0 && errno == ESRCH) {
+			std::filesystem::remove_all(dir.path(), ec);
+		}
+	}
+	scratch_root = config.scratch_root;
+	atexit(remove_scratch_root);
+}
+
+/* Hugepage arenas need hugepages reserved on the host beforehand */
+static void check_hugepages(const Configuration& config)
+{
+	// A storage VM and its forks reserve arenas the same way
+	const uint64_t main_vms = config.storage ? 2 : 1;
+	const uint64_t request_vms = uint64_t(config.concurrency)
+		* ((config.storage && config.storage_1_to_1) ? 2 : 1);
+	const uint64_t needed = main_vms * config.hugepage_arena_size
+		+ request_vms * config.hugepage_requests_arena;
+	if (needed > 0) {
+		uint64_t free_pages = 0, page_kb = 0;
+		FILE* fp = fopen("/proc/meminfo", "r");
+		if (fp) {
+			char line[128];
+			while (fgets(line, sizeof(line), fp)) {
+				sscanf(line, "HugePages_Free: %lu", &free_pages);
+				sscanf(line, "Hugepagesize: %lu kB", &page_kb);
+			}
+			fclose(fp);
+		}
+		const uint64_t available = free_pages * page_kb * 1024;
+		if (available < needed) {
+			fprintf(stderr, "Warning: The hugepage arenas need %luMB, but only %luMB of hugepages are free "
+				"(see /proc/sys/vm/nr_hugepages)\n", (unsigned long)(needed >> 20), (unsigned long)(available >> 20));
+		}
+	}
+	if (config.transparent_hugepages) {
+		char mode[128] = {};
+		FILE* fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+		if (fp) {
+			fgets(mode, sizeof(mode), fp);
+			fclose(fp);
+		}
+		if (strstr(mode, "[never]") != nullptr) {
+			fprintf(stderr, "Warning: Transparent hugepages are disabled on this host\n");
+		}
+	}
+}
 
 int main(int argc, char* argv[], char* envp[])
 {
+	SyscallStats::block_report_signal();
 	try {
 		Configuration config = Configuration::FromArgs(argc, argv);
+		Logger::set_level(config.log_level);
+		// A system call trace with gaps would be misleading
+		Logger::set_lossless(config.verbose_syscalls);
+		if (!config.trace_startup.empty()) {
+			StartupTrace::enable(config.trace_startup);
+			StartupTrace::name_thread("main");
+		}
+		auto trace_start = StartupTrace::clock::now();
 		VirtualMachine::init_kvm();
+		StartupTrace::record("init kvm", trace_start);
+		SyscallStats::start_reporter(config.syscall_stats_interval);
+		if (config.buffer_guest_output) {
+			OutputCapture::start(config.prefix_guest_output);
+		}
+		MemoryTrimmer::start(config);
+		if (config.paravirt_clock && !ParavirtClock::init()) {
+			fprintf(stderr, "Warning: No invariant TSC, the paravirtual clock is disabled\n");
+		}
+		check_hugepages(config);
+		if (!config.scratch_root.empty()) {
+			remove_stale_scratch_roots(config);
+		}
 
 		// Read the binary file
 		std::optional<MmapFile> binary_file;
@@ -17,6 +137,23 @@ int main(int argc, char* argv[], char* envp[])
 			binary_file.emplace(config.main_filename);
 		}
 
+		std::unique_ptr<SharedCache> shared_cache;
+		if (config.shared_cache_size > 0) {
+			shared_cache = std::make_unique<SharedCache>(config.shared_cache_size);
+		}
+		std::unique_ptr<UpstreamPool> upstream_pool;
+		if (!config.upstream_pool.empty()) {
+			upstream_pool = std::make_unique<UpstreamPool>(config.upstream_pool, config.upstream_pool_idle, config.verbose);
+		}
+		std::unique_ptr<FileCache> file_cache;
+		if (config.open_file_cache > 0) {
+			file_cache = std::make_unique<FileCache>(config.open_file_cache);
+		}
+		std::unique_ptr<DnsCache> dns_cache;
+		if (config.dns_cache) {
+			dns_cache = std::make_unique<DnsCache>(config.dns_nameservers, config.verbose);
+		}
+
 		std::unique_ptr<MmapFile> storage_binary_file;
 		std::unique_ptr<VirtualMachine> storage_vm;
 		std::vector<std::unique_ptr<VirtualMachine>> storage_forks;
@@ -25,9 +162,12 @@ int main(int argc, char* argv[], char* envp[])
 			// Load the storage VM binary
 			storage_binary_file = std::make_unique<MmapFile>(config.storage_filename);
 			// Create the storage VM
+			trace_start = StartupTrace::clock::now();
 			storage_vm = std::make_unique<VirtualMachine>(storage_binary_file->view(), config, true);
+			StartupTrace::record("storage load ELF", trace_start);
 			// Make sure only one thread at a time can access the storage VM
 			storage_vm->machine().cpu().remote_serializer = &storage_vm_mutex;
+			storage_vm->set_shared_cache(shared_cache.get());
 			auto init = storage_vm->initialize(nullptr, false);
 			if (!storage_vm->is_waiting_for_requests()) {
 				fprintf(stderr, "The storage VM did not wait for requests\n");
@@ -37,8 +177,20 @@ int main(int argc, char* argv[], char* envp[])
 			storage_binary_file->dontneed(); // Lazily drop pages from the file
 		}
 
+		std::unique_ptr<Profiler> profiler;
+		if (!config.profile_filename.empty()) {
+			profiler = std::make_unique<Profiler>(config.profile_filename, config.profile_frequency);
+		}
+
 		// Create a VirtualMachine instance
+		trace_start = StartupTrace::clock::now();
 		VirtualMachine vm(binary_file.has_value() ? std::optional(binary_file.value().view()) : std::nullopt, config);
+		StartupTrace::record("load ELF", trace_start);
+		vm.set_shared_cache(shared_cache.get());
+		vm.set_upstream_pool(upstream_pool.get());
+		vm.set_dns_cache(dns_cache.get());
+		vm.set_file_cache(file_cache.get());
+		vm.set_profiler(profiler.get());
 		if (storage_vm != nullptr) {
 			// Link the main storage VM to the main VM
 			if (config.storage_ipre_permanent) {
@@ -71,6 +223,14 @@ int main(int argc, char* argv[], char* envp[])
 			// Create one storage VM per request VM
 			storage_forks.resize(config.concurrency);
 		}
+		if (config.prefault_master && !just_one_vm) {
+			// Forks read from the main VM memory, so the first requests
+			// would otherwise fault it in, and reclaim could drop it later
+			vm.prefault_memory(config.mlock_master);
+			if (config.storage_1_to_1 && storage_vm != nullptr) {
+				storage_vm->prefault_memory(config.mlock_master);
+			}
+		}
 
 		// Get warmup time (if any)
 		const std::string warmup_time = (init.warmup_time.count() > 0) ?
@@ -93,6 +253,8 @@ int main(int argc, char* argv[], char* envp[])
 			method = "poll";
 		} else if (vm.poll_method() == VirtualMachine::PollMethod::Blocking) {
 			method = "blocking";
+		} else if (vm.poll_method() == VirtualMachine::PollMethod::Checkpoint) {
+			method = "checkpoint";
 		} else if (vm.poll_method() == VirtualMachine::PollMethod::Undefined) {
 			method = "undefined";
 		}
@@ -108,12 +270,55 @@ int main(int argc, char* argv[], char* envp[])
 			process_rss.c_str());
 
 		if (config.snapshot_mode == tinykvm::MachineOptions::SnapshotMode::Create) {
+			StartupTrace::write();
 			return 0;
 		}
 
+		std::unique_ptr<Metrics> metrics;
+		if (!config.metrics_socket.empty() || config.bench) {
+			metrics = std::make_unique<Metrics>(config.concurrency);
+		}
+		if (!config.metrics_socket.empty()) {
+			metrics->serve(config.metrics_socket);
+		}
+
+		// The load generator of kvmserver bench runs in a thread of its
+		// own, and ends the process once it has printed the results
+		if (config.bench) {
+			std::thread([&vm, &metrics, just_one_vm]() {
+				// Wait for the forks, so that no request waits for one to be created
+				const auto deadline = std::chrono::steady_clock::now()
+					+ std::chrono::milliseconds(uint64_t(vm.config().max_boot_time * 1000));
+				while (!just_one_vm && forks_ready.load() < vm.config().concurrency
+					&& std::chrono::steady_clock::now() < deadline) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				}
+				struct sockaddr_storage addr {};
+				socklen_t addrlen = sizeof(addr);
+				if (getsockname(vm.listening_fd(), reinterpret_cast<struct sockaddr*>(&addr), &addrlen) < 0) {
+					Logger::flush();
+					fprintf(stderr, "Bench: Failed getsockname: %s\n", strerror(errno));
+					remove_scratch_root();
+					_exit(1);
+				}
+				LoadGenerator generator(addr, addrlen, LoadGenerator::Options{
+					.connections = vm.config().bench_connections,
+					.duration = vm.config().bench_duration,
+					.rate = vm.config().bench_rate,
+					.path = vm.config().bench_path,
+				});
+				generator.run(stdout, just_one_vm ? nullptr : metrics.get());
+				Logger::flush();
+				OutputCapture::flush();
+				remove_scratch_root();
+				_exit(0);
+			}).detach();
+		}
+
 		// Non-ephemeral single-threaded - we already have a VM
 		if (just_one_vm)
 		{
+			StartupTrace::write();
 			vm.restart_poll_syscall();
 
 			while (true)
@@ -152,22 +357,29 @@ int main(int argc, char* argv[], char* envp[])
 		for (unsigned int i = 0; i < config.concurrency; ++i)
 		{
 			const bool is_storage_1_to_1 = (config.storage && config.storage_1_to_1);
-			threads.emplace_back([&vm, &storage_forks, &storage_vm, i, is_storage_1_to_1]()
+			ForkMetrics* fork_metrics = (metrics != nullptr) ? &metrics->fork(i) : nullptr;
+			threads.emplace_back([&vm, &storage_forks, &storage_vm, i, is_storage_1_to_1, fork_metrics]()
 			{
 				// Create a new VM
 				std::unique_ptr<VirtualMachine> forked_vm;
+				StartupTrace::name_thread("fork " + std::to_string(i));
 				try {
 					// Fork a new VM
+					auto trace_start = StartupTrace::clock::now();
 					forked_vm = std::make_unique<VirtualMachine>(vm, i, false);
+					StartupTrace::record("fork", trace_start);
 					// Link the specific storage VM to the forked VM
 					if (is_storage_1_to_1 && i < storage_forks.size()) {
+						trace_start = StartupTrace::clock::now();
 						storage_forks[i] = std::make_unique<VirtualMachine>(*storage_vm, i, true);
+						StartupTrace::record("storage fork", trace_start);
 						if (vm.config().storage_ipre_permanent) {
 							forked_vm->machine().permanent_remote_connect(storage_forks[i]->machine());
 						} else {
 							forked_vm->machine().remote_connect(storage_forks[i]->machine());
 						}
 					}
+					forked_vm->set_metrics(fork_metrics);
 					forked_vm->set_on_reset_callback([&vm, i]()
 					{
 						if (!vm.config().verbose)
@@ -180,29 +392,34 @@ int main(int argc, char* argv[], char* envp[])
 								for (unsigned int j = 0; j < vm.config().concurrency; ++j) {
 									counters_str += std::to_string(j) + ": " + std::to_string(reset_counters[j].load()) + " ";
 								}
-								fprintf(stderr, "\rForked VMs have been reset: %s\n", counters_str.c_str());
+								Logger::log(Logger::Debug, "\rForked VMs have been reset: %s\n", counters_str.c_str());
 							} else {
 								// Print a dot in between resets
-								fprintf(stderr, ".");
+								Logger::log(Logger::Debug, ".");
 							}
 						}
 					});
 					if (getenv("DEBUG_FORK") != nullptr) {
 						forked_vm->open_debugger();
 					}
+					fork_created(vm.config(), true);
 				} catch (const tinykvm::MachineTimeoutException& me) {
-					fprintf(stderr, "*** Forked VM %u failed to initialize: timed out\n", i);
-					fprintf(stderr, "Error: %s Data: 0x%#lX\n", me.what(), me.data());
+					Logger::log(Logger::Error, "*** Forked VM %u failed to initialize: timed out\n", i);
+					Logger::log(Logger::Error, "Error: %s Data: 0x%#lX\n", me.what(), me.data());
+					fork_created(vm.config(), false);
 					return;
 				} catch (const tinykvm::MemoryException& me) {
-					fprintf(stderr, "*** Forked VM %u failed to initialize: memory error: %s Addr: 0x%#lX Size: %zu OOM: %d\n",
+					Logger::log(Logger::Error, "*** Forked VM %u failed to initialize: memory error: %s Addr: 0x%#lX Size: %zu OOM: %d\n",
 						i, me.what(), me.addr(), me.size(), me.is_oom());
+					fork_created(vm.config(), false);
 					return;
 				} catch (const tinykvm::MachineException& me) {
-					fprintf(stderr, "*** Forked VM %u failed to initialize: %s Data: 0x%#lX\n", i, me.what(), me.data());
+					Logger::log(Logger::Error, "*** Forked VM %u failed to initialize: %s Data: 0x%#lX\n", i, me.what(), me.data());
+					fork_created(vm.config(), false);
 					return;
 				} catch (const std::exception& e) {
-					fprintf(stderr, "*** Forked VM %u failed to initialize: %s\n", i, e.what());
+					Logger::log(Logger::Error, "*** Forked VM %u failed to initialize: %s\n", i, e.what());
+					fork_created(vm.config(), false);
 					return;
 				}
 				while (true) {
@@ -210,15 +427,18 @@ int main(int argc, char* argv[], char* envp[])
 					try {
 						forked_vm->resume_fork();
 					} catch (const tinykvm::MachineTimeoutException& me) {
-						fprintf(stderr, "*** Forked VM %u timed out\n", i);
-						fprintf(stderr, "Error: %s Data: 0x%#lX\n", me.what(), me.data());
+						Logger::log(Logger::Error, "*** Forked VM %u timed out\n", i);
+						Logger::log(Logger::Error, "Error: %s Data: 0x%#lX\n", me.what(), me.data());
+						if (fork_metrics) fork_metrics->timeout();
 						failure = true;
 					} catch (const tinykvm::MachineException& me) {
-						fprintf(stderr, "*** Forked VM %u Error: %s Data: 0x%#lX\n",
+						Logger::log(Logger::Error, "*** Forked VM %u Error: %s Data: 0x%#lX\n",
 							i, me.what(), me.data());
+						if (fork_metrics) fork_metrics->error();
 						failure = true;
 					} catch (const std::exception& e) {
-						fprintf(stderr, "*** Forked VM %u Error: %s\n", i, e.what());
+						Logger::log(Logger::Error, "*** Forked VM %u Error: %s\n", i, e.what());
+						if (fork_metrics) fork_metrics->error();
 						failure = true;
 					}
 					if (failure) {
@@ -227,11 +447,12 @@ int main(int argc, char* argv[], char* envp[])
 						}
 					}
 					if (vm.is_ephemeral() || failure) {
-						printf("Forked VM %u finished. Resetting...\n", i);
+						Logger::log(Logger::Info, "Forked VM %u finished. Resetting...\n", i);
 						try {
-							forked_vm->reset_to(vm);
+							// Persistent ranges may be half-written after a failure
+							forked_vm->reset_to(vm, !failure);
 						} catch (const std::exception& e) {
-							fprintf(stderr, "*** Forked VM %u failed to reset: %s\n", i, e.what());
+							Logger::log(Logger::Error, "*** Forked VM %u failed to reset: %s\n", i, e.what());
 						}
 					}
 				}
@@ -244,16 +465,19 @@ int main(int argc, char* argv[], char* envp[])
 		}
 
 	} catch (const tinykvm::MachineTimeoutException& me) {
+		Logger::flush();
 		fprintf(stderr, "Machine timed out\n");
 		fprintf(stderr, "Error: %s Data: 0x%lX\n", me.what(), me.data());
 		fprintf(stderr, "The server has stopped.\n");
 		return 1;
 	} catch (const tinykvm::MachineException& me) {
+		Logger::flush();
 		fprintf(stderr, "Machine not initialized properly\n");
 		fprintf(stderr, "Error: %s Data: 0x%lX\n", me.what(), me.data());
 		fprintf(stderr, "The server has stopped.\n");
 		return 1;
 	} catch (const std::exception& e) {
+		Logger::flush();
 		fprintf(stderr, "Error: %s\n", e.what());
 		fprintf(stderr, "The server has stopped.\n");
 		return 1;
@@ -0,0 +1,159 @@
+#include "memory_trimmer.hpp"
+
+#include "config.hpp"
+#include "logger.hpp"
+#include "settings.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static bool trimming = false;
+static uint64_t memory_budget = 0;
+static float memory_pressure = 0.0f;
+static std::mutex forks_mutex;
+static std::vector<std::unique_ptr<MemoryTrimmer::Fork>> forks;
+
+void MemoryTrimmer::Fork::idle(size_t working_memory, bool trimmed)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_idle_since = std::chrono::steady_clock::now();
+	m_working_memory = working_memory;
+	m_state.store(trimmed ? Trimmed : Idle, std::memory_order_relaxed);
+	// Consume any wakeup from before the reset
+	uint64_t value;
+	while (read(m_wakeup_fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+void MemoryTrimmer::Fork::busy()
+{
+	// A fork that accepts a connection keeps its working memory
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_state.store(Busy, std::memory_order_relaxed);
+}
+
+static void wake_up(int fd)
+{
+	const uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		perror("Memory trimmer: wakeup");
+	}
+}
+
+/* The some avg10 memory pressure of the host in percent, or -1 */
+static float read_memory_pressure()
+{
+	FILE* fp = fopen("/proc/pressure/memory", "r");
+	if (fp == nullptr) {
+		return -1.0f;
+	}
+	float avg10 = -1.0f;
+	if (fscanf(fp, "some avg10=%f", &avg10) != 1) {
+		avg10 = -1.0f;
+	}
+	fclose(fp);
+	return avg10;
+}
+
+static uint64_t read_resident_memory()
+{
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp == nullptr) {
+		return 0;
+	}
+	unsigned long size = 0, resident = 0;
+	if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(fp);
+	return uint64_t(resident) * sysconf(_SC_PAGESIZE);
+}
+
+void MemoryTrimmer::trim_idle_forks(uint64_t amount)
+{
+	const auto now = std::chrono::steady_clock::now();
+	const auto min_idle = std::chrono::seconds(settings::MEMORY_TRIM_MIN_IDLE);
+	std::lock_guard<std::mutex> lock(forks_mutex);
+	std::vector<std::pair<std::chrono::steady_clock::time_point, Fork*>> candidates;
+	for (auto& fork : forks) {
+		std::lock_guard<std::mutex> fork_lock(fork->m_mutex);
+		if (fork->m_state.load(std::memory_order_relaxed) == Fork::Idle && now - fork->m_idle_since >= min_idle) {
+			candidates.emplace_back(fork->m_idle_since, fork.get());
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(),
+		[](const auto& a, const auto& b) { return a.first < b.first; });
+
+	uint64_t released = 0;
+	for (auto& [idle_since, fork] : candidates) {
+		if (released >= amount) {
+			break;
+		}
+		std::lock_guard<std::mutex> fork_lock(fork->m_mutex);
+		if (fork->m_state.load(std::memory_order_relaxed) != Fork::Idle) {
+			continue;
+		}
+		fork->m_state.store(Fork::TrimRequested, std::memory_order_relaxed);
+		wake_up(fork->m_wakeup_fd);
+		released += std::max<uint64_t>(fork->m_working_memory, 1);
+		Logger::log(Logger::Debug, "Trimming forked VM %u, idle for %lds with %zu MB of working memory\n",
+			fork->m_vm, long(std::chrono::duration_cast<std::chrono::seconds>(now - idle_since).count()),
+			fork->m_working_memory >> 20);
+	}
+}
+
+bool MemoryTrimmer::enabled() noexcept
+{
+	return trimming;
+}
+
+void MemoryTrimmer::start(const Configuration& config)
+{
+	memory_budget = config.memory_budget;
+	memory_pressure = config.memory_pressure;
+	if (memory_pressure > 0.0f && read_memory_pressure() < 0.0f) {
+		fprintf(stderr, "Warning: Memory pressure is not available on this host (/proc/pressure/memory)\n");
+		memory_pressure = 0.0f;
+	}
+	if (memory_budget == 0 && memory_pressure <= 0.0f) {
+		return;
+	}
+	trimming = true;
+
+	std::thread([] {
+		while (true) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(settings::MEMORY_TRIM_INTERVAL_MS));
+			uint64_t excess = 0;
+			if (memory_budget != 0) {
+				const uint64_t resident = read_resident_memory();
+				if (resident > memory_budget) {
+					excess = resident - memory_budget;
+				}
+			}
+			// Under pressure the forks are trimmed one at a time
+			if (memory_pressure > 0.0f && read_memory_pressure() >= memory_pressure) {
+				excess = std::max<uint64_t>(excess, 1);
+			}
+			trim_idle_forks(excess);
+		}
+	}).detach();
+}
+
+MemoryTrimmer::Fork* MemoryTrimmer::add_fork(unsigned vm)
+{
+	auto fork = std::make_unique<Fork>();
+	fork->m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fork->m_wakeup_fd < 0) {
+		throw std::runtime_error("Memory trimmer: eventfd: " + std::string(strerror(errno)));
+	}
+	fork->m_vm = vm;
+	std::lock_guard<std::mutex> lock(forks_mutex);
+	forks.push_back(std::move(fork));
+	return forks.back().get();
+}
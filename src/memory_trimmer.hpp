@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+struct Configuration;
+
+/**
+ * Releases the working memory of idle ephemeral forks when the host is
+ * short on memory, either because memory pressure (PSI) is high or the
+ * resident memory of kvmserver exceeds a budget. The forks that have
+ * been idle the longest are trimmed first.
+ *
+ * An idle fork that waits for connections without a timeout also waits
+ * for an eventfd of its own, which wakes it when it should be trimmed.
+ * It then resets itself with a small working memory limit. Working
+ * memory grows back on demand when the fork handles requests again.
+**/
+struct MemoryTrimmer
+{
+	/* One ephemeral fork, updated by the thread running it */
+	class Fork {
+	public:
+		/* The fork was reset and is waiting for a connection */
+		void idle(size_t working_memory, bool trimmed);
+		/* The fork accepted a connection */
+		void busy();
+		/* The fork should stop waiting and reset with a trimmed working memory */
+		bool trim_requested() const noexcept { return m_state.load(std::memory_order_relaxed) == TrimRequested; }
+		/* Readable when a trim is requested */
+		int wakeup_fd() const noexcept { return m_wakeup_fd; }
+
+	private:
+		friend struct MemoryTrimmer;
+		enum State { Busy, Idle, TrimRequested, Trimmed };
+		std::mutex m_mutex;
+		std::atomic<int> m_state { Busy };
+		std::chrono::steady_clock::time_point m_idle_since;
+		size_t m_working_memory = 0;
+		int m_wakeup_fd = -1;
+		unsigned m_vm = 0;
+	};
+
+	static bool enabled() noexcept;
+	/* Start checking the memory pressure and budget every second */
+	static void start(const Configuration& config);
+	static Fork* add_fork(unsigned vm);
+
+private:
+	/* Wake up idle forks until at least this much memory is released */
+	static void trim_idle_forks(uint64_t amount);
+};
@@ -0,0 +1,197 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+void ForkMetrics::reset(uint64_t nanos, uint64_t working_memory) noexcept
+{
+	bump(m_resets, 1);
+	bump(m_reset_ns, nanos);
+	unsigned bucket = 0;
+	while (bucket < RESET_BUCKETS_NS.size() && nanos > RESET_BUCKETS_NS[bucket]) {
+		bucket++;
+	}
+	bump(m_reset_histogram[bucket], 1);
+	m_working_memory.store(working_memory, std::memory_order_relaxed);
+}
+
+Metrics::Metrics(unsigned forks)
+	: m_forks(new ForkMetrics[forks]), m_count(forks)
+{
+}
+
+Metrics::Totals Metrics::totals() const noexcept
+{
+	Totals totals {};
+	for (unsigned i = 0; i < m_count; i++) {
+		totals.requests += m_forks[i].m_requests.load(std::memory_order_relaxed);
+		totals.resets += m_forks[i].m_resets.load(std::memory_order_relaxed);
+		totals.request_timeouts += m_forks[i].m_timeouts.load(std::memory_order_relaxed);
+		totals.request_errors += m_forks[i].m_errors.load(std::memory_order_relaxed);
+	}
+	return totals;
+}
+
+static void append(std::string& out, const char* format, auto... args)
+{
+	char buffer[256];
+	const int len = snprintf(buffer, sizeof(buffer), format, args...);
+	out.append(buffer, std::min<size_t>(len, sizeof(buffer) - 1));
+}
+
+std::string Metrics::collect() const
+{
+	std::string out;
+	auto per_fork = [&] (const char* name, const char* type, const char* help,
+		std::atomic<uint64_t> ForkMetrics::*member, double scale)
+	{
+		append(out, "# HELP kvmserver_%s %s\n# TYPE kvmserver_%s %s\n", name, help, name, type);
+		for (unsigned i = 0; i < m_count; i++) {
+			const uint64_t value = (m_forks[i].*member).load(std::memory_order_relaxed);
+			if (scale == 1.0) {
+				append(out, "kvmserver_%s{vm=\"%u\"} %lu\n", name, i, (unsigned long)value);
+			} else {
+				append(out, "kvmserver_%s{vm=\"%u\"} %.9f\n", name, i, value * scale);
+			}
+		}
+	};
+	per_fork("requests_total", "counter", "Connections accepted.", &ForkMetrics::m_requests, 1.0);
+	per_fork("resets_total", "counter", "Resets after a request.", &ForkMetrics::m_resets, 1.0);
+	per_fork("busy_seconds_total", "counter", "Time spent handling and resetting after requests.", &ForkMetrics::m_busy_ns, 1e-9);
+	per_fork("idle_seconds_total", "counter", "Time spent waiting for a connection.", &ForkMetrics::m_idle_ns, 1e-9);
+	per_fork("timeouts_total", "counter", "Requests that exceeded the time limit.", &ForkMetrics::m_timeouts, 1.0);
+	per_fork("errors_total", "counter", "Requests that ended with a VM error.", &ForkMetrics::m_errors, 1.0);
+	per_fork("storage_calls_total", "counter", "Calls into the storage VM.", &ForkMetrics::m_storage_calls, 1.0);
+	per_fork("storage_call_seconds_total", "counter", "Time spent in storage calls, including lock wait.", &ForkMetrics::m_storage_ns, 1e-9);
+	per_fork("storage_lock_wait_seconds_total", "counter", "Time spent waiting for the storage VM.", &ForkMetrics::m_storage_wait_ns, 1e-9);
+	per_fork("working_memory_bytes", "gauge", "Memory used by the last request.", &ForkMetrics::m_working_memory, 1.0);
+
+	// The reset latency histogram is summed over all forks
+	std::array<uint64_t, ForkMetrics::RESET_BUCKETS_NS.size() + 1> buckets {};
+	uint64_t count = 0, sum = 0;
+	for (unsigned i = 0; i < m_count; i++) {
+		for (size_t b = 0; b < buckets.size(); b++) {
+			const uint64_t value = m_forks[i].m_reset_histogram[b].load(std::memory_order_relaxed);
+			buckets[b] += value;
+			count += value;
+		}
+		sum += m_forks[i].m_reset_ns.load(std::memory_order_relaxed);
+	}
+	out += "# HELP kvmserver_reset_duration_seconds Time to reset a VM after a request.\n"
+		"# TYPE kvmserver_reset_duration_seconds histogram\n";
+	uint64_t cumulative = 0;
+	for (size_t b = 0; b < ForkMetrics::RESET_BUCKETS_NS.size(); b++) {
+		cumulative += buckets[b];
+		append(out, "kvmserver_reset_duration_seconds_bucket{le=\"%g\"} %lu\n",
+			ForkMetrics::RESET_BUCKETS_NS[b] * 1e-9, (unsigned long)cumulative);
+	}
+	append(out, "kvmserver_reset_duration_seconds_bucket{le=\"+Inf\"} %lu\n", (unsigned long)count);
+	append(out, "kvmserver_reset_duration_seconds_sum %.9f\n", sum * 1e-9);
+	append(out, "kvmserver_reset_duration_seconds_count %lu\n", (unsigned long)count);
+
+	// Connection phases are summed over all forks, and reported as quantiles
+	static constexpr const char* phase_names[ForkMetrics::PHASES] {
+		"accept_to_read", "read_to_write", "write_to_close", "close_to_reset", "total"
+	};
+	static constexpr double quantiles[] { 0.5, 0.9, 0.99, 0.999, 1.0 };
+	out += "# HELP kvmserver_connection_phase_seconds Time between accepting a connection, the first read, "
+		"the first write, closing it and the completed reset.\n"
+		"# TYPE kvmserver_connection_phase_seconds summary\n";
+	std::vector<uint64_t> counts(LatencyHistogram::BUCKETS);
+	for (unsigned phase = 0; phase < ForkMetrics::PHASES; phase++) {
+		std::fill(counts.begin(), counts.end(), 0);
+		uint64_t total = 0, sum = 0;
+		for (unsigned i = 0; i < m_count; i++) {
+			const auto& histogram = m_forks[i].m_phases[phase];
+			for (unsigned b = 0; b < LatencyHistogram::BUCKETS; b++) {
+				const uint64_t value = histogram.counts[b].load(std::memory_order_relaxed);
+				counts[b] += value;
+				total += value;
+			}
+			sum += histogram.sum.load(std::memory_order_relaxed);
+		}
+		unsigned b = 0;
+		uint64_t seen = 0;
+		for (const double quantile : quantiles) {
+			const uint64_t rank = std::max<uint64_t>(1, uint64_t(quantile * total + 0.5));
+			while (b < LatencyHistogram::BUCKETS - 1 && seen + counts[b] < rank) {
+				seen += counts[b++];
+			}
+			const double value = (total > 0) ? LatencyHistogram::highest(b) * 1e-9 : 0.0;
+			append(out, "kvmserver_connection_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+				phase_names[phase], quantile, value);
+		}
+		append(out, "kvmserver_connection_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[phase], sum * 1e-9);
+		append(out, "kvmserver_connection_phase_seconds_count{phase=\"%s\"} %lu\n", phase_names[phase], (unsigned long)total);
+	}
+	return out;
+}
+
+void Metrics::serve(const std::string& path)
+{
+	struct sockaddr_un addr {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("Metrics socket path is too long: " + path);
+	}
+	path.copy(addr.sun_path, path.size());
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::runtime_error("Metrics: Unable to create socket");
+	}
+	// Only a socket left behind by a previous run is replaced
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			close(fd);
+			throw std::runtime_error("Metrics: " + path + " exists and is not a socket");
+		}
+		unlink(path.c_str());
+	}
+	// Only the owner may connect, since the metrics describe the server.
+	// The socket does not accept connections until it listens.
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+		chmod(path.c_str(), 0600) < 0 || listen(fd, 16) < 0) {
+		const int error = errno;
+		close(fd);
+		throw std::runtime_error("Metrics: Unable to listen on " + path + ": " + strerror(error));
+	}
+
+	std::thread([this, fd] {
+		while (true) {
+			const int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client < 0) {
+				continue;
+			}
+			// Wait briefly for the request, which is otherwise ignored
+			struct timeval timeout { 1, 0 };
+			setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			char request[4096];
+			(void)recv(client, request, sizeof(request), 0);
+
+			const std::string body = collect();
+			std::string response = "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: " + std::to_string(body.size()) + "\r\n"
+				"Connection: close\r\n\r\n" + body;
+			size_t sent = 0;
+			while (sent < response.size()) {
+				const ssize_t len = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+				if (len <= 0) {
+					break;
+				}
+				sent += len;
+			}
+			close(client);
+		}
+	}).detach();
+}
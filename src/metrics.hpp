@@ -0,0 +1,119 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * Latency histogram with the bucketing of HdrHistogram: 16 linear
+ * sub-buckets per power of two, so every value is kept with at least
+ * 6% precision, from 1ns up to about two minutes.
+**/
+struct LatencyHistogram
+{
+	static constexpr unsigned SUB_BITS = 4;
+	static constexpr unsigned SUB_BUCKETS = 1u << SUB_BITS;
+	static constexpr unsigned MAX_BITS = 37;
+	static constexpr unsigned BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+	static unsigned index(uint64_t nanos) noexcept {
+		nanos = std::min<uint64_t>(nanos, (1ull << MAX_BITS) - 1);
+		if (nanos < SUB_BUCKETS) {
+			return nanos;
+		}
+		const unsigned shift = (63 - __builtin_clzll(nanos)) - SUB_BITS;
+		return (shift + 1) * SUB_BUCKETS + ((nanos >> shift) & (SUB_BUCKETS - 1));
+	}
+	/* The highest value that falls into a bucket */
+	static uint64_t highest(unsigned index) noexcept {
+		if (index < SUB_BUCKETS) {
+			return index;
+		}
+		const unsigned shift = index / SUB_BUCKETS - 1;
+		return ((uint64_t(SUB_BUCKETS + index % SUB_BUCKETS) + 1) << shift) - 1;
+	}
+
+	std::array<std::atomic<uint64_t>, BUCKETS> counts {};
+	std::atomic<uint64_t> sum {0};
+};
+
+/**
+ * Counters of a single forked VM. Only the thread running the fork
+ * writes them, using relaxed stores, and the metrics endpoint reads
+ * them without locks, so collecting never slows a fork down.
+**/
+struct alignas(64) ForkMetrics
+{
+	/* Upper bounds of the reset latency histogram buckets */
+	static constexpr std::array<uint64_t, 9> RESET_BUCKETS_NS {
+		50'000, 100'000, 250'000, 500'000, 1'000'000, 2'500'000, 5'000'000, 10'000'000, 50'000'000
+	};
+
+	/* Time between the events of a connection, see VirtualMachine::ConnectionEvent */
+	enum Phase { AcceptToRead, ReadToWrite, WriteToClose, CloseToReset, Total, PHASES };
+
+	void request() noexcept { bump(m_requests, 1); }
+	void phase(Phase phase, uint64_t nanos) noexcept {
+		auto& histogram = m_phases[phase];
+		bump(histogram.counts[LatencyHistogram::index(nanos)], 1);
+		bump(histogram.sum, nanos);
+	}
+	void reset(uint64_t nanos, uint64_t working_memory) noexcept;
+	void busy(uint64_t nanos) noexcept { bump(m_busy_ns, nanos); }
+	void idle(uint64_t nanos) noexcept { bump(m_idle_ns, nanos); }
+	void timeout() noexcept { bump(m_timeouts, 1); }
+	void error() noexcept { bump(m_errors, 1); }
+	void storage_call(uint64_t nanos, uint64_t wait_nanos) noexcept {
+		bump(m_storage_calls, 1);
+		bump(m_storage_ns, nanos);
+		bump(m_storage_wait_ns, wait_nanos);
+	}
+
+private:
+	friend class Metrics;
+	static void bump(std::atomic<uint64_t>& value, uint64_t add) noexcept {
+		value.store(value.load(std::memory_order_relaxed) + add, std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t> m_requests {0};
+	std::atomic<uint64_t> m_resets {0};
+	std::atomic<uint64_t> m_reset_ns {0};
+	std::array<std::atomic<uint64_t>, RESET_BUCKETS_NS.size() + 1> m_reset_histogram {};
+	std::atomic<uint64_t> m_busy_ns {0};
+	std::atomic<uint64_t> m_idle_ns {0};
+	std::atomic<uint64_t> m_timeouts {0};
+	std::atomic<uint64_t> m_errors {0};
+	std::atomic<uint64_t> m_storage_calls {0};
+	std::atomic<uint64_t> m_storage_ns {0};
+	std::atomic<uint64_t> m_storage_wait_ns {0};
+	std::atomic<uint64_t> m_working_memory {0};
+	std::array<LatencyHistogram, PHASES> m_phases;
+};
+
+/**
+ * Serves the metrics of all forks in the Prometheus text format, over
+ * HTTP on a unix socket, e.g. curl --unix-socket PATH http://localhost/
+**/
+class Metrics
+{
+public:
+	Metrics(unsigned forks);
+	ForkMetrics& fork(unsigned index) noexcept { return m_forks[index]; }
+	/* Counters summed over all forks */
+	struct Totals {
+		uint64_t requests;
+		uint64_t resets;
+		uint64_t request_timeouts;
+		uint64_t request_errors; /* The VM failed while handling a request */
+	};
+	Totals totals() const noexcept;
+	std::string collect() const;
+	/* Listen on the given path from a background thread */
+	void serve(const std::string& path);
+
+private:
+	std::unique_ptr<ForkMetrics[]> m_forks;
+	const unsigned m_count;
+};
@@ -0,0 +1,93 @@
+#include "network_allowlist.hpp"
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <netinet/in.h>
+#include <stdexcept>
+
+static inline unsigned address_bit(const uint8_t* addr, unsigned bit)
+{
+	return (addr[bit / 8] >> (7 - (bit % 8))) & 1;
+}
+
+void NetworkAllowlist::add(std::vector<Node>& trie, const uint8_t* addr, unsigned prefix_len, PortRange ports)
+{
+	uint32_t node = 0;
+	for (unsigned bit = 0; bit < prefix_len; bit++) {
+		const unsigned b = address_bit(addr, bit);
+		if (trie[node].child[b] == 0) {
+			trie[node].child[b] = trie.size();
+			trie.emplace_back();
+		}
+		node = trie[node].child[b];
+	}
+	trie[node].ports.push_back(ports);
+}
+
+void NetworkAllowlist::add(int family, const void* addr, unsigned prefix_len, PortRange ports)
+{
+	if (family == AF_INET) {
+		if (prefix_len > 32)
+			throw std::invalid_argument("IPv4 prefix length must be at most 32");
+		add(m_ipv4, static_cast<const uint8_t*>(addr), prefix_len, ports);
+	} else if (family == AF_INET6) {
+		if (prefix_len > 128)
+			throw std::invalid_argument("IPv6 prefix length must be at most 128");
+		add(m_ipv6, static_cast<const uint8_t*>(addr), prefix_len, ports);
+	} else {
+		throw std::invalid_argument("Unknown address family");
+	}
+}
+
+void NetworkAllowlist::add_any(PortRange ports)
+{
+	m_ipv4[0].ports.push_back(ports);
+	m_ipv6[0].ports.push_back(ports);
+}
+
+void NetworkAllowlist::clear()
+{
+	m_ipv4.assign(1, Node{});
+	m_ipv6.assign(1, Node{});
+}
+
+bool NetworkAllowlist::contains(const std::vector<Node>& trie, const uint8_t* addr, unsigned bits, uint16_t port)
+{
+	uint32_t node = 0;
+	for (unsigned bit = 0; ; bit++) {
+		for (const auto& range : trie[node].ports) {
+			if (range.contains(port))
+				return true;
+		}
+		if (bit == bits)
+			return false;
+		node = trie[node].child[address_bit(addr, bit)];
+		if (node == 0)
+			return false;
+	}
+}
+
+bool NetworkAllowlist::contains(const struct sockaddr_storage& addr) const
+{
+	// IPv4
+	if (addr.ss_family == AF_INET)
+	{
+		const struct sockaddr_in* addr_ipv4 =
+			reinterpret_cast<const struct sockaddr_in*>(&addr);
+		return contains(m_ipv4, reinterpret_cast<const uint8_t*>(&addr_ipv4->sin_addr),
+			32, ntohs(addr_ipv4->sin_port));
+	}
+	// IPv6 or unspecified (we are guessing IPv4-mapped IPv6)
+	// XXX: is AF_UNSPEC a liability here? we should probably not allow
+	//      it but some (e.g. bun uses it to mean IPv4-mapped IPv6)
+	if (addr.ss_family == AF_INET6 || addr.ss_family == AF_UNSPEC)
+	{
+		const struct sockaddr_in6* addr_ipv6 =
+			reinterpret_cast<const struct sockaddr_in6*>(&addr);
+		return contains(m_ipv6, reinterpret_cast<const uint8_t*>(&addr_ipv6->sin6_addr),
+			128, ntohs(addr_ipv6->sin6_port));
+	}
+	// Unknown address family
+	fprintf(stderr, "Unknown address family: %d\n", addr.ss_family);
+	return false;
+}
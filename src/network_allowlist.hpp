@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include <sys/socket.h> // for sockaddr_storage
+#include <vector>
+
+/**
+ * Allowed network destinations as address prefixes with port ranges,
+ * compiled into one binary trie per address family. A check walks at
+ * most the address length in bits, regardless of the number of rules.
+**/
+struct NetworkAllowlist
+{
+	struct PortRange {
+		uint16_t first = 0;
+		uint16_t last = UINT16_MAX;
+		bool contains(uint16_t port) const noexcept { return port >= first && port <= last; }
+	};
+
+	/* Allow a prefix of an in_addr (AF_INET) or in6_addr (AF_INET6) */
+	void add(int family, const void* addr, unsigned prefix_len, PortRange ports);
+	/* Allow every address of both families */
+	void add_any(PortRange ports);
+	void clear();
+	bool empty() const noexcept { return m_ipv4.size() == 1 && m_ipv6.size() == 1
+		&& m_ipv4[0].ports.empty() && m_ipv6[0].ports.empty(); }
+
+	bool contains(const struct sockaddr_storage& addr) const;
+
+	NetworkAllowlist() { clear(); }
+
+private:
+	struct Node {
+		uint32_t child[2] = {0, 0}; // 0 is the root, so never a child
+		std::vector<PortRange> ports;
+	};
+	static void add(std::vector<Node>& trie, const uint8_t* addr, unsigned prefix_len, PortRange ports);
+	static bool contains(const std::vector<Node>& trie, const uint8_t* addr, unsigned bits, uint16_t port);
+
+	std::vector<Node> m_ipv4;
+	std::vector<Node> m_ipv6;
+};
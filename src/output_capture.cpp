@@ -0,0 +1,104 @@
+#include "output_capture.hpp"
+
+#include "settings.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static bool prefix_lines = false;
+static std::mutex buffers_mutex;
+static std::vector<std::unique_ptr<OutputCapture::Buffers>> buffers;
+static std::mutex write_mutex; /* Keeps batches from interleaving */
+
+static void write_all(int fd, const std::string& data)
+{
+	size_t offset = 0;
+	while (offset < data.size()) {
+		const ssize_t len = write(fd, data.data() + offset, data.size() - offset);
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			return; // Nowhere to write, so the output is lost
+		}
+		offset += len;
+	}
+}
+
+void OutputCapture::Buffers::append(int fd, std::string_view data)
+{
+	const unsigned stream = (fd == 2) ? 1 : 0;
+	std::string overflow;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& pending = m_pending[stream];
+		if (!prefix_lines) {
+			pending.append(data);
+		} else {
+			char prefix[64];
+			const int prefix_len = snprintf(prefix, sizeof(prefix), "[vm %u req %lu] ",
+				m_vm, (unsigned long)m_request);
+			while (!data.empty()) {
+				if (m_line_start[stream]) {
+					pending.append(prefix, prefix_len);
+				}
+				const size_t newline = data.find('\n');
+				const size_t len = (newline == std::string_view::npos) ? data.size() : newline + 1;
+				pending.append(data.substr(0, len));
+				m_line_start[stream] = (newline != std::string_view::npos);
+				data.remove_prefix(len);
+			}
+		}
+		// A VM that writes faster than the flushes writes on its own
+		if (pending.size() > settings::OUTPUT_CAPTURE_BUFFER) {
+			overflow.swap(pending);
+		}
+	}
+	if (!overflow.empty()) {
+		std::lock_guard<std::mutex> lock(write_mutex);
+		write_all(stream + 1, overflow);
+	}
+}
+
+void OutputCapture::start(bool prefix)
+{
+	prefix_lines = prefix;
+	std::thread([] {
+		while (true) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(settings::OUTPUT_CAPTURE_FLUSH_MS));
+			flush();
+		}
+	}).detach();
+	atexit(flush);
+}
+
+OutputCapture::Buffers* OutputCapture::add_vm(unsigned vm)
+{
+	std::lock_guard<std::mutex> lock(buffers_mutex);
+	buffers.push_back(std::make_unique<Buffers>());
+	buffers.back()->m_vm = vm;
+	return buffers.back().get();
+}
+
+void OutputCapture::flush()
+{
+	std::array<std::string, 2> batch;
+	{
+		std::lock_guard<std::mutex> lock(buffers_mutex);
+		for (auto& vm : buffers) {
+			std::lock_guard<std::mutex> vm_lock(vm->m_mutex);
+			for (unsigned stream = 0; stream < 2; stream++) {
+				batch[stream].append(vm->m_pending[stream]);
+				vm->m_pending[stream].clear();
+			}
+		}
+	}
+	std::lock_guard<std::mutex> lock(write_mutex);
+	write_all(STDOUT_FILENO, batch[0]);
+	write_all(STDERR_FILENO, batch[1]);
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+/**
+ * Collects what forked VMs write to stdout and stderr, so that a guest
+ * logging on every request does not make a host system call for every
+ * line. A background thread writes the output of all VMs together, in
+ * batches, optionally prefixing each line with the VM and request.
+**/
+struct OutputCapture
+{
+	/* The output of one VM, only appended to by the thread running it */
+	class Buffers {
+	public:
+		void append(int fd, std::string_view data);
+		void next_request() noexcept { m_request++; }
+
+	private:
+		friend struct OutputCapture;
+		std::mutex m_mutex;
+		std::array<std::string, 2> m_pending; /* stdout, stderr */
+		std::array<bool, 2> m_line_start { true, true };
+		unsigned m_vm = 0;
+		uint64_t m_request = 0;
+	};
+
+	/* Start writing captured output every few milliseconds */
+	static void start(bool prefix);
+	static Buffers* add_vm(unsigned vm);
+	static void flush();
+};
@@ -0,0 +1,65 @@
+#include "paravirt_clock.hpp"
+
+#include "settings.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cpuid.h>
+#include <ctime>
+#include <thread>
+#include <x86intrin.h>
+
+static bool tsc_invariant = false;
+static uint64_t start_tsc = 0;
+static int64_t start_ns = 0;
+
+static int64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return int64_t(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+}
+
+bool ParavirtClock::init()
+{
+	unsigned eax, ebx, ecx, edx;
+	// Invariant TSC: constant rate in all P-, C- and T-states
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || (edx & (1u << 8)) == 0) {
+		return false;
+	}
+	start_ns = clock_ns(CLOCK_MONOTONIC);
+	start_tsc = __rdtsc();
+	// The frequency is measured against this starting point on every
+	// calibration, so it becomes more precise the longer we run.
+	std::this_thread::sleep_for(std::chrono::milliseconds(settings::PARAVIRT_CLOCK_WARMUP_MS));
+	tsc_invariant = true;
+	return true;
+}
+
+bool ParavirtClock::available() noexcept
+{
+	return tsc_invariant;
+}
+
+ParavirtClock::Params ParavirtClock::calibrate(uint64_t guest_tsc)
+{
+	const uint64_t tsc = __rdtsc();
+	const int64_t mono = clock_ns(CLOCK_MONOTONIC);
+	const int64_t real = clock_ns(CLOCK_REALTIME);
+	const unsigned __int128 elapsed_ns = mono - start_ns;
+	const uint64_t elapsed_ticks = tsc - start_tsc;
+	const uint64_t ticks_per_ms = elapsed_ticks * (unsigned __int128)1'000'000 / elapsed_ns;
+	// Shortly after startup the frequency is less precise, so the
+	// parameters expire sooner, limiting how far the guest can drift.
+	const uint64_t valid_ticks = std::min(elapsed_ticks / 8,
+		ticks_per_ms * settings::PARAVIRT_CLOCK_PERIOD_MS);
+
+	// The guest TSC runs at the host rate, but with a per-VM offset,
+	// which is why the guest passes its own reading as the base.
+	return Params {
+		.tsc_base = guest_tsc,
+		.tsc_valid_until = guest_tsc + valid_ticks,
+		.mult = uint64_t((elapsed_ns << 32) / elapsed_ticks),
+		.mono_base = mono,
+		.real_base = real,
+	};
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+
+/**
+ * Lets a guest turn its own TSC readings into host CLOCK_MONOTONIC and
+ * CLOCK_REALTIME nanoseconds without leaving the VM. The guest reads
+ * the TSC, asks the host to calibrate once, and from then on computes
+ * the time itself until the parameters expire or the VM is reset.
+**/
+struct ParavirtClock
+{
+	/* Shared with libkvmserverguest, do not change the layout */
+	struct Params {
+		uint64_t tsc_base;
+		uint64_t tsc_valid_until; /* Zeroed by the host to force recalibration */
+		uint64_t mult;            /* Nanoseconds per tick, 32.32 fixed point */
+		int64_t  mono_base;
+		int64_t  real_base;
+	};
+
+	/* Measures the TSC frequency. Returns false when the TSC is not invariant. */
+	static bool init();
+	static bool available() noexcept;
+	/* Parameters for a guest that read guest_tsc just before exiting */
+	static Params calibrate(uint64_t guest_tsc);
+};
@@ -0,0 +1,139 @@
+#include "path_index.hpp"
+
+#include <algorithm>
+#include <array>
+static constexpr size_t MAX_PATH_DEPTH = 128;
+static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+PathIndex::PathIndex(const decltype(Configuration::allowed_paths)& allowed_paths)
+{
+	m_nodes.emplace_back();
+	for (const auto& [key, vpath] : allowed_paths)
+	{
+		uint32_t node = 0;
+		for (const auto& component : key.relative_path()) {
+			const std::string name = component.string();
+			if (name.empty()) {
+				continue; // Trailing separator
+			}
+			auto& children = m_nodes[node].children;
+			auto it = std::lower_bound(children.begin(), children.end(), name,
+				[](const auto& child, const std::string& name) { return child.first < name; });
+			if (it != children.end() && it->first == name) {
+				node = it->second;
+				continue;
+			}
+			const uint32_t child = m_nodes.size();
+			children.insert(it, {name, child});
+			m_nodes.emplace_back();
+			node = child;
+		}
+		m_nodes[node].entry = m_entries.size();
+		m_entries.push_back(Entry {
+			.real_path = vpath.real_path.string(),
+			.readable = vpath.readable,
+			.writable = vpath.writable,
+			.symlink = vpath.symlink,
+			.scratch = vpath.scratch,
+		});
+	}
+}
+
+uint32_t PathIndex::find_child(uint32_t node, std::string_view name) const noexcept
+{
+	const auto& children = m_nodes[node].children;
+	auto it = std::lower_bound(children.begin(), children.end(), name,
+		[](const auto& child, std::string_view name) { return child.first < name; });
+	if (it != children.end() && it->first == name) {
+		return it->second;
+	}
+	return NO_NODE;
+}
+
+bool PathIndex::grants(const Entry& entry, Access access) noexcept
+{
+	switch (access) {
+	case Readable: return entry.readable;
+	case Writable: return entry.writable;
+	case Any:      return true;
+	}
+	return false;
+}
+
+static bool append_components(std::string_view path,
+	std::array<std::string_view, MAX_PATH_DEPTH>& components, size_t& count)
+{
+	size_t pos = 0;
+	while (pos < path.size()) {
+		size_t end = path.find('/', pos);
+		if (end == std::string_view::npos) {
+			end = path.size();
+		}
+		const std::string_view name = path.substr(pos, end - pos);
+		pos = end + 1;
+		if (name.empty() || name == ".") {
+			continue;
+		}
+		if (name == "..") {
+			if (count > 0) {
+				count--;
+			}
+			continue;
+		}
+		if (count == components.size()) {
+			return false;
+		}
+		components[count++] = name;
+	}
+	return true;
+}
+
+const PathIndex::Entry* PathIndex::lookup(std::string& path, std::string_view cwd, Access access) const
+{
+	// Lexically normalize into components, relative to cwd
+	std::array<std::string_view, MAX_PATH_DEPTH> components;
+	size_t count = 0;
+	if (path.empty() || path.front() != '/') {
+		if (!append_components(cwd, components, count)) {
+			return nullptr;
+		}
+	}
+	if (!append_components(path, components, count)) {
+		return nullptr;
+	}
+
+	// Walk the trie, remembering the deepest entry that grants access
+	const Entry* match = nullptr;
+	size_t matched = 0;
+	uint32_t node = 0;
+	for (size_t i = 0; ; i++) {
+		const int32_t entry = m_nodes[node].entry;
+		if (entry >= 0 && grants(m_entries[entry], access)) {
+			match = &m_entries[entry];
+			matched = i;
+		}
+		if (i == count) {
+			break;
+		}
+		node = find_child(node, components[i]);
+		if (node == NO_NODE) {
+			break;
+		}
+	}
+	if (match == nullptr) {
+		return nullptr;
+	}
+
+	// Real path of the match followed by the remainder of path, built
+	// in a buffer that keeps its capacity, since components refer to path
+	thread_local std::string result;
+	result.assign(match->real_path);
+	for (size_t i = matched; i < count; i++) {
+		if (result.empty() || result.back() != '/') {
+			result += '/';
+		}
+		result.append(components[i]);
+	}
+	path.assign(result);
+	return match;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "config.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * An immutable trie over path components, compiled once from
+ * Configuration::allowed_paths. Lookups normalize the guest path
+ * without allocating, and build the real path in a reused buffer.
+**/
+struct PathIndex
+{
+	enum Access : uint8_t {
+		Readable,
+		Writable,
+		Any, /* Longest prefix regardless of permissions */
+	};
+	struct Entry {
+		std::string real_path;
+		bool readable = false;
+		bool writable = false;
+		bool symlink = false;
+		bool scratch = false;
+	};
+
+	/* Find the longest allowed prefix of path that grants access, and
+	   rewrite path into the matching real path. Returns nullptr when
+	   no prefix grants access, leaving path unchanged. */
+	const Entry* lookup(std::string& path, std::string_view cwd, Access access) const;
+
+	PathIndex(const decltype(Configuration::allowed_paths)& allowed_paths);
+
+private:
+	struct Node {
+		std::vector<std::pair<std::string, uint32_t>> children; // Sorted by name
+		int32_t entry = -1;
+	};
+	uint32_t find_child(uint32_t node, std::string_view name) const noexcept;
+	static bool grants(const Entry& entry, Access access) noexcept;
+
+	std::vector<Node> m_nodes; // m_nodes[0] is the root directory
+	std::vector<Entry> m_entries;
+};
@@ -0,0 +1,478 @@
+#include "profiler.hpp"
+
+#include "settings.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <optional>
+#include <shared_mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <tinykvm/machine.hpp>
+#include <unistd.h>
+
+/**
+ * Function symbols of an ELF file, looked up by file offset, so that
+ * the load address of the guest mapping does not matter.
+**/
+struct ElfSymbols
+{
+	struct Symbol {
+		uint64_t addr;
+		uint64_t size;
+		std::string name;
+	};
+	struct Segment {
+		uint64_t offset;
+		uint64_t vaddr;
+		uint64_t size;
+	};
+	std::string filename;
+	std::vector<Symbol> symbols; /* Sorted by address */
+	std::vector<Segment> segments;
+
+	bool load(int fd);
+	std::string lookup(uint64_t offset) const;
+};
+
+template <typename T>
+static bool read_array(int fd, std::vector<T>& out, uint64_t offset, size_t count)
+{
+	out.resize(count);
+	const size_t bytes = count * sizeof(T);
+	return pread(fd, out.data(), bytes, offset) == ssize_t(bytes);
+}
+
+bool ElfSymbols::load(int fd)
+{
+	Elf64_Ehdr ehdr;
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)
+		|| memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+		return false;
+	}
+	std::vector<Elf64_Phdr> phdrs;
+	if (!read_array(fd, phdrs, ehdr.e_phoff, ehdr.e_phnum)) {
+		return false;
+	}
+	for (const auto& phdr : phdrs) {
+		if (phdr.p_type == PT_LOAD) {
+			segments.push_back({phdr.p_offset, phdr.p_vaddr, phdr.p_filesz});
+		}
+	}
+	std::vector<Elf64_Shdr> shdrs;
+	if (!read_array(fd, shdrs, ehdr.e_shoff, ehdr.e_shnum)) {
+		return false;
+	}
+	// Prefer the full symbol table, and fall back to the dynamic symbols
+	for (const uint32_t type : {SHT_SYMTAB, SHT_DYNSYM}) {
+		for (const auto& shdr : shdrs) {
+			if (shdr.sh_type != type || shdr.sh_link >= shdrs.size()) {
+				continue;
+			}
+			std::vector<Elf64_Sym> syms;
+			std::vector<char> strtab;
+			const auto& strhdr = shdrs[shdr.sh_link];
+			if (!read_array(fd, syms, shdr.sh_offset, shdr.sh_size / sizeof(Elf64_Sym))
+				|| !read_array(fd, strtab, strhdr.sh_offset, strhdr.sh_size)) {
+				continue;
+			}
+			for (const auto& sym : syms) {
+				if (ELF64_ST_TYPE(sym.st_info) == STT_FUNC && sym.st_value != 0 && sym.st_name < strtab.size()) {
+					symbols.push_back({sym.st_value, sym.st_size,
+						std::string(&strtab[sym.st_name], strnlen(&strtab[sym.st_name], strtab.size() - sym.st_name))});
+				}
+			}
+		}
+		if (!symbols.empty()) {
+			break;
+		}
+	}
+	std::sort(symbols.begin(), symbols.end(),
+		[] (const Symbol& a, const Symbol& b) { return a.addr < b.addr; });
+	return true;
+}
+
+static std::string demangle(const std::string& name)
+{
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+	if (demangled == nullptr) {
+		return name;
+	}
+	std::string result(demangled);
+	free(demangled);
+	return result;
+}
+
+std::string ElfSymbols::lookup(uint64_t offset) const
+{
+	char fallback[64];
+	snprintf(fallback, sizeof(fallback), "+0x%lx", (unsigned long)offset);
+	for (const auto& segment : segments) {
+		if (offset < segment.offset || offset >= segment.offset + segment.size) {
+			continue;
+		}
+		const uint64_t vaddr = offset - segment.offset + segment.vaddr;
+		auto it = std::upper_bound(symbols.begin(), symbols.end(), vaddr,
+			[] (uint64_t addr, const Symbol& sym) { return addr < sym.addr; });
+		if (it != symbols.begin()) {
+			--it;
+			if (it->size == 0 || vaddr < it->addr + it->size) {
+				return demangle(it->name);
+			}
+		}
+		break;
+	}
+	return filename + fallback;
+}
+
+/**
+ * Symbols of JIT-compiled code, from a perf map (text lines of
+ * "START SIZE name") or a jitdump file (binary code load records).
+ * The file is read again as the JIT appends to it, at most once per
+ * second, and from the start when it shrinks, such as after a reset.
+**/
+struct JitSymbols
+{
+	JitSymbols(std::string path)
+		: m_path(std::move(path)), m_jitdump(m_path.ends_with(".dump")) {}
+	std::optional<std::string> lookup(uint64_t addr);
+
+private:
+	void refresh();
+	size_t parse_perf_map();
+	size_t parse_jitdump();
+	/* Up to PROFILE_JIT_MAX_SYMBOLS, the file is written by the guest */
+	void add(uint64_t start, uint64_t end, std::string name);
+
+	const std::string m_path;
+	const bool m_jitdump;
+	std::shared_mutex m_mutex;
+	std::map<uint64_t, std::pair<uint64_t, std::string>> m_symbols; /* Start -> end, name */
+	std::string m_pending; /* Read, but not yet a complete line or record */
+	off_t m_parsed = 0;
+	bool m_header_read = false;
+	bool m_finished = false; /* Closed, or not a valid jitdump */
+	std::atomic<int64_t> m_next_refresh {0};
+};
+
+std::optional<std::string> JitSymbols::lookup(uint64_t addr)
+{
+	const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+	int64_t next = m_next_refresh.load(std::memory_order_relaxed);
+	// Only one thread reads the file, the others use what is already known
+	if (now >= next && m_next_refresh.compare_exchange_strong(next,
+		now + std::chrono::steady_clock::duration(std::chrono::seconds(1)).count()))
+	{
+		std::unique_lock<std::shared_mutex> lock(m_mutex);
+		this->refresh();
+	}
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	auto it = m_symbols.upper_bound(addr);
+	if (it == m_symbols.begin()) {
+		return std::nullopt;
+	}
+	--it;
+	if (addr >= it->second.first) {
+		return std::nullopt;
+	}
+	return it->second.second;
+}
+
+void JitSymbols::refresh()
+{
+	const int fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return;
+	}
+	// A truncated file is being written again, even after it was finished
+	if (st.st_size < m_parsed) {
+		m_symbols.clear();
+		m_pending.clear();
+		m_parsed = 0;
+		m_header_read = false;
+		m_finished = false;
+	}
+	char buffer[65536];
+	while (!m_finished && m_parsed < st.st_size) {
+		const ssize_t len = pread(fd, buffer, sizeof(buffer), m_parsed);
+		if (len <= 0) {
+			break;
+		}
+		m_pending.append(buffer, len);
+		m_parsed += len;
+		m_pending.erase(0, m_jitdump ? parse_jitdump() : parse_perf_map());
+		// What is left is less than one line or record
+		if (m_pending.size() > settings::PROFILE_JIT_MAX_RECORD) {
+			m_pending.clear();
+			m_finished = true;
+		}
+	}
+	close(fd);
+}
+
+void JitSymbols::add(uint64_t start, uint64_t end, std::string name)
+{
+	if (m_symbols.size() >= settings::PROFILE_JIT_MAX_SYMBOLS && m_symbols.count(start) == 0) {
+		return;
+	}
+	m_symbols[start] = {end, std::move(name)};
+}
+
+size_t JitSymbols::parse_perf_map()
+{
+	size_t pos = 0;
+	while (true) {
+		const size_t end = m_pending.find('\n', pos);
+		if (end == std::string::npos) {
+			return pos;
+		}
+		const std::string line = m_pending.substr(pos, end - pos);
+		unsigned long start = 0, size = 0;
+		int name = 0;
+		if (sscanf(line.c_str(), "%lx %lx %n", &start, &size, &name) == 2 && name > 0) {
+			add(start, start + size, line.substr(name));
+		}
+		pos = end + 1;
+	}
+}
+
+size_t JitSymbols::parse_jitdump()
+{
+	// See tools/perf/Documentation/jitdump-specification.txt in Linux
+	static constexpr uint32_t JITDUMP_MAGIC = 0x4A695444;
+	enum : uint32_t { JIT_CODE_LOAD = 0, JIT_CODE_MOVE = 1, JIT_CODE_CLOSE = 3 };
+	struct RecordHeader { uint32_t id; uint32_t total_size; uint64_t timestamp; };
+	struct CodeLoad { uint32_t pid, tid; uint64_t vma, code_addr, code_size, code_index; };
+	struct CodeMove { uint32_t pid, tid; uint64_t vma, old_code_addr, new_code_addr, code_size, code_index; };
+
+	size_t pos = 0;
+	if (!m_header_read) {
+		uint32_t header[3]; /* Magic, version and header size */
+		if (m_pending.size() < sizeof(header)) {
+			return 0;
+		}
+		memcpy(header, m_pending.data(), sizeof(header));
+		if (header[0] != JITDUMP_MAGIC) {
+			// Not a jitdump, or one in the other byte order
+			m_finished = true;
+			return m_pending.size();
+		}
+		if (m_pending.size() < header[2]) {
+			return 0;
+		}
+		pos = header[2];
+		m_header_read = true;
+	}
+	RecordHeader record;
+	while (m_pending.size() - pos >= sizeof(record)) {
+		memcpy(&record, &m_pending[pos], sizeof(record));
+		if (record.total_size < sizeof(record)) {
+			m_finished = true; // Corrupt, ignore the rest
+			return m_pending.size();
+		}
+		if (m_pending.size() - pos < record.total_size) {
+			break;
+		}
+		const char* body = &m_pending[pos + sizeof(record)];
+		const size_t body_size = record.total_size - sizeof(record);
+		if (record.id == JIT_CODE_LOAD && body_size > sizeof(CodeLoad)) {
+			CodeLoad load;
+			memcpy(&load, body, sizeof(load));
+			const char* name = body + sizeof(load);
+			add(load.code_addr, load.code_addr + load.code_size,
+				std::string(name, strnlen(name, body_size - sizeof(load))));
+		} else if (record.id == JIT_CODE_MOVE && body_size >= sizeof(CodeMove)) {
+			CodeMove move;
+			memcpy(&move, body, sizeof(move));
+			auto it = m_symbols.find(move.old_code_addr);
+			if (it != m_symbols.end()) {
+				std::string name = std::move(it->second.second);
+				m_symbols.erase(it);
+				add(move.new_code_addr, move.new_code_addr + move.code_size, std::move(name));
+			}
+		} else if (record.id == JIT_CODE_CLOSE) {
+			m_finished = true;
+			return m_pending.size();
+		}
+		pos += record.total_size;
+	}
+	return pos;
+}
+
+Profiler::Profiler(std::string filename, unsigned frequency)
+	: m_filename(std::move(filename)), m_frequency(std::max(1u, frequency))
+{
+	std::thread([this] {
+		while (true) {
+			std::this_thread::sleep_for(std::chrono::seconds(settings::PROFILE_WRITE_INTERVAL));
+			this->write();
+		}
+	}).detach();
+}
+
+std::shared_ptr<const ElfSymbols> Profiler::symbols_for(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_symbols.find({st.st_dev, st.st_ino});
+	if (it != m_symbols.end()) {
+		return it->second;
+	}
+	auto symbols = std::make_shared<ElfSymbols>();
+	// Name the file after the path it was opened with
+	char path[PATH_MAX];
+	const std::string link = "/proc/self/fd/" + std::to_string(fd);
+	const ssize_t len = readlink(link.c_str(), path, sizeof(path) - 1);
+	symbols->filename = (len > 0) ? std::string(path, len) : link;
+	symbols->filename = symbols->filename.substr(symbols->filename.find_last_of('/') + 1);
+	if (!symbols->load(fd)) {
+		symbols->symbols.clear();
+		symbols->segments.clear();
+	}
+	m_symbols.emplace(std::make_pair(st.st_dev, st.st_ino), symbols);
+	return symbols;
+}
+
+bool Profiler::is_jit_symbol_file(std::string_view path)
+{
+	const std::string_view name = path.substr(path.find_last_of('/') + 1);
+	auto numbered = [&] (std::string_view prefix, std::string_view suffix) {
+		if (!name.starts_with(prefix) || !name.ends_with(suffix)
+			|| name.size() <= prefix.size() + suffix.size()) {
+			return false;
+		}
+		const auto pid = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+		return std::all_of(pid.begin(), pid.end(), [] (char c) { return c >= '0' && c <= '9'; });
+	};
+	return numbered("perf-", ".map") || numbered("jit-", ".dump");
+}
+
+std::shared_ptr<JitSymbols> Profiler::jit_symbols_for(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto& symbols = m_jit_symbols[path];
+	if (symbols == nullptr) {
+		symbols = std::make_shared<JitSymbols>(path);
+	}
+	return symbols;
+}
+
+Profiler::Shard& Profiler::shard()
+{
+	thread_local Shard* shard = nullptr;
+	if (shard == nullptr) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shards.push_back(std::make_unique<Shard>());
+		shard = m_shards.back().get();
+	}
+	return *shard;
+}
+
+std::string Profiler::symbolize(tinykvm::Machine& machine, uint64_t addr, const Mappings& mappings,
+	const JitFiles& jit_files, std::string_view binary)
+{
+	for (const auto& mapping : mappings) {
+		if (addr >= mapping.begin && addr < mapping.end) {
+			return mapping.symbols->lookup(addr - mapping.begin + mapping.offset);
+		}
+	}
+	for (const auto& jit_file : jit_files) {
+		if (auto name = jit_file->lookup(addr)) {
+			// Flame graph tools color frames with this suffix as JIT code
+			return *name + "_[j]";
+		}
+	}
+	if (!binary.empty()) {
+		std::string name = machine.resolve(addr, binary);
+		if (!name.empty()) {
+			return name;
+		}
+	}
+	return "[unknown]";
+}
+
+void Profiler::sample(tinykvm::Machine& machine, const Mappings& mappings, const JitFiles& jit_files,
+	std::string_view binary)
+{
+	std::array<uint64_t, settings::PROFILE_MAX_FRAMES> frames;
+	unsigned count = 0;
+	const auto& regs = machine.registers();
+	frames[count++] = regs.rip;
+	uint64_t fp = regs.rbp;
+	while (count < frames.size() && fp != 0 && (fp & 7) == 0) {
+		uint64_t frame[2]; /* Saved frame pointer and return address */
+		try {
+			machine.copy_from_guest(frame, fp, sizeof(frame));
+		} catch (...) {
+			break;
+		}
+		if (frame[1] == 0) {
+			break;
+		}
+		// Return addresses point after the call instruction
+		frames[count++] = frame[1] - 1;
+		// Frames must move up the stack, or we are following garbage
+		if (frame[0] <= fp || frame[0] - fp > settings::MAIN_STACK_SIZE) {
+			break;
+		}
+		fp = frame[0];
+	}
+
+	std::string stack;
+	for (unsigned i = count; i-- > 0; ) {
+		stack += symbolize(machine, frames[i], mappings, jit_files, binary);
+		if (i > 0) {
+			stack += ';';
+		}
+	}
+	auto& shard = this->shard();
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.stacks[std::move(stack)]++;
+}
+
+void Profiler::write()
+{
+	std::unordered_map<std::string, uint64_t> stacks;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& shard : m_shards) {
+			std::lock_guard<std::mutex> shard_lock(shard->mutex);
+			for (const auto& [stack, samples] : shard->stacks) {
+				stacks[stack] += samples;
+			}
+		}
+	}
+	if (stacks.empty()) {
+		return;
+	}
+	// Replace the file atomically, so that readers never see half of it
+	const std::string temporary = m_filename + ".tmp";
+	FILE* fp = fopen(temporary.c_str(), "w");
+	if (fp == nullptr) {
+		fprintf(stderr, "Profiler: Unable to write %s\n", temporary.c_str());
+		return;
+	}
+	for (const auto& [stack, samples] : stacks) {
+		fprintf(fp, "%s %lu\n", stack.c_str(), (unsigned long)samples);
+	}
+	fclose(fp);
+	if (rename(temporary.c_str(), m_filename.c_str()) < 0) {
+		fprintf(stderr, "Profiler: Unable to replace %s\n", m_filename.c_str());
+	}
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+namespace tinykvm { struct Machine; }
+struct ElfSymbols;
+struct JitSymbols;
+
+/**
+ * Samples the guest stacks of forked VMs while they run, and writes
+ * them as folded stacks (one line per unique stack, with its sample
+ * count) that flamegraph.pl, inferno and speedscope can read.
+ *
+ * A VM is sampled when the short vmresume() timeout of its fork thread
+ * fires. Stacks are unwound through frame pointers, so only code built
+ * with -fno-omit-frame-pointer produces complete stacks. JIT-compiled
+ * code is named from the perf map or jitdump files the guest writes.
+**/
+class Profiler
+{
+public:
+	/* An executable mapping of a file in a guest, usually a shared object */
+	struct Mapping {
+		uint64_t begin;
+		uint64_t end;
+		uint64_t offset; /* File offset of begin */
+		std::shared_ptr<const ElfSymbols> symbols;
+	};
+	using Mappings = std::vector<Mapping>;
+	/* Perf map and jitdump files written by a guest */
+	using JitFiles = std::vector<std::shared_ptr<JitSymbols>>;
+
+	Profiler(std::string filename, unsigned frequency);
+	/* Seconds between samples of a VM */
+	float period() const noexcept { return 1.0f / m_frequency; }
+
+	/* Symbols of a file mapped into a guest, shared by all VMs */
+	std::shared_ptr<const ElfSymbols> symbols_for(int fd);
+	/* Whether a guest file is /tmp/perf-<pid>.map or jit-<pid>.dump */
+	static bool is_jit_symbol_file(std::string_view path);
+	/* Symbols from a JIT symbol file, by its real path */
+	std::shared_ptr<JitSymbols> jit_symbols_for(const std::string& path);
+	/* Take a sample of a VM that was stopped by a timeout. The program
+	   binary is used for addresses outside of the mappings. */
+	void sample(tinykvm::Machine& machine, const Mappings& mappings, const JitFiles& jit_files,
+		std::string_view binary);
+	/* Write all samples so far, replacing the file */
+	void write();
+
+private:
+	std::string symbolize(tinykvm::Machine& machine, uint64_t addr, const Mappings& mappings,
+		const JitFiles& jit_files, std::string_view binary);
+	/* Each fork thread counts its stacks separately */
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<std::string, uint64_t> stacks;
+	};
+	Shard& shard();
+
+	const std::string m_filename;
+	const unsigned m_frequency;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<Shard>> m_shards;
+	std::map<std::pair<dev_t, ino_t>, std::shared_ptr<const ElfSymbols>> m_symbols;
+	std::map<std::string, std::shared_ptr<JitSymbols>> m_jit_symbols;
+};
@@ -1,8 +1,34 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
 namespace settings
 {
     static constexpr uint64_t MAIN_STACK_SIZE = 4UL << 20; /* 4MB */
+    static constexpr size_t PATH_CACHE_SLOTS = 512; /* Per access type, a power of two */
+    static constexpr size_t DNS_CACHE_MAX_ENTRIES = 4096;
+    static constexpr uint32_t DNS_CACHE_MAX_TTL = 3600; /* Seconds */
+    static constexpr size_t CLIENT_OUTPUT_BUFFER = 64UL << 10; /* 64KB */
+    static constexpr unsigned CLIENT_OUTPUT_SEND_WAIT_MS = 100; /* For a client that stopped reading */
+    static constexpr unsigned SYSCALL_TABLE_SIZE = 512; /* Wrapped system call numbers */
+    static constexpr unsigned PARAVIRT_CLOCK_WARMUP_MS = 20; /* Initial TSC measurement */
+    static constexpr unsigned PARAVIRT_CLOCK_PERIOD_MS = 1000; /* Guest recalibration interval */
+    static constexpr unsigned PROFILE_MAX_FRAMES = 128;
+    static constexpr unsigned PROFILE_WRITE_INTERVAL = 10; /* Seconds between profile writes */
+    static constexpr size_t PROFILE_JIT_MAX_SYMBOLS = 1UL << 20; /* Per perf map or jitdump file */
+    static constexpr size_t PROFILE_JIT_MAX_RECORD = 1UL << 20; /* Longest line or record kept */
+    static constexpr unsigned LOG_RING_SLOTS = 512; /* Per logging thread */
+    static constexpr unsigned LOG_MESSAGE_SIZE = 240; /* Longer messages are truncated */
+    static constexpr unsigned LOG_RATE_LIMIT = 1000; /* Messages per second per thread */
+    static constexpr unsigned LOG_WRITE_INTERVAL_MS = 5;
+    static constexpr size_t OUTPUT_CAPTURE_BUFFER = 64UL << 10; /* Per VM and stream */
+    static constexpr unsigned OUTPUT_CAPTURE_FLUSH_MS = 20;
+    static constexpr unsigned BENCH_IO_TIMEOUT = 10; /* Seconds to wait for a response */
+    static constexpr size_t BENCH_MAX_RESPONSE = 64UL << 20; /* 64MB */
+    static constexpr unsigned MEMORY_TRIM_INTERVAL_MS = 1000;
+    static constexpr unsigned MEMORY_TRIM_MIN_IDLE = 5; /* Seconds before an idle fork may be trimmed */
+    static constexpr uint32_t MEMORY_TRIM_KEEP = 2UL << 20; /* Working memory kept by a trimmed fork */
+    static constexpr size_t PREFAULT_CHUNK = 64UL << 20; /* Memory populated at a time by a thread */
+    static constexpr unsigned PREFAULT_MAX_THREADS = 16;
 
 }
\ No newline at end of file
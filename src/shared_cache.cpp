@@ -0,0 +1,77 @@
+#include "shared_cache.hpp"
+
+#include <cerrno>
+#include <mutex>
+
+SharedCache::value_t SharedCache::get(std::string_view key) const
+{
+	std::shared_lock lock(m_mtx);
+	auto it = m_entries.find(key);
+	if (it == m_entries.end()) {
+		return nullptr;
+	}
+	if (it->second.expires != clock_type::time_point::max() &&
+		clock_type::now() >= it->second.expires) {
+		return nullptr; // Expired entries are removed by put()
+	}
+	return it->second.value;
+}
+
+int SharedCache::put(std::string_view key, std::string value, uint32_t ttl_ms)
+{
+	const size_t bytes = key.size() + value.size();
+	if (bytes > m_max_bytes) {
+		return -ENOSPC;
+	}
+	Entry entry {
+		.value = std::make_shared<const std::string>(std::move(value)),
+		.expires = (ttl_ms != 0) ?
+			clock_type::now() + std::chrono::milliseconds(ttl_ms) :
+			clock_type::time_point::max(),
+	};
+
+	std::unique_lock lock(m_mtx);
+	auto it = m_entries.find(key);
+	if (it != m_entries.end()) {
+		m_used_bytes -= entry_bytes(it->first, it->second);
+		m_entries.erase(it);
+	}
+	if (m_used_bytes + bytes > m_max_bytes) {
+		// Drop expired entries first, then arbitrary ones until it fits
+		const auto now = clock_type::now();
+		for (auto eit = m_entries.begin(); eit != m_entries.end(); ) {
+			if (now >= eit->second.expires) {
+				m_used_bytes -= entry_bytes(eit->first, eit->second);
+				eit = m_entries.erase(eit);
+			} else {
+				++eit;
+			}
+		}
+		while (m_used_bytes + bytes > m_max_bytes && !m_entries.empty()) {
+			auto eit = m_entries.begin();
+			m_used_bytes -= entry_bytes(eit->first, eit->second);
+			m_entries.erase(eit);
+		}
+	}
+	m_entries.emplace(std::string(key), std::move(entry));
+	m_used_bytes += bytes;
+	return 0;
+}
+
+bool SharedCache::invalidate(std::string_view key)
+{
+	std::unique_lock lock(m_mtx);
+	auto it = m_entries.find(key);
+	if (it == m_entries.end()) {
+		return false;
+	}
+	m_used_bytes -= entry_bytes(it->first, it->second);
+	m_entries.erase(it);
+	return true;
+}
+
+size_t SharedCache::used_bytes() const
+{
+	std::shared_lock lock(m_mtx);
+	return m_used_bytes;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/**
+ * A host-side key-value cache shared by all VMs. Values outlive
+ * ephemeral resets and are handed out as immutable shared strings,
+ * so readers never hold the lock while copying into a guest.
+**/
+struct SharedCache
+{
+	using value_t = std::shared_ptr<const std::string>;
+
+	value_t get(std::string_view key) const;
+	// Returns 0 on success or -ENOSPC when the value cannot fit
+	int put(std::string_view key, std::string value, uint32_t ttl_ms);
+	bool invalidate(std::string_view key);
+
+	size_t max_bytes() const noexcept { return m_max_bytes; }
+	size_t used_bytes() const;
+
+	SharedCache(size_t max_bytes) : m_max_bytes(max_bytes) {}
+
+private:
+	using clock_type = std::chrono::steady_clock;
+	struct Entry {
+		value_t value;
+		clock_type::time_point expires; // time_point::max() when no TTL
+	};
+	struct StringHash {
+		using is_transparent = void;
+		size_t operator()(std::string_view sv) const noexcept { return std::hash<std::string_view>{}(sv); }
+	};
+	static size_t entry_bytes(const std::string& key, const Entry& entry) noexcept {
+		return key.size() + entry.value->size();
+	}
+
+	mutable std::shared_mutex m_mtx;
+	std::unordered_map<std::string, Entry, StringHash, std::equal_to<>> m_entries;
+	const size_t m_max_bytes;
+	size_t m_used_bytes = 0;
+};
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* Compares family, address and port of IPv4 and IPv6 socket addresses */
+inline bool same_address(const struct sockaddr_storage& a, const struct sockaddr_storage& b)
+{
+	if (a.ss_family != b.ss_family)
+		return false;
+	if (a.ss_family == AF_INET) {
+		auto& a4 = reinterpret_cast<const struct sockaddr_in&>(a);
+		auto& b4 = reinterpret_cast<const struct sockaddr_in&>(b);
+		return a4.sin_port == b4.sin_port && a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+	}
+	if (a.ss_family == AF_INET6) {
+		auto& a6 = reinterpret_cast<const struct sockaddr_in6&>(a);
+		auto& b6 = reinterpret_cast<const struct sockaddr_in6&>(b);
+		return a6.sin6_port == b6.sin6_port &&
+			memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(struct in6_addr)) == 0;
+	}
+	return false;
+}
+
+inline socklen_t address_length(const struct sockaddr_storage& addr)
+{
+	return (addr.ss_family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+/* The loopback address of the same family, with port 0 */
+inline struct sockaddr_storage loopback_address(int family)
+{
+	struct sockaddr_storage local {};
+	local.ss_family = family;
+	if (family == AF_INET) {
+		reinterpret_cast<struct sockaddr_in&>(local).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	} else {
+		reinterpret_cast<struct sockaddr_in6&>(local).sin6_addr = in6addr_loopback;
+	}
+	return local;
+}
@@ -0,0 +1,101 @@
+#include "startup_trace.hpp"
+
+#include <cstdio>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
+
+struct TraceEvent {
+	std::string name;
+	pid_t tid;
+	int64_t start_us; /* Since tracing was enabled */
+	int64_t duration_us; /* -1 names the thread */
+};
+static std::string trace_filename;
+static StartupTrace::clock::time_point trace_start;
+static std::mutex trace_mutex;
+static std::vector<TraceEvent> trace_events;
+static bool trace_written = false;
+
+void StartupTrace::enable(const std::string& filename)
+{
+	trace_filename = filename;
+	trace_start = clock::now();
+}
+
+bool StartupTrace::enabled() noexcept
+{
+	return !trace_filename.empty();
+}
+
+void StartupTrace::record(const std::string& name, clock::time_point start, clock::time_point end)
+{
+	if (!enabled()) {
+		return;
+	}
+	using std::chrono::microseconds;
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	trace_events.push_back({name, gettid(),
+		std::chrono::duration_cast<microseconds>(start - trace_start).count(),
+		std::chrono::duration_cast<microseconds>(end - start).count()});
+}
+
+void StartupTrace::name_thread(const std::string& name)
+{
+	if (!enabled()) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	trace_events.push_back({name, gettid(), 0, -1});
+}
+
+static std::string json_string(const std::string& value)
+{
+	std::string out = "\"";
+	for (const char c : value) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char)c < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+void StartupTrace::write()
+{
+	if (!enabled()) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(trace_mutex);
+	if (trace_written) {
+		return;
+	}
+	trace_written = true;
+	FILE* fp = fopen(trace_filename.c_str(), "w");
+	if (fp == nullptr) {
+		fprintf(stderr, "Failed to write the startup trace to %s\n", trace_filename.c_str());
+		return;
+	}
+	const pid_t pid = getpid();
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (size_t i = 0; i < trace_events.size(); i++) {
+		const auto& event = trace_events[i];
+		if (event.duration_us < 0) {
+			fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":%s}}",
+				pid, event.tid, json_string(event.name).c_str());
+		} else {
+			fprintf(fp, "{\"name\":%s,\"cat\":\"startup\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%ld,\"dur\":%ld}",
+				json_string(event.name).c_str(), pid, event.tid, (long)event.start_us, (long)event.duration_us);
+		}
+		fprintf(fp, (i + 1 < trace_events.size()) ? ",\n" : "\n");
+	}
+	fprintf(fp, "]}\n");
+	fclose(fp);
+	printf("Wrote the startup trace to %s\n", trace_filename.c_str());
+}
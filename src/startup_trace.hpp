@@ -0,0 +1,25 @@
+#pragma once
+#include <chrono>
+#include <string>
+
+/**
+ * Records the phases of startup on every thread, and writes them in the
+ * Chrome trace event format, which chrome://tracing and Perfetto open,
+ * so that a slow cold start can be broken down and overlapping or
+ * serialized phases are easy to see. Nothing is recorded unless
+ * enabled, and the file is written once, when startup is done.
+**/
+struct StartupTrace
+{
+	using clock = std::chrono::steady_clock;
+
+	static void enable(const std::string& filename);
+	static bool enabled() noexcept;
+	/* A phase of the calling thread */
+	static void record(const std::string& name, clock::time_point start, clock::time_point end);
+	static void record(const std::string& name, clock::time_point start) { record(name, start, clock::now()); }
+	/* Name the calling thread in the trace */
+	static void name_thread(const std::string& name);
+	/* Write the trace file, the first time only */
+	static void write();
+};
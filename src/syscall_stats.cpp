@@ -0,0 +1,133 @@
+#include "syscall_stats.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+static constexpr size_t REPORT_TOP_SYSCALLS = 20;
+static std::mutex registry_mtx;
+static std::vector<const SyscallStats*> registry;
+static SyscallStats::Totals retired; // Counters of destroyed VMs
+
+SyscallStats::SyscallStats()
+{
+	std::lock_guard lock(registry_mtx);
+	registry.push_back(this);
+}
+SyscallStats::~SyscallStats()
+{
+	std::lock_guard lock(registry_mtx);
+	registry.erase(std::remove(registry.begin(), registry.end(), this), registry.end());
+	this->add_to(retired);
+}
+
+void SyscallStats::add_to(Totals& out) const
+{
+	for (unsigned i = 0; i < SYSCALLS; i++) {
+		const auto& counter = m_counters[i];
+		out.count[i] += counter.count.load(std::memory_order_relaxed);
+		out.nanos[i] += counter.nanos.load(std::memory_order_relaxed);
+		for (unsigned b = 0; b < BUCKETS; b++) {
+			out.histogram[i][b] += counter.histogram[b].load(std::memory_order_relaxed);
+		}
+	}
+	out.requests += m_requests.load(std::memory_order_relaxed);
+}
+
+void SyscallStats::totals(Totals& out)
+{
+	std::lock_guard lock(registry_mtx);
+	out = retired;
+	for (const auto* stats : registry) {
+		stats->add_to(out);
+	}
+}
+
+void SyscallStats::report(FILE* out, const Totals& now, const Totals& before)
+{
+	std::vector<unsigned> order;
+	for (unsigned i = 0; i < SYSCALLS; i++) {
+		if (now.count[i] > before.count[i])
+			order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), [&] (unsigned a, unsigned b) {
+		return now.nanos[a] - before.nanos[a] > now.nanos[b] - before.nanos[b];
+	});
+	if (order.size() > REPORT_TOP_SYSCALLS) {
+		order.resize(REPORT_TOP_SYSCALLS);
+	}
+	const uint64_t requests = now.requests - before.requests;
+	fprintf(out, "System calls over %lu requests:\n", (unsigned long)requests);
+	static const char* bucket_names[BUCKETS] = {
+		"<1us", "<4us", "<16us", "<64us", "<256us", "<1ms", "<4ms", ">=4ms"
+	};
+	fprintf(out, "%8s %12s %10s %10s %10s",
+		"syscall", "count", "per req", "avg us", "total ms");
+	for (unsigned b = 0; b < BUCKETS; b++) {
+		fprintf(out, " %6s", bucket_names[b]);
+	}
+	fprintf(out, " (%%)\n");
+	for (const unsigned i : order) {
+		const uint64_t count = now.count[i] - before.count[i];
+		const uint64_t nanos = now.nanos[i] - before.nanos[i];
+		fprintf(out, "%8u %12lu %10.2f %10.2f %10.2f ",
+			i, (unsigned long)count,
+			requests > 0 ? double(count) / requests : 0.0,
+			double(nanos) / count / 1e3,
+			double(nanos) / 1e6);
+		for (unsigned b = 0; b < BUCKETS; b++) {
+			const uint64_t hits = now.histogram[i][b] - before.histogram[i][b];
+			fprintf(out, " %6.0f", 100.0 * hits / count);
+		}
+		fprintf(out, "\n");
+	}
+	fflush(out);
+}
+
+void SyscallStats::block_report_signal()
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+}
+
+void SyscallStats::start_reporter(unsigned interval)
+{
+	// SIGUSR1 stays blocked everywhere, and is only read from here
+	block_report_signal();
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	const int report_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (report_fd < 0) {
+		perror("SyscallStats: signalfd");
+		return;
+	}
+
+	std::thread([interval, report_fd] {
+		// Each report covers the time since the previous one
+		auto before = std::make_unique<Totals>();
+		auto now = std::make_unique<Totals>();
+		while (true) {
+			struct pollfd pfd { report_fd, POLLIN, 0 };
+			const int result = poll(&pfd, 1, (interval > 0) ? int(interval * 1000) : -1);
+			if (result < 0 && errno != EINTR) {
+				perror("SyscallStats: poll");
+				return;
+			}
+			struct signalfd_siginfo info;
+			while (read(report_fd, &info, sizeof(info)) > 0);
+			totals(*now);
+			report(stderr, *now, *before);
+			std::swap(now, before);
+		}
+	}).detach();
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "settings.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * System call counters of a single VM. They are only written by the
+ * thread running the VM, and read without locks by the reporter, so
+ * recording is two relaxed stores. Every instance is registered, so
+ * that a report can add up all VMs, including ones that are gone.
+**/
+struct SyscallStats
+{
+	static constexpr unsigned SYSCALLS = settings::SYSCALL_TABLE_SIZE;
+	static constexpr unsigned BUCKETS = 8; /* Powers of 4 from <1us up to >=4ms */
+
+	void record(unsigned sysno, uint64_t nanos) noexcept {
+		auto& counter = m_counters[sysno];
+		bump(counter.count, 1);
+		bump(counter.nanos, nanos);
+		bump(counter.histogram[bucket(nanos)], 1);
+	}
+	/* Called on every ephemeral reset, for per-request averages */
+	void count_request() noexcept { bump(m_requests, 1); }
+
+	struct Totals {
+		std::array<uint64_t, SYSCALLS> count {};
+		std::array<uint64_t, SYSCALLS> nanos {};
+		std::array<std::array<uint64_t, BUCKETS>, SYSCALLS> histogram {};
+		uint64_t requests = 0;
+	};
+	/* Sum of all VMs, past and present */
+	static void totals(Totals& out);
+	/* Print the system calls that used the most host time between two totals */
+	static void report(FILE* out, const Totals& now, const Totals& before);
+	/* Block SIGUSR1 in the calling thread and every thread it creates later,
+	   so that it never interrupts a VM. Call before any threads are started. */
+	static void block_report_signal();
+	/* Report every interval seconds (0 = never), and whenever SIGUSR1 arrives */
+	static void start_reporter(unsigned interval);
+
+	SyscallStats();
+	~SyscallStats();
+
+private:
+	struct Counter {
+		std::atomic<uint64_t> count {0};
+		std::atomic<uint64_t> nanos {0};
+		std::array<std::atomic<uint64_t>, BUCKETS> histogram {};
+	};
+	static void bump(std::atomic<uint64_t>& value, uint64_t add) noexcept {
+		value.store(value.load(std::memory_order_relaxed) + add, std::memory_order_relaxed);
+	}
+	static unsigned bucket(uint64_t nanos) noexcept {
+		unsigned b = 0;
+		for (uint64_t limit = 1000; b < BUCKETS - 1 && nanos >= limit; limit *= 4) {
+			b++;
+		}
+		return b;
+	}
+	void add_to(Totals& out) const;
+
+	std::array<Counter, SYSCALLS> m_counters;
+	std::atomic<uint64_t> m_requests {0};
+};
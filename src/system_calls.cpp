@@ -0,0 +1,385 @@
+#include "vm.hpp"
+
+#include "dns_cache.hpp"
+#include "logger.hpp"
+#include "output_capture.hpp"
+#include "settings.hpp"
+#include "sockaddr.hpp"
+#include "syscall_stats.hpp"
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <utility>
+using syscall_t = tinykvm::Machine::syscall_t;
+// The handler that runs inside the wrapper: tinykvm's own, or one below
+static std::array<syscall_t, settings::SYSCALL_TABLE_SIZE> handlers {};
+static std::array<syscall_t, settings::SYSCALL_TABLE_SIZE> original_handlers {};
+static constexpr size_t MAX_BUFFERED_IOVECS = 64;
+
+static bool is_readonly_open(uint64_t flags)
+{
+	return (flags & O_ACCMODE) == O_RDONLY &&
+		(flags & (O_CREAT | O_TRUNC | O_DIRECTORY | O_PATH | O_NOFOLLOW)) == 0;
+}
+
+/* Reads an optional 64-bit file offset from the guest, false on a bad pointer */
+static bool read_offset(tinykvm::Machine& machine, uint64_t addr, off_t& offset, off_t*& poffset)
+{
+	poffset = nullptr;
+	if (addr == 0)
+		return true;
+	try {
+		machine.copy_from_guest(&offset, addr, sizeof(offset));
+	} catch (const tinykvm::MemoryException&) {
+		return false;
+	}
+	poffset = &offset;
+	return true;
+}
+
+/* Writes an updated file offset back to the guest, false on a bad pointer */
+static bool write_offset(tinykvm::Machine& machine, uint64_t addr, off_t offset)
+{
+	try {
+		machine.copy_to_guest(addr, &offset, sizeof(offset));
+	} catch (const tinykvm::MemoryException&) {
+		return false;
+	}
+	return true;
+}
+
+static constexpr bool may_buffer_client_output(unsigned sysno)
+{
+	return sysno == SYS_write || sysno == SYS_writev || sysno == SYS_sendto;
+}
+
+/* System calls that read from the file descriptor in rdi, and that
+   write to the one in rdi, or in rdx for splice() */
+static constexpr bool is_fd_read(unsigned sysno)
+{
+	return sysno == SYS_read || sysno == SYS_readv || sysno == SYS_recvfrom || sysno == SYS_recvmsg
+		|| sysno == SYS_splice;
+}
+static constexpr bool is_fd_write(unsigned sysno)
+{
+	return may_buffer_client_output(sysno) || sysno == SYS_sendmsg || sysno == SYS_sendfile
+		|| sysno == SYS_splice;
+}
+
+/* Wraps every system call. Buffered client output is sent before
+   anything that could make the guest wait, the host time spent is
+   counted per system call number, and the first reads and writes of
+   the tracked client are timestamped. */
+template <unsigned N>
+static void system_call_handler(tinykvm::vCPU& cpu)
+{
+	auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+	if constexpr (!may_buffer_client_output(N)) {
+		vm.flush_client_output();
+	}
+	bool batched_write = false;
+	if constexpr (is_fd_read(N) || is_fd_write(N)) {
+		if (vm.traces_connections()) {
+			const auto& regs = cpu.registers();
+			if (is_fd_read(N) && vm.is_tracked_client(int(regs.rdi))) {
+				vm.trace_connection(VirtualMachine::FirstRead);
+			} else if (is_fd_write(N) && vm.is_tracked_client(int(N == SYS_splice ? regs.rdx : regs.rdi))) {
+				batched_write = may_buffer_client_output(N) && vm.config().batch_client_writes;
+				if (!batched_write) {
+					vm.trace_connection(VirtualMachine::FirstWrite);
+				}
+			}
+		}
+	}
+	const auto t0 = std::chrono::steady_clock::now();
+	handlers[N](cpu);
+	const auto t1 = std::chrono::steady_clock::now();
+	// Buffered writes are timestamped when they are sent to the client
+	if (batched_write && !vm.has_client_output()) {
+		vm.trace_connection(VirtualMachine::FirstWrite);
+	}
+	vm.syscall_stats().record(N, std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+}
+template <unsigned... N>
+static void install_system_call_handlers(std::integer_sequence<unsigned, N...>)
+{
+	((handlers[N] != nullptr ?
+		tinykvm::Machine::install_syscall_handler(N, system_call_handler<N>) : void()), ...);
+}
+
+/* Buffers a write to the tracked client, or performs it normally */
+static void client_write_handler(tinykvm::vCPU& cpu, const VirtualMachine::GuestBuffer* buffers, size_t count,
+	syscall_t original)
+{
+	auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+	long result = 0;
+	if (count > 0 && vm.append_client_output(buffers, count, result)) {
+		auto& regs = cpu.registers();
+		regs.rax = result;
+		cpu.set_registers(regs);
+		return;
+	}
+	vm.flush_client_output();
+	original(cpu);
+}
+
+/* Reads the iovec array of a writev() call, or returns -EFAULT to the guest */
+static bool read_iovecs(tinykvm::vCPU& cpu, VirtualMachine::GuestBuffer* buffers)
+{
+	auto& regs = cpu.registers();
+	try {
+		// struct iovec has the same layout in the guest
+		cpu.machine().copy_from_guest(buffers, regs.rsi, regs.rdx * sizeof(VirtualMachine::GuestBuffer));
+		return true;
+	} catch (const tinykvm::MemoryException&) {
+		regs.rax = -EFAULT;
+		cpu.set_registers(regs);
+		return false;
+	}
+}
+
+/* Replies from the DNS cache come from a local port, but resolvers only
+   accept replies from the nameserver they sent the query to */
+static void restore_dns_source(tinykvm::Machine& machine, const DnsCache& cache, uint64_t addr, socklen_t buflen)
+{
+	if (addr == 0 || buflen < sizeof(sa_family_t)) {
+		return;
+	}
+	struct sockaddr_storage source {};
+	const size_t len = std::min<size_t>(buflen, sizeof(source));
+	try {
+		machine.copy_from_guest(&source, addr, len);
+		if (cache.restore_source(source)) {
+			machine.copy_to_guest(addr, &source, std::min<size_t>(len, address_length(source)));
+		}
+	} catch (const tinykvm::MemoryException&) {
+		// The system call itself already failed or succeeded
+	}
+}
+
+void VirtualMachine::install_system_calls()
+{
+	for (unsigned i = 0; i < settings::SYSCALL_TABLE_SIZE; i++) {
+		original_handlers[i] = tinykvm::Machine::get_syscall_handler(i);
+		handlers[i] = original_handlers[i];
+	}
+
+	// Let the open-file cache tell real read-only opens apart from
+	// other path lookups, such as stat() and readlink()
+	handlers[SYS_open] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+		vm.m_readonly_open = is_readonly_open(cpu.registers().rsi);
+		try {
+			original_handlers[SYS_open](cpu);
+		} catch (...) {
+			vm.m_readonly_open = false;
+			throw;
+		}
+		vm.m_readonly_open = false;
+	};
+	handlers[SYS_openat] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+		vm.m_readonly_open = is_readonly_open(cpu.registers().rdx);
+		try {
+			original_handlers[SYS_openat](cpu);
+		} catch (...) {
+			vm.m_readonly_open = false;
+			throw;
+		}
+		vm.m_readonly_open = false;
+	};
+
+	// Writes to the tracked client with --batch-client-writes,
+	// and to stdout and stderr with --buffer-guest-output
+	handlers[SYS_write] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+		auto& regs = cpu.registers();
+		if (vm.captures_output(regs.rdi)) {
+			const GuestBuffer buffer { regs.rsi, regs.rdx };
+			if (vm.capture_output(regs.rdi, &buffer, 1)) {
+				regs.rax = buffer.len;
+				cpu.set_registers(regs);
+				return;
+			}
+		}
+		if (vm.config().batch_client_writes && vm.is_tracked_client(regs.rdi)) {
+			const GuestBuffer buffer { regs.rsi, regs.rdx };
+			client_write_handler(cpu, &buffer, 1, original_handlers[SYS_write]);
+			return;
+		}
+		vm.flush_client_output();
+		original_handlers[SYS_write](cpu);
+	};
+	handlers[SYS_writev] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+		auto& regs = cpu.registers();
+		if (vm.captures_output(regs.rdi) && regs.rdx > MAX_BUFFERED_IOVECS) {
+			OutputCapture::flush(); // Keep the order of what is written directly
+		} else if (vm.captures_output(regs.rdi)) {
+			std::array<GuestBuffer, MAX_BUFFERED_IOVECS> buffers;
+			if (!read_iovecs(cpu, buffers.data())) {
+				return;
+			}
+			if (vm.capture_output(regs.rdi, buffers.data(), regs.rdx)) {
+				size_t total = 0;
+				VirtualMachine::total_length(buffers.data(), regs.rdx, total);
+				regs.rax = total;
+				cpu.set_registers(regs);
+				return;
+			}
+		}
+		if (vm.config().batch_client_writes && vm.is_tracked_client(regs.rdi)
+			&& regs.rdx <= MAX_BUFFERED_IOVECS) {
+			std::array<GuestBuffer, MAX_BUFFERED_IOVECS> buffers;
+			if (!read_iovecs(cpu, buffers.data())) {
+				return;
+			}
+			client_write_handler(cpu, buffers.data(), regs.rdx, original_handlers[SYS_writev]);
+			return;
+		}
+		vm.flush_client_output();
+		original_handlers[SYS_writev](cpu);
+	};
+	handlers[SYS_sendto] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+		const auto& regs = cpu.registers();
+		// Only plain send() calls without a destination address
+		const uint64_t allowed_flags = MSG_NOSIGNAL | MSG_DONTWAIT | MSG_MORE;
+		if (vm.config().batch_client_writes && vm.is_tracked_client(regs.rdi)
+			&& regs.r8 == 0 && (regs.r10 & ~allowed_flags) == 0) {
+			const GuestBuffer buffer { regs.rsi, regs.rdx };
+			client_write_handler(cpu, &buffer, 1, original_handlers[SYS_sendto]);
+			return;
+		}
+		vm.flush_client_output();
+		original_handlers[SYS_sendto](cpu);
+	};
+
+	// Connected UDP sockets to a nameserver are redirected to the DNS
+	// cache, and replies must appear to come from the nameserver
+	handlers[SYS_recvfrom] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+		const auto args = cpu.registers();
+		socklen_t buflen = 0;
+		if (vm.m_dns_cache != nullptr && args.r8 != 0 && args.r9 != 0) {
+			try {
+				cpu.machine().copy_from_guest(&buflen, args.r9, sizeof(buflen));
+			} catch (const tinykvm::MemoryException&) {
+				buflen = 0;
+			}
+		}
+		original_handlers[SYS_recvfrom](cpu);
+		if (buflen != 0 && int64_t(cpu.registers().rax) >= 0) {
+			restore_dns_source(cpu.machine(), *vm.m_dns_cache, args.r8, buflen);
+		}
+	};
+	handlers[SYS_recvmsg] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+		const auto args = cpu.registers();
+		struct msghdr msg {};
+		if (vm.m_dns_cache != nullptr) {
+			try {
+				cpu.machine().copy_from_guest(&msg, args.rsi, sizeof(msg));
+			} catch (const tinykvm::MemoryException&) {
+				msg = {};
+			}
+		}
+		original_handlers[SYS_recvmsg](cpu);
+		if (msg.msg_name != nullptr && int64_t(cpu.registers().rax) >= 0) {
+			restore_dns_source(cpu.machine(), *vm.m_dns_cache, uint64_t(msg.msg_name), msg.msg_namelen);
+		}
+	};
+
+	// The profiler symbolizes code in files mapped by the dynamic linker
+	handlers[SYS_mmap] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+		const auto args = cpu.registers();
+		original_handlers[SYS_mmap](cpu);
+		const int64_t result = cpu.registers().rax;
+		if ((args.rdx & PROT_EXEC) && !(args.r10 & MAP_ANONYMOUS) && result >= 0) {
+			if (vm.is_profiling()) {
+				vm.add_exec_mapping(result, args.rsi, args.r9, int(args.r8));
+			}
+			if (StartupTrace::enabled() && !vm.is_waiting_for_requests()) {
+				vm.m_library_mapped = StartupTrace::clock::now();
+			}
+		}
+	};
+
+	// sendfile() and splice() run directly on the host fds, so that
+	// file contents never pass through (and dirty) guest memory
+	handlers[SYS_sendfile] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& machine = cpu.machine();
+		auto& regs = cpu.registers();
+		const int out_fd = machine.fds().translate(regs.rdi);
+		const int in_fd = machine.fds().translate(regs.rsi);
+		off_t offset;
+		off_t* poffset;
+		if (out_fd < 0 || in_fd < 0) {
+			regs.rax = -EBADF;
+		} else if (!read_offset(machine, regs.rdx, offset, poffset)) {
+			regs.rax = -EFAULT;
+		} else {
+			const ssize_t result = sendfile(out_fd, in_fd, poffset, regs.r10);
+			regs.rax = (result < 0) ? -errno : result;
+			// The same as the kernel when the offset cannot be updated
+			if (result > 0 && poffset != nullptr && !write_offset(machine, regs.rdx, offset)) {
+				regs.rax = -EFAULT;
+			}
+		}
+		auto& vm = *machine.get_userdata<VirtualMachine>();
+		if (vm.config().verbose_syscalls) {
+			Logger::log(Logger::Debug, "sendfile(vfd=%d (%d), vfd=%d (%d), 0x%lX, %lu) = %ld\n",
+				int(regs.rdi), out_fd, int(regs.rsi), in_fd, (unsigned long)regs.rdx,
+				(unsigned long)regs.r10, (long)regs.rax);
+		}
+		cpu.set_registers(regs);
+	};
+	handlers[SYS_splice] =
+	[] (tinykvm::vCPU& cpu) {
+		auto& machine = cpu.machine();
+		auto& regs = cpu.registers();
+		const int in_fd = machine.fds().translate(regs.rdi);
+		const int out_fd = machine.fds().translate(regs.rdx);
+		off_t in_offset, out_offset;
+		off_t *pin, *pout;
+		if (in_fd < 0 || out_fd < 0) {
+			regs.rax = -EBADF;
+		} else if (!read_offset(machine, regs.rsi, in_offset, pin)
+			|| !read_offset(machine, regs.r10, out_offset, pout)) {
+			regs.rax = -EFAULT;
+		} else {
+			const ssize_t result = splice(in_fd, pin, out_fd, pout, regs.r8, regs.r9);
+			regs.rax = (result < 0) ? -errno : result;
+			if (result > 0 && pin != nullptr && !write_offset(machine, regs.rsi, in_offset)) {
+				regs.rax = -EFAULT;
+			}
+			if (result > 0 && pout != nullptr && !write_offset(machine, regs.r10, out_offset)) {
+				regs.rax = -EFAULT;
+			}
+		}
+		auto& vm = *machine.get_userdata<VirtualMachine>();
+		if (vm.config().verbose_syscalls) {
+			Logger::log(Logger::Debug, "splice(vfd=%d (%d), 0x%lX, vfd=%d (%d), 0x%lX, %lu, 0x%lX) = %ld\n",
+				int(regs.rdi), in_fd, (unsigned long)regs.rsi, int(regs.rdx), out_fd,
+				(unsigned long)regs.r10, (unsigned long)regs.r8, (unsigned long)regs.r9, (long)regs.rax);
+		}
+		cpu.set_registers(regs);
+	};
+
+	install_system_call_handlers(std::make_integer_sequence<unsigned, settings::SYSCALL_TABLE_SIZE>{});
+}
@@ -0,0 +1,523 @@
+#include "upstream_pool.hpp"
+#include "sockaddr.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+static constexpr size_t RELAY_BUFFER_SIZE = 64 * 1024;
+static constexpr size_t MAX_HTTP_HEAD = 64 * 1024;
+static constexpr size_t MAX_CHUNK_LINE = 1024;
+// How long a redirected connection may take to reach the relay
+static constexpr std::chrono::seconds EXPECTED_TIMEOUT {10};
+
+static void set_nodelay(int fd)
+{
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+UpstreamPool::UpstreamPool(const std::vector<struct sockaddr_storage>& upstreams, unsigned max_idle, bool verbose)
+	: m_max_idle(max_idle), m_verbose(verbose)
+{
+	m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (m_epoll_fd < 0 || m_wakeup_fd < 0) {
+		throw std::runtime_error("Upstream pool: " + std::string(strerror(errno)));
+	}
+	struct epoll_event ev {};
+	ev.events = EPOLLIN;
+	ev.data.fd = m_wakeup_fd;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &ev);
+
+	m_upstreams.reserve(upstreams.size());
+	for (const auto& addr : upstreams)
+	{
+		Upstream& upstream = m_upstreams.emplace_back();
+		upstream.addr = addr;
+		// The relay listens on loopback with the same address family as
+		// the upstream, so that the guest socket is able to connect to it
+		struct sockaddr_storage local = loopback_address(addr.ss_family);
+		const int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0 ||
+			bind(fd, reinterpret_cast<struct sockaddr*>(&local), address_length(local)) < 0 ||
+			listen(fd, SOMAXCONN) < 0) {
+			throw std::runtime_error("Upstream pool: relay listener: " + std::string(strerror(errno)));
+		}
+		socklen_t len = sizeof(upstream.relay_addr);
+		getsockname(fd, reinterpret_cast<struct sockaddr*>(&upstream.relay_addr), &len);
+		upstream.listener_fd = fd;
+		watch(fd, EPOLLIN, FdEntry{FdKind::Listener, m_upstreams.size() - 1, nullptr});
+	}
+	m_thread = std::thread(&UpstreamPool::relay_loop, this);
+}
+
+UpstreamPool::~UpstreamPool()
+{
+	m_stop = true;
+	const uint64_t one = 1;
+	if (write(m_wakeup_fd, &one, sizeof(one)) < 0) {
+		perror("Upstream pool: wakeup");
+	}
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	for (auto& [fd, entry] : m_fds) {
+		close(fd);
+	}
+	close(m_wakeup_fd);
+	close(m_epoll_fd);
+}
+
+bool UpstreamPool::redirect(int fd, struct sockaddr_storage& addr)
+{
+	for (const auto& upstream : m_upstreams) {
+		if (same_address(addr, upstream.addr)) {
+			memcpy(&addr, &upstream.relay_addr, address_length(upstream.relay_addr));
+			std::scoped_lock lock(m_expected_mutex);
+			m_expected.push_back(Expected{fd, std::chrono::steady_clock::now()});
+			return true;
+		}
+	}
+	return false;
+}
+
+bool UpstreamPool::expected(int client_fd)
+{
+	// A connection is ours when a redirected socket has the same address
+	// pair, which no other process is able to reproduce while it is open
+	struct sockaddr_storage peer {}, local {};
+	socklen_t peer_len = sizeof(peer), local_len = sizeof(local);
+	if (getpeername(client_fd, reinterpret_cast<struct sockaddr*>(&peer), &peer_len) < 0 ||
+		getsockname(client_fd, reinterpret_cast<struct sockaddr*>(&local), &local_len) < 0) {
+		return false;
+	}
+	const auto now = std::chrono::steady_clock::now();
+	std::scoped_lock lock(m_expected_mutex);
+	for (auto it = m_expected.begin(); it != m_expected.end(); ) {
+		struct sockaddr_storage from {}, to {};
+		socklen_t from_len = sizeof(from), to_len = sizeof(to);
+		if (getsockname(it->fd, reinterpret_cast<struct sockaddr*>(&from), &from_len) == 0 &&
+			getpeername(it->fd, reinterpret_cast<struct sockaddr*>(&to), &to_len) == 0 &&
+			same_address(from, peer) && same_address(to, local)) {
+			m_expected.erase(it);
+			return true;
+		}
+		// The guest closed the socket, or its connect failed
+		if (now - it->since > EXPECTED_TIMEOUT)
+			it = m_expected.erase(it);
+		else
+			++it;
+	}
+	return false;
+}
+
+static bool iequals(std::string_view a, std::string_view b)
+{
+	return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+		[] (char x, char y) { return tolower((unsigned char)x) == tolower((unsigned char)y); });
+}
+static bool icontains(std::string_view haystack, std::string_view needle)
+{
+	for (size_t i = 0; i + needle.size() <= haystack.size(); i++) {
+		if (iequals(haystack.substr(i, needle.size()), needle))
+			return true;
+	}
+	return false;
+}
+static std::string_view trim(std::string_view s)
+{
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+		s.remove_prefix(1);
+	while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r'))
+		s.remove_suffix(1);
+	return s;
+}
+
+void UpstreamPool::HttpFraming::end_head(bool response)
+{
+	std::string_view head = line;
+	size_t eol = head.find("\r\n");
+	const std::string_view start = head.substr(0, eol);
+	int status = 0;
+	if (response) {
+		// Only HTTP/1.1 keeps connections open without asking
+		if (start.size() < 12 || start.substr(0, 9) != "HTTP/1.1 ") {
+			valid = false;
+			return;
+		}
+		status = atoi(std::string(start.substr(9, 3)).c_str());
+	} else {
+		const size_t space = start.find(' ');
+		const std::string_view method = start.substr(0, space);
+		// HEAD responses have no body, and CONNECT turns into a tunnel
+		if (space == std::string_view::npos || start.size() < 9 ||
+			start.substr(start.size() - 9) != " HTTP/1.1" ||
+			method == "HEAD" || method == "CONNECT") {
+			valid = false;
+			return;
+		}
+	}
+	bool chunked = false;
+	bool has_length = false;
+	uint64_t length = 0;
+	while (eol != std::string_view::npos && eol + 2 < head.size()) {
+		const size_t next = head.find("\r\n", eol + 2);
+		const std::string_view field = head.substr(eol + 2, next - eol - 2);
+		eol = next;
+		const size_t colon = field.find(':');
+		if (colon == std::string_view::npos)
+			continue;
+		const std::string_view name = field.substr(0, colon);
+		const std::string_view value = trim(field.substr(colon + 1));
+		if (iequals(name, "Content-Length")) {
+			char* end = nullptr;
+			const std::string number(value);
+			const uint64_t n = strtoull(number.c_str(), &end, 10);
+			if (number.empty() || *end != 0 || (has_length && n != length)) {
+				valid = false;
+				return;
+			}
+			has_length = true;
+			length = n;
+		} else if (iequals(name, "Transfer-Encoding")) {
+			// Chunked must be the final encoding, anything else ends at close
+			if (value.size() < 7 || !iequals(value.substr(value.size() - 7), "chunked")) {
+				valid = false;
+				return;
+			}
+			chunked = true;
+		} else if ((iequals(name, "Connection") && (icontains(value, "close") || icontains(value, "upgrade")))
+			|| iequals(name, "Upgrade")) {
+			valid = false;
+			return;
+		}
+	}
+	line.clear();
+	if (response && status >= 100 && status < 200) {
+		// Interim responses precede the final one, except for a switch
+		if (status == 101)
+			valid = false;
+		return;
+	}
+	if (response && (status == 204 || status == 304)) {
+		messages++;
+	} else if (chunked) {
+		state = ChunkSize;
+	} else if (has_length && length > 0) {
+		remaining = length;
+		state = Body;
+	} else if (has_length || !response) {
+		messages++;
+	} else {
+		valid = false; // The body ends when the upstream closes
+	}
+}
+
+void UpstreamPool::HttpFraming::feed(const char* data, size_t len, bool response)
+{
+	size_t i = 0;
+	while (i < len && valid) {
+		switch (state) {
+		case Head:
+			// Empty lines between messages are ignored
+			if (line.empty() && (data[i] == '\r' || data[i] == '\n')) {
+				i++;
+				break;
+			}
+			line.push_back(data[i++]);
+			if (line.size() > MAX_HTTP_HEAD) {
+				valid = false;
+			} else if (line.size() >= 4 && line.compare(line.size() - 4, 4, "\r\n\r\n") == 0) {
+				end_head(response);
+			}
+			break;
+		case Body:
+		case ChunkData:
+		case ChunkEnd: {
+			const size_t n = std::min<uint64_t>(remaining, len - i);
+			i += n;
+			remaining -= n;
+			if (remaining == 0) {
+				if (state == Body) {
+					messages++;
+					state = Head;
+				} else if (state == ChunkData) {
+					remaining = 2; // The CRLF after the chunk data
+					state = ChunkEnd;
+				} else {
+					state = ChunkSize;
+				}
+			}
+			break;
+		}
+		case ChunkSize:
+		case Trailer:
+			line.push_back(data[i++]);
+			if (line.size() > MAX_CHUNK_LINE) {
+				valid = false;
+			} else if (line.back() == '\n') {
+				if (state == ChunkSize) {
+					char* end = nullptr;
+					remaining = strtoull(line.c_str(), &end, 16);
+					if (end == line.c_str()) {
+						valid = false;
+					}
+					state = (remaining > 0) ? ChunkData : Trailer;
+				} else if (line == "\r\n") {
+					messages++;
+					state = Head;
+				}
+				line.clear();
+			}
+			break;
+		}
+	}
+}
+
+void UpstreamPool::watch(int fd, uint32_t events, FdEntry entry)
+{
+	struct epoll_event ev {};
+	ev.events = events;
+	ev.data.fd = fd;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	m_fds.insert_or_assign(fd, std::move(entry));
+}
+void UpstreamPool::update(int fd, uint32_t events)
+{
+	struct epoll_event ev {};
+	ev.events = events;
+	ev.data.fd = fd;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+void UpstreamPool::unwatch(int fd)
+{
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+	m_fds.erase(fd);
+}
+
+void UpstreamPool::relay_loop()
+{
+	std::array<struct epoll_event, 64> events;
+	while (!m_stop)
+	{
+		const int n = epoll_wait(m_epoll_fd, events.data(), events.size(), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Upstream pool: epoll_wait");
+			return;
+		}
+		for (int i = 0; i < n; i++) {
+			const int fd = events[i].data.fd;
+			auto it = m_fds.find(fd);
+			if (it == m_fds.end()) {
+				continue; // Wakeup, or closed earlier in this batch
+			}
+			const FdEntry entry = it->second;
+			switch (entry.kind) {
+			case FdKind::Listener:
+				while (true) {
+					const int client_fd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+					if (client_fd < 0)
+						break;
+					if (!expected(client_fd)) {
+						if (m_verbose) {
+							fprintf(stderr, "Upstream pool: rejected a connection that was not redirected\n");
+						}
+						close(client_fd);
+						continue;
+					}
+					start_session(entry.upstream, client_fd);
+				}
+				break;
+			case FdKind::Idle: {
+				// An idle connection must stay silent, so data or EOF means
+				// that it can no longer be reused
+				auto& idle = m_upstreams[entry.upstream].idle_fds;
+				idle.erase(std::remove(idle.begin(), idle.end(), fd), idle.end());
+				unwatch(fd);
+				close(fd);
+				break;
+			}
+			case FdKind::Client:
+			case FdKind::UpstreamConn:
+				pump(entry.session);
+				break;
+			}
+		}
+	}
+}
+
+int UpstreamPool::take_idle(Upstream& upstream)
+{
+	while (!upstream.idle_fds.empty()) {
+		const int fd = upstream.idle_fds.back();
+		upstream.idle_fds.pop_back();
+		unwatch(fd);
+		// Make sure nothing arrived since the connection became idle
+		char c;
+		if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+void UpstreamPool::start_session(size_t index, int client_fd)
+{
+	auto& upstream = m_upstreams[index];
+	auto session = std::make_shared<Session>();
+	session->upstream = index;
+	session->client_fd = client_fd;
+	session->to_upstream.data = std::make_unique<char[]>(RELAY_BUFFER_SIZE);
+	session->to_client.data = std::make_unique<char[]>(RELAY_BUFFER_SIZE);
+	session->upstream_fd = take_idle(upstream);
+	session->connecting = false;
+	if (session->upstream_fd < 0) {
+		const int fd = socket(upstream.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0 ||
+			(connect(fd, reinterpret_cast<const struct sockaddr*>(&upstream.addr), address_length(upstream.addr)) < 0
+				&& errno != EINPROGRESS)) {
+			if (m_verbose) {
+				fprintf(stderr, "Upstream pool: connect failed: %s\n", strerror(errno));
+			}
+			if (fd >= 0)
+				close(fd);
+			close(client_fd);
+			return;
+		}
+		set_nodelay(fd);
+		session->upstream_fd = fd;
+		session->connecting = true;
+	} else if (m_verbose) {
+		fprintf(stderr, "Upstream pool: reusing connection %d\n", session->upstream_fd);
+	}
+	set_nodelay(client_fd);
+	watch(client_fd, 0, FdEntry{FdKind::Client, index, session});
+	watch(session->upstream_fd, 0, FdEntry{FdKind::UpstreamConn, index, session});
+	pump(session);
+}
+
+void UpstreamPool::pump(const std::shared_ptr<Session>& session)
+{
+	Session& s = *session;
+	if (s.connecting) {
+		struct pollfd pfd { s.upstream_fd, POLLOUT, 0 };
+		if (poll(&pfd, 1, 0) > 0) {
+			int error = 0;
+			socklen_t len = sizeof(error);
+			getsockopt(s.upstream_fd, SOL_SOCKET, SO_ERROR, &error, &len);
+			if (error != 0) {
+				if (m_verbose) {
+					fprintf(stderr, "Upstream pool: connect failed: %s\n", strerror(error));
+				}
+				finish(session, false);
+				return;
+			}
+			s.connecting = false;
+		}
+	}
+
+	// Move data in both directions until everything would block
+	auto transfer = [] (int from, int to, Buffer& buffer, HttpFraming& framing, bool response,
+		bool& eof, bool can_read, bool can_write) -> int {
+		int progress = 0;
+		if (can_read && !eof && buffer.end < RELAY_BUFFER_SIZE) {
+			const ssize_t r = read(from, &buffer.data[buffer.end], RELAY_BUFFER_SIZE - buffer.end);
+			if (r > 0) {
+				framing.feed(&buffer.data[buffer.end], r, response);
+				buffer.end += r;
+				buffer.received += r;
+				progress = 1;
+			} else if (r == 0) {
+				eof = true;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -1;
+			}
+		}
+		if (can_write && !buffer.empty()) {
+			const ssize_t w = send(to, &buffer.data[buffer.begin], buffer.end - buffer.begin, MSG_NOSIGNAL);
+			if (w > 0) {
+				buffer.begin += w;
+				buffer.sent += w;
+				if (buffer.begin == buffer.end)
+					buffer.begin = buffer.end = 0;
+				progress = 1;
+			} else if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -1;
+			}
+		}
+		return progress;
+	};
+	while (true) {
+		const int up = transfer(s.client_fd, s.upstream_fd, s.to_upstream, s.requests, false,
+			s.client_eof, true, !s.connecting);
+		const int down = transfer(s.upstream_fd, s.client_fd, s.to_client, s.responses, true,
+			s.upstream_eof, !s.connecting, true);
+		if (up < 0 || down < 0) {
+			finish(session, false);
+			return;
+		}
+		if (up == 0 && down == 0)
+			break;
+	}
+
+	// The guest closed its connection, or shut down its sending side
+	if (s.client_eof && s.to_upstream.empty() && !s.connecting && !s.upstream_shutdown) {
+		int unread = 0;
+		ioctl(s.upstream_fd, FIONREAD, &unread);
+		// Keep the upstream only if every request was answered in full,
+		// the guest was given all of it, and nothing else has arrived
+		if (s.requests.at_boundary() && s.responses.at_boundary() &&
+			s.requests.messages == s.responses.messages &&
+			!s.upstream_eof && s.to_client.empty() && unread == 0) {
+			finish(session, true);
+			return;
+		}
+		// Otherwise the guest may still be waiting for the response, which
+		// is relayed until the upstream closes or the guest stops reading,
+		// and the connection is not reused
+		shutdown(s.upstream_fd, SHUT_WR);
+		s.upstream_shutdown = true;
+	}
+	// The upstream closed, and everything has been passed on
+	if (s.upstream_eof && s.to_client.empty()) {
+		finish(session, false);
+		return;
+	}
+	const uint32_t in = EPOLLIN, out = EPOLLOUT;
+	update(s.client_fd,
+		((!s.client_eof && s.to_upstream.end < RELAY_BUFFER_SIZE) ? in : 0u) |
+		(!s.to_client.empty() ? out : 0u));
+	update(s.upstream_fd, s.connecting ? out :
+		((!s.upstream_eof && s.to_client.end < RELAY_BUFFER_SIZE) ? in : 0u) |
+		(!s.to_upstream.empty() ? out : 0u));
+}
+
+void UpstreamPool::finish(const std::shared_ptr<Session>& session, bool reusable)
+{
+	Session& s = *session;
+	unwatch(s.client_fd);
+	close(s.client_fd);
+	unwatch(s.upstream_fd);
+	auto& upstream = m_upstreams[s.upstream];
+	if (reusable && upstream.idle_fds.size() < m_max_idle) {
+		upstream.idle_fds.push_back(s.upstream_fd);
+		watch(s.upstream_fd, EPOLLIN | EPOLLRDHUP, FdEntry{FdKind::Idle, s.upstream, nullptr});
+	} else {
+		close(s.upstream_fd);
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Keeps idle TCP connections to configured upstreams open across
+ * ephemeral resets. Guest connections to a pooled upstream are
+ * redirected to a local relay, which only accepts the connections
+ * redirected here, and pairs them with an idle upstream connection.
+ * The relay follows HTTP/1.1 message framing in both directions, and
+ * returns the upstream connection to the pool when the guest closes
+ * after every request has been answered in full and passed on.
+ * Otherwise, including for anything that is not plain HTTP/1.1, the
+ * end of the guest connection is passed on as a half-close, what the
+ * upstream sends is still relayed, and the connection is then closed.
+**/
+struct UpstreamPool
+{
+	/* Rewrites addr to the relay when it is a pooled upstream, and
+	   expects a connection from the socket fd */
+	bool redirect(int fd, struct sockaddr_storage& addr);
+
+	UpstreamPool(const std::vector<struct sockaddr_storage>& upstreams, unsigned max_idle, bool verbose);
+	~UpstreamPool();
+
+private:
+	struct Upstream {
+		struct sockaddr_storage addr;
+		struct sockaddr_storage relay_addr;
+		int listener_fd = -1;
+		std::vector<int> idle_fds;
+	};
+	struct Buffer {
+		std::unique_ptr<char[]> data;
+		size_t begin = 0;
+		size_t end = 0;
+		uint64_t received = 0;
+		uint64_t sent = 0;
+		bool empty() const noexcept { return begin == end; }
+	};
+	/* Follows HTTP/1.1 message boundaries in one direction */
+	struct HttpFraming {
+		enum State { Head, Body, ChunkSize, ChunkData, ChunkEnd, Trailer };
+		State state = Head;
+		std::string line;       /* Head or chunk line read so far */
+		uint64_t remaining = 0; /* Body or chunk bytes left */
+		uint64_t messages = 0;  /* Complete messages */
+		bool valid = true;      /* False once the stream can no longer be followed */
+		void feed(const char* data, size_t len, bool response);
+		bool at_boundary() const noexcept { return valid && state == Head && line.empty(); }
+	private:
+		void end_head(bool response);
+	};
+	struct Session {
+		size_t upstream;
+		int client_fd;
+		int upstream_fd;
+		bool connecting;
+		bool client_eof = false;
+		bool upstream_eof = false;
+		bool upstream_shutdown = false; /* The client EOF was passed on */
+		Buffer to_upstream;
+		Buffer to_client;
+		HttpFraming requests;
+		HttpFraming responses;
+	};
+	struct Expected {
+		int fd;
+		std::chrono::steady_clock::time_point since;
+	};
+	enum class FdKind { Listener, Idle, Client, UpstreamConn };
+	struct FdEntry {
+		FdKind kind;
+		size_t upstream;
+		std::shared_ptr<Session> session;
+	};
+
+	void relay_loop();
+	bool expected(int client_fd);
+	void start_session(size_t upstream, int client_fd);
+	int take_idle(Upstream& upstream);
+	void pump(const std::shared_ptr<Session>& session);
+	void finish(const std::shared_ptr<Session>& session, bool reusable);
+	void watch(int fd, uint32_t events, FdEntry entry);
+	void update(int fd, uint32_t events);
+	void unwatch(int fd);
+
+	std::vector<Upstream> m_upstreams;
+	std::unordered_map<int, FdEntry> m_fds;
+	std::mutex m_expected_mutex;
+	std::vector<Expected> m_expected;
+	const unsigned m_max_idle;
+	const bool m_verbose;
+	int m_epoll_fd = -1;
+	int m_wakeup_fd = -1;
+	std::atomic<bool> m_stop = false;
+	std::thread m_thread;
+};
@@ -1,19 +1,37 @@
 #include "vm.hpp"
 
 #include "settings.hpp"
+#include "shared_cache.hpp"
+#include "upstream_pool.hpp"
+#include "dns_cache.hpp"
+#include "file_cache.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "paravirt_clock.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
 #include <cstring>
 #include <elf.h>
 #include <fcntl.h>
 #include <filesystem>
 #include <netinet/in.h>
-#include <numeric>
 #include <optional>
 #include <stdexcept>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/signal.h>
 #include <sys/syscall.h>
 #include <sys/un.h>
+#include <thread>
+#include <unistd.h>
 #include <tinykvm/linux/threads.hpp>
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22 /* Linux 5.14 */
+#endif
 extern std::vector<uint8_t> file_loader(const std::string& filename);
 static std::vector<uint8_t> ld_linux_x86_64_so;
 
@@ -62,97 +80,6 @@ static uint64_t dylink_address(const Configuration& config, bool storage)
 	return config.dylink_address_hint;
 }
 
-static bool lookup_allowed_path(
-	std::string& pathinout, const std::string& cwd,
-	const std::map<std::filesystem::path, Configuration::VirtualPath, Configuration::ComparePathSegments>& allowed_paths,
-	std::function<bool(const Configuration::VirtualPath&)> extract
-) {
-	std::filesystem::path path(pathinout);
-	if (path.is_relative()) {
-		path = std::filesystem::path(cwd) / path;
-	}
-	path = (path / "").lexically_normal().parent_path();
-	// Find first key strictly greater than path, e.g.
-	// { /foo: true, /foo/bar: true, /qux: true }.upper_bound(/foo/baz) -> /qux
-	auto it = allowed_paths.upper_bound(path);
-	size_t failsafe = allowed_paths.size();
-	while (it != allowed_paths.begin()) {
-		--it; // Previous key is either the path or shares a common prefix, e.g. /foo/bar.
-		auto [first_it, path_it] = std::mismatch(it->first.begin(), it->first.end(), path.begin(), path.end());
-		if (first_it == it->first.end()) {
-			if (extract(it->second)) {
-				// If that key is itself a prefix return the real_path plus the remainder of path
-				pathinout = std::accumulate(path_it, path.end(), it->second.real_path, std::divides{});
-				return true;
-			}
-			--path_it;
-		}
-		// otherwise lookup the common prefix
-		it = allowed_paths.upper_bound(std::accumulate(path.begin(), path_it, std::filesystem::path("/"), std::divides{}));
-		if (--failsafe == 0) {
-			if (getenv("VERBOSE") != nullptr)
-				fprintf(stderr, "lookup_allowed_path: failsafe triggered for path %s\n", pathinout.c_str());
-			break;
-		}
-	}
-	return false; // no prefix found
-}
-
-static bool validate_network_access(
-	const struct sockaddr_storage& addr,
-	const std::vector<struct sockaddr_storage>& allowed_ipv4,
-	const std::vector<struct sockaddr_storage>& allowed_ipv6
-) {
-	// IPv4
-	if (addr.ss_family == AF_INET)
-	{
-		// Compare the socket address with the allowed address
-		const struct sockaddr_in* addr_ipv4 =
-			reinterpret_cast<const struct sockaddr_in*>(&addr);
-		for (auto& allowed : allowed_ipv4) {
-			const struct sockaddr_in* addr_allowed =
-				reinterpret_cast<const struct sockaddr_in*>(&allowed);
-			if (addr_ipv4->sin_addr.s_addr == addr_allowed->sin_addr.s_addr ||
-					addr_allowed->sin_addr.s_addr == 0) {
-				// The socket address is allowed
-				if (addr_ipv4->sin_port == addr_allowed->sin_port ||
-					addr_allowed->sin_port == 0) {
-					// The socket port is allowed
-					return true;
-				}
-			} // in_addr
-		}
-		// No match found
-		return false;
-	}
-	// IPv6 or unspecified (we are guessing IPv4-mapped IPv6)
-	// XXX: is AF_UNSPEC a liability here? we should probably not allow
-	//      it but some (e.g. bun uses it to mean IPv4-mapped IPv6)
-	if (addr.ss_family == AF_INET6 || addr.ss_family == AF_UNSPEC)
-	{
-		const struct sockaddr_in6* addr_ipv6 =
-			reinterpret_cast<const struct sockaddr_in6*>(&addr);
-		for (auto& allowed : allowed_ipv6) {
-			const struct sockaddr_in6* addr_allowed =
-				reinterpret_cast<const struct sockaddr_in6*>(&allowed);
-			if (memcmp(&addr_allowed->sin6_addr, &in6addr_any, sizeof(struct in6_addr)) == 0 ||
-					memcmp(&addr_allowed->sin6_addr, &addr_ipv6->sin6_addr, sizeof(struct in6_addr)) == 0) {
-				// The socket address is allowed
-				if (addr_allowed->sin6_port == 0 ||
-					addr_ipv6->sin6_port == addr_allowed->sin6_port) {
-					// The socket port is allowed
-					return true;
-				}
-			} // in6_addr
-		}
-		// No match found
-		return false;
-	}
-	// Unknown address family
-	fprintf(stderr, "Unknown address family: %d\n", addr.ss_family);
-	return false;
-}
-
 VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Configuration& config, bool storage)
 	: m_machine(binary.has_value() ? select_main_binary(binary.value()) : std::string_view(), tinykvm::MachineOptions{
 		.max_mem = config.max_address_space,
@@ -162,8 +89,10 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 		.vmem_base_address = !binary.has_value() ? 0 : detect_gigapage_from(binary.value(), dylink_address(config, storage)),
 		.remappings {storage ? config.storage_remappings : config.vmem_remappings},
 		.verbose_loader = config.verbose,
-		.hugepages = config.hugepage_arena_size != 0,
+		.hugepages = config.hugepages || config.hugepage_arena_size != 0,
+		.transparent_hugepages = config.transparent_hugepages,
 		.master_direct_memory_writes = true,
+		// The main VM writes its memory directly, only forks copy on write
 		.split_hugepages = false,
 		.executable_heap = config.executable_heap,
 		.mmap_backed_files = config.mmap_backed_files && (storage || config.snapshot_filename.empty()),
@@ -180,6 +109,7 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 	machine().install_unhandled_syscall_handler(
 		[] (tinykvm::vCPU& cpu, unsigned syscall_number) {
 			auto& vm = *cpu.machine().get_userdata<VirtualMachine>();
+			vm.flush_client_output();
 			switch (syscall_number) {
 			case 67339: // sys_remote_resume
 			case 0x10001:
@@ -188,6 +118,7 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 					const uint64_t src = cpu.registers().rdi;
 					const uint64_t len = cpu.registers().rsi;
 
+					const auto start = std::chrono::steady_clock::now();
 					if (vm.config().storage_ipre_permanent)  {
 						tinykvm::Machine& m = cpu.machine().remote();
 						auto& regs = m.registers();
@@ -196,14 +127,19 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 						m.set_registers(regs);
 
 						m.ipre_permanent_remote_resume_now();
+						vm.record_storage_call(start, start);
 						return;
 					}
 
+					// The callback runs once the storage VM has been acquired
+					auto entered = start;
 					vm.machine().ipre_remote_resume_now(false,
-					[src, len] (tinykvm::Machine& m) {
+					[src, len, &entered] (tinykvm::Machine& m) {
+						entered = std::chrono::steady_clock::now();
 						m.remote().copy_to_guest(m.registers().rdi, &src, sizeof(src));
 						m.registers().rax = len;
 					});
+					vm.record_storage_call(start, entered);
 					return;
 				}
 				throw std::runtime_error("sys_remote_resume should *NOT* be called from storage VM");
@@ -214,13 +150,49 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 					return;
 				}
 				throw std::runtime_error("sys_wait_for_storage_task_paused should *ONLY* be called from storage VM");
+			case 0x10003: { // sys_persist_range
+				auto& regs = vm.machine().registers();
+				regs.rax = vm.persist_range(regs.rdi, regs.rsi);
+				vm.machine().set_registers(regs);
+				return;
+			}
+			case 0x10004: { // sys_cache_get
+				auto& regs = vm.machine().registers();
+				regs.rax = vm.cache_get(regs.rdi, regs.rsi, regs.rdx, regs.rcx);
+				vm.machine().set_registers(regs);
+				return;
+			}
+			case 0x10005: { // sys_cache_put
+				auto& regs = vm.machine().registers();
+				regs.rax = vm.cache_put(regs.rdi, regs.rsi, regs.rdx, regs.rcx, regs.r8);
+				vm.machine().set_registers(regs);
+				return;
+			}
+			case 0x10006: { // sys_cache_invalidate
+				auto& regs = vm.machine().registers();
+				regs.rax = vm.cache_invalidate(regs.rdi, regs.rsi);
+				vm.machine().set_registers(regs);
+				return;
+			}
+			case 0x10007: { // sys_checkpoint
+				auto& regs = vm.machine().registers();
+				regs.rax = vm.checkpoint();
+				vm.machine().set_registers(regs);
+				return;
+			}
+			case 0x10008: { // sys_clock_calibrate
+				auto& regs = vm.machine().registers();
+				regs.rax = vm.clock_calibrate(regs.rdi, regs.rsi);
+				vm.machine().set_registers(regs);
+				return;
+			}
 			}
 			std::string info;
 			if (vm.is_storage())
 				info = " (storage)";
 			else
 				info = " (request " + std::to_string(vm.reqid()) + ")";
-			fprintf(stderr, "Unhandled syscall %d in VM %s%s\n",
+			Logger::log(Logger::Warning, "Unhandled syscall %d in VM %s%s\n",
 				syscall_number, vm.name().c_str(), info.c_str());
 		});
 	machine().set_verbose_system_calls(
@@ -234,20 +206,19 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 	// Set the current working directory
 	machine().fds().set_current_working_directory(
 		config.current_working_directory);
+	// Compile the allowed paths once, shared with all forks
+	m_path_index = std::make_shared<const PathIndex>(config.allowed_paths);
+	this->reset_scratch();
 	machine().fds().set_open_writable_callback(
-	[&] (std::string& path) -> bool {
-		return lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config.allowed_paths, [](const Configuration::VirtualPath& vpath) { return vpath.writable; });
+	[this] (std::string& path) -> bool {
+		return this->open_writable(path);
 	});
 	machine().fds().set_open_readable_callback(
-	[&] (std::string& path) -> bool {
-		return lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config.allowed_paths, [](const Configuration::VirtualPath& vpath) { return vpath.readable; });
+	[this] (std::string& path) -> bool {
+		return this->open_readable(path);
 	});
 	machine().fds().connect_socket_callback =
 	[this] (int fd, struct sockaddr_storage& addr) -> bool {
-		(void)fd;
-
 		// Validate unix socket path against allow-read and allow-write
 		if (addr.ss_family == AF_UNIX)
 		{
@@ -261,8 +232,14 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 		}
 
 		// Validate network addresses against allow-connect
-		return validate_network_access(
-			addr, m_config.allowed_connect_ipv4, m_config.allowed_connect_ipv6);
+		if (!m_config.allowed_connect.contains(addr))
+			return false;
+		// Cached lookups and pooled upstreams are served by the host
+		if (m_dns_cache != nullptr && m_dns_cache->redirect(fd, addr))
+			return true;
+		if (m_upstream_pool != nullptr)
+			m_upstream_pool->redirect(fd, addr);
+		return true;
 	};
 	machine().fds().bind_socket_callback =
 	[this] (int fd, struct sockaddr_storage& addr) -> bool {
@@ -281,8 +258,7 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 		}
 
 		// Validate network addresses against allow-listen
-		return validate_network_access(
-			addr, m_config.allowed_listen_ipv4, m_config.allowed_listen_ipv6);
+		return m_config.allowed_listen.contains(addr);
 	};
 	machine().fds().listening_socket_callback =
 	[this] (int vfd, int fd) -> bool {
@@ -290,23 +266,21 @@ VirtualMachine::VirtualMachine(std::optional<std::string_view> binary, const Con
 	};
 
 	machine().fds().set_resolve_symlink_callback(
-	[&] (std::string& path) -> bool {
-		bool symlink = false;
-		lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config.allowed_paths, [&](const Configuration::VirtualPath& vpath) {
-				symlink = vpath.symlink;
-				// stop iteration here
-				return true;
-		});
-		return symlink;
+	[this] (std::string& path) -> bool {
+		// The longest prefix decides whether this is a symlink
+		const PathIndex::Entry* entry = this->lookup_path(path, PathIndex::Any);
+		return entry != nullptr && entry->symlink;
 	});
 }
 VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool is_storage)
 	: m_machine(other.m_machine, tinykvm::MachineOptions{
 		.max_mem = other.config().max_main_memory,
 		.max_cow_mem = other.config().max_req_mem,
+		// Each fork takes its working memory from a hugepage arena of its own
+		.hugepages = other.config().hugepages || other.config().hugepage_requests_arena != 0,
+		.transparent_hugepages = other.config().transparent_hugepages,
 		.split_hugepages = other.config().split_hugepages,
-		.hugepages_arena_size = other.config().hugepage_arena_size,
+		.hugepages_arena_size = other.config().hugepage_requests_arena,
 	  }),
 	  m_config(other.m_config),
 	  m_original_binary(other.m_original_binary),
@@ -315,8 +289,24 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 	  m_ephemeral(other.m_ephemeral),
 	  m_is_storage(is_storage),
 	  m_master_instance(&other),
-	  m_poll_method(other.m_poll_method)
+	  m_poll_method(other.m_poll_method),
+	  m_persistent_ranges(other.m_persistent_ranges),
+	  m_persistent_data(other.m_persistent_data),
+	  m_shared_cache(other.m_shared_cache),
+	  m_upstream_pool(other.m_upstream_pool),
+	  m_dns_cache(other.m_dns_cache),
+	  m_file_cache(other.m_file_cache),
+	  m_profiler(other.m_profiler),
+	  m_exec_mappings(other.m_exec_mappings),
+	  m_jit_files(other.m_jit_files),
+	  m_path_index(other.m_path_index),
+	  m_clock_params(other.m_clock_params)
 {
+	this->reset_scratch();
+	this->invalidate_clock();
+	if (config().buffer_guest_output && !is_storage) {
+		m_output = OutputCapture::add_vm(reqid);
+	}
 	machine().set_userdata<VirtualMachine> (this);
 	machine().fds().set_verbose(config().verbose);
 	machine().set_verbose_system_calls(config().verbose_syscalls);
@@ -332,14 +322,12 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 			return master->machine().fds().entry_for_vfd(vfd);
 		});
 	machine().fds().set_open_writable_callback(
-	[&] (std::string& path) -> bool {
-		return lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config().allowed_paths, [](const Configuration::VirtualPath& vpath) { return vpath.writable; });
+	[this] (std::string& path) -> bool {
+		return this->open_writable(path);
 	});
 	machine().fds().set_open_readable_callback(
-	[&] (std::string& path) -> bool {
-		return lookup_allowed_path(path, machine().fds().current_working_directory(),
-			config().allowed_paths, [](const Configuration::VirtualPath& vpath) { return vpath.readable; });
+	[this] (std::string& path) -> bool {
+		return this->open_readable(path);
 	});
 	machine().fds().connect_socket_callback = other.machine().fds().connect_socket_callback;
 	machine().fds().bind_socket_callback = other.machine().fds().bind_socket_callback;
@@ -348,11 +336,53 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 	// with a clean slate.
 	if (this->m_ephemeral)
 	{
+		if (MemoryTrimmer::enabled() && !is_storage) {
+			// A new fork has no working memory to release yet
+			m_trim = MemoryTrimmer::add_fork(reqid);
+			m_trim->idle(0, true);
+			// Idle forks also wait for a trim request, and the callbacks
+			// the fork already has are called first
+			auto epoll_wait_callback = std::move(machine().fds().epoll_wait_callback);
+			machine().fds().epoll_wait_callback =
+			[this, previous = std::move(epoll_wait_callback)] (int vfd, int epfd, int timeout) {
+				if (previous && !previous(vfd, epfd, timeout)) {
+					return false;
+				}
+				thread_local std::vector<struct pollfd> wait_fds;
+				wait_fds.assign(1, pollfd{epfd, POLLIN, 0});
+				return !this->stop_for_trim(wait_fds, timeout);
+			};
+			auto poll_callback = std::move(machine().fds().poll_callback);
+			machine().fds().poll_callback =
+			[this, previous = std::move(poll_callback)] (struct pollfd* fds, unsigned nfds, int timeout) {
+				if (previous && !previous(fds, nfds, timeout)) {
+					return false;
+				}
+				thread_local std::vector<struct pollfd> wait_fds;
+				wait_fds.clear();
+				for (unsigned i = 0; i < nfds; i++) {
+					const int fd = machine().fds().translate(fds[i].fd);
+					if (fd >= 0) {
+						wait_fds.push_back(pollfd{fd, fds[i].events, 0});
+					}
+				}
+				return !this->stop_for_trim(wait_fds, timeout);
+			};
+		}
 		machine().fds().accept_callback =
 		[this](int vfd, int fd, int flags) {
+			if (m_trim != nullptr) {
+				// Only a blocking accept() waits for a connection
+				const bool blocking = (fcntl(fd, F_GETFL) & O_NONBLOCK) == 0;
+				thread_local std::vector<struct pollfd> wait_fds;
+				wait_fds.assign(1, pollfd{fd, POLLIN, 0});
+				if (this->stop_for_trim(wait_fds, blocking ? -1 : 0)) {
+					return false; // Don't call accept4
+				}
+			}
 			if (this->m_blocking_connections) {
 					if (UNLIKELY(config().verbose_syscalls)) {
-						fprintf(stderr, "accept4: fd %d (%d) is not accepting connections\n", vfd, fd);
+						Logger::log(Logger::Debug, "accept4: fd %d (%d) is not accepting connections\n", vfd, fd);
 					}
 					auto& regs = machine().registers();
 					regs.rax = -EAGAIN;
@@ -364,26 +394,33 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 		machine().fds().accept_socket_callback =
 		[this](int listener_vfd, int listener_fd, int fd, struct sockaddr_storage& addr, socklen_t& addrlen) {
 			if (this->m_tracked_client_vfd != -1) {
-				fprintf(stderr, "Forked VM %u already has a connection on fd %d (%d)\n",
+				Logger::log(Logger::Warning, "Forked VM %u already has a connection on fd %d (%d)\n",
 					this->m_reqid, this->m_tracked_client_vfd, this->m_tracked_client_fd);
 				return -EAGAIN;
 			}
 			this->m_tracked_client_fd = fd;
 			this->m_tracked_client_vfd = machine().fds().manage(fd, true, true);
-			if (config().verbose) {
-				printf("Forked VM %u accepted connection on vfd %d (%d)\n",
-					this->m_reqid, this->m_tracked_client_vfd, fd);
+			if (m_trim != nullptr) {
+				m_trim->busy();
 			}
+			if (m_metrics != nullptr) {
+				const auto now = std::chrono::steady_clock::now();
+				m_metrics->idle(std::chrono::nanoseconds(now - m_phase_start).count());
+				m_metrics->request();
+				m_phase_start = now;
+				m_connection_events[Accepted] = now;
+			}
+			Logger::log(Logger::Debug, "Forked VM %u accepted connection on vfd %d (%d)\n",
+				this->m_reqid, this->m_tracked_client_vfd, fd);
 			this->m_blocking_connections = true;
 			return this->m_tracked_client_vfd;
 		};
 		machine().fds().free_fd_callback =
 		[this](int vfd, tinykvm::FileDescriptors::Entry& entry) -> bool {
 			if (vfd == this->m_tracked_client_vfd) {
-				if (config().verbose) {
-					printf("Forked VM %u closed connection on fd %d (%d). Resetting...\n",
-						this->m_reqid, this->m_tracked_client_vfd, this->m_tracked_client_fd);
-				}
+				this->trace_connection(Closed);
+				Logger::log(Logger::Debug, "Forked VM %u closed connection on fd %d (%d). Resetting...\n",
+					this->m_reqid, this->m_tracked_client_vfd, this->m_tracked_client_fd);
 				machine().stop();
 				this->m_reset_needed = true;
 				return true; // The VM will be reset
@@ -394,35 +431,528 @@ VirtualMachine::VirtualMachine(const VirtualMachine& other, unsigned reqid, bool
 }
 VirtualMachine::~VirtualMachine()
 {
+	if (!m_scratch_dir.empty()) {
+		std::error_code ec;
+		std::filesystem::remove_all(m_scratch_dir, ec);
+	}
 }
 
-void VirtualMachine::reset_to(const VirtualMachine& other)
+void VirtualMachine::reset_to(const VirtualMachine& other, bool keep_persistent)
 {
+	const auto reset_start = std::chrono::steady_clock::now();
+	const size_t working_memory = machine().banked_memory_pages() * 4096UL;
+	const bool trim = m_trim != nullptr && m_trim->trim_requested();
+	// Save persistent ranges before the memory is reset
+	keep_persistent = keep_persistent && !m_persistent_ranges.empty();
+	if (keep_persistent) {
+		size_t offset = 0;
+		for (const auto& range : m_persistent_ranges) {
+			machine().copy_from_guest(&m_persistent_data[offset], range.addr, range.size);
+			offset += range.size;
+		}
+	}
 	m_machine.reset_to(other.m_machine, tinykvm::MachineOptions{
 		.max_mem = other.m_machine.max_address(),
 		.max_cow_mem = other.config().max_req_mem,
 		.stack_size = settings::MAIN_STACK_SIZE,
-		.reset_free_work_mem = other.config().limit_req_mem,
+		.reset_free_work_mem = trim ? settings::MEMORY_TRIM_KEEP : other.config().limit_req_mem,
 		.reset_copy_all_registers = true,
-		.reset_keep_all_work_memory = other.config().ephemeral_keep_working_memory,
+		.reset_keep_all_work_memory = other.config().ephemeral_keep_working_memory && !trim,
 	});
+	if (keep_persistent) {
+		size_t offset = 0;
+		for (const auto& range : m_persistent_ranges) {
+			machine().copy_to_guest(range.addr, &m_persistent_data[offset], range.size);
+			offset += range.size;
+		}
+	}
+	this->reset_scratch();
+	this->m_clock_params = other.m_clock_params;
+	this->invalidate_clock();
+	this->m_exec_mappings = other.m_exec_mappings;
+	this->m_jit_files = other.m_jit_files;
+	m_syscall_stats->count_request();
+	if (m_output != nullptr) {
+		m_output->next_request();
+	}
+	if (m_metrics != nullptr) {
+		// Resetting is part of the request that needed it
+		const auto reset_end = std::chrono::steady_clock::now();
+		const uint64_t phase_ns = std::chrono::nanoseconds(reset_end - m_phase_start).count();
+		if (m_tracked_client_vfd != -1) {
+			m_metrics->busy(phase_ns);
+		} else {
+			m_metrics->idle(phase_ns);
+		}
+		m_metrics->reset(std::chrono::nanoseconds(reset_end - reset_start).count(), working_memory);
+		m_phase_start = reset_end;
+		this->record_connection(reset_end);
+	}
 	if (this->m_on_reset_callback) {
 		this->m_on_reset_callback();
 	}
 
 	this->m_tracked_client_fd = -1;
 	this->m_tracked_client_vfd = -1;
+	this->m_client_output.clear();
+	this->m_client_output_error = 0;
 	this->m_blocking_connections = false;
+	this->m_path_cache_generation++;
+	if (m_trim != nullptr) {
+		m_trim->idle(machine().banked_memory_pages() * 4096UL, trim);
+	}
+}
+
+bool VirtualMachine::stop_for_trim(std::vector<struct pollfd>& wait_fds, int timeout)
+{
+	// Only a fork waiting for a connection can be trimmed, and it is
+	// stopped here so that resume_fork() resets it with less memory.
+	if (m_trim == nullptr || m_tracked_client_vfd != -1) {
+		return false;
+	}
+	// A wait without a timeout is done here first, together with the
+	// wakeup of the trimmer. Waits with a timeout check on every call.
+	if (timeout < 0 && !m_trim->trim_requested()) {
+		wait_fds.push_back(pollfd{m_trim->wakeup_fd(), POLLIN, 0});
+		while (poll(wait_fds.data(), wait_fds.size(), -1) < 0 && errno == EINTR);
+	}
+	if (!m_trim->trim_requested()) {
+		return false;
+	}
+	Logger::log(Logger::Debug, "Forked VM %u is idle. Releasing its working memory...\n", m_reqid);
+	machine().stop();
+	this->m_reset_needed = true;
+	return true;
+}
+
+const PathIndex::Entry* VirtualMachine::lookup_path(std::string& path, PathIndex::Access access)
+{
+	static_assert((settings::PATH_CACHE_SLOTS & (settings::PATH_CACHE_SLOTS - 1)) == 0);
+	// Relative paths depend on the working directory, so they are not cached
+	PathLookup* slot = nullptr;
+	if (!path.empty() && path.front() == '/') {
+		auto& cache = m_path_cache[access];
+		if (cache.empty()) {
+			cache.resize(settings::PATH_CACHE_SLOTS);
+		}
+		slot = &cache[std::hash<std::string_view>{}(path) & (settings::PATH_CACHE_SLOTS - 1)];
+		if (slot->generation == m_path_cache_generation && slot->key == path) {
+			if (slot->entry != nullptr) {
+				path.assign(slot->path);
+			}
+			return slot->entry;
+		}
+		slot->key.assign(path);
+	}
+
+	const PathIndex::Entry* entry = m_path_index->lookup(path,
+		machine().fds().current_working_directory(), access);
+	if (entry != nullptr && entry->scratch) {
+		path.insert(0, m_scratch_dir);
+	}
+	if (slot != nullptr) {
+		slot->entry = entry;
+		slot->path.assign(entry != nullptr ? std::string_view(path) : std::string_view());
+		slot->generation = m_path_cache_generation;
+	}
+	return entry;
+}
+
+bool VirtualMachine::total_length(const GuestBuffer* buffers, size_t count, size_t& total)
+{
+	total = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (buffers[i].len > size_t(SSIZE_MAX) - total) {
+			return false;
+		}
+		total += buffers[i].len;
+	}
+	return true;
+}
+
+bool VirtualMachine::append_client_output(const GuestBuffer* buffers, size_t count, long& result)
+{
+	size_t total = 0;
+	if (!total_length(buffers, count, total)) {
+		return false; // Write directly, and let the kernel reject it
+	}
+	if (m_client_output_error != 0) {
+		// A previous write that the guest saw succeed could not be sent
+		result = -m_client_output_error;
+		m_client_output_error = 0;
+		return true;
+	}
+	// Only what the socket takes right away is buffered. Anything more is
+	// written directly after the buffer, so the guest sees a full socket.
+	if (m_client_output.empty()) {
+		m_client_output_space = std::min(settings::CLIENT_OUTPUT_BUFFER, client_send_space());
+	}
+	if (m_client_output.size() + total > m_client_output_space) {
+		return false;
+	}
+	const size_t start = m_client_output.size();
+	m_client_output.resize(start + total);
+	try {
+		size_t offset = start;
+		for (size_t i = 0; i < count; i++) {
+			machine().copy_from_guest(&m_client_output[offset], buffers[i].addr, buffers[i].len);
+			offset += buffers[i].len;
+		}
+	} catch (const tinykvm::MemoryException&) {
+		m_client_output.resize(start);
+		result = -EFAULT;
+		return true;
+	}
+	result = total;
+	return true;
+}
+
+bool VirtualMachine::captures_output(int vfd) const
+{
+	if (m_output == nullptr || (vfd != 1 && vfd != 2)) {
+		return false;
+	}
+	// Not when the guest has replaced its stdout or stderr
+	const int fd = machine().fds().translate(vfd);
+	return fd < 0 || fd == vfd;
+}
+
+bool VirtualMachine::capture_output(int vfd, const GuestBuffer* buffers, size_t count)
+{
+	size_t total = 0;
+	if (!total_length(buffers, count, total) || total > settings::OUTPUT_CAPTURE_BUFFER) {
+		OutputCapture::flush(); // Keep the order of what is written directly
+		return false;
+	}
+	thread_local std::string data;
+	data.resize(total);
+	try {
+		size_t offset = 0;
+		for (size_t i = 0; i < count; i++) {
+			machine().copy_from_guest(&data[offset], buffers[i].addr, buffers[i].len);
+			offset += buffers[i].len;
+		}
+	} catch (...) {
+		return false; // Let the write fail normally
+	}
+	m_output->append(vfd, data);
+	return true;
+}
+
+size_t VirtualMachine::client_send_space() const
+{
+	int sndbuf = 0;
+	int queued = 0;
+	socklen_t len = sizeof(sndbuf);
+	if (getsockopt(m_tracked_client_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0 ||
+		ioctl(m_tracked_client_fd, SIOCOUTQ, &queued) < 0) {
+		return 0;
+	}
+	// Half of SO_SNDBUF is for the data, the kernel doubles it for overhead
+	return (sndbuf / 2 > queued) ? size_t(sndbuf / 2 - queued) : 0;
+}
+
+bool VirtualMachine::send_client_output()
+{
+	const auto deadline = std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(settings::CLIENT_OUTPUT_SEND_WAIT_MS);
+	size_t offset = 0;
+	while (offset < m_client_output.size()) {
+		const ssize_t n = send(m_tracked_client_fd, &m_client_output[offset],
+			m_client_output.size() - offset, MSG_NOSIGNAL);
+		if (n > 0) {
+			if (offset == 0) {
+				this->trace_connection(FirstWrite);
+			}
+			offset += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// The guest has already seen these writes succeed. They were
+			// sized to fit the socket, so a short wait is enough.
+			const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now()).count();
+			struct pollfd pfd { m_tracked_client_fd, POLLOUT, 0 };
+			if (left > 0 && poll(&pfd, 1, int(left)) > 0)
+				continue;
+		}
+		// The next write to the client reports the error
+		m_client_output_error = (n < 0) ? errno : EPIPE;
+		Logger::log(Logger::Debug, "Forked VM %u: unable to send buffered output to client fd %d\n",
+			m_reqid, m_tracked_client_fd);
+		m_client_output.clear();
+		return false;
+	}
+	m_client_output.clear();
+	return true;
+}
+
+bool VirtualMachine::open_readable(std::string& path)
+{
+	const bool cache_open = m_readonly_open && m_file_cache != nullptr;
+	std::string original;
+	if (cache_open) {
+		original = path;
+	}
+	const PathIndex::Entry* entry = this->lookup_path(path, PathIndex::Readable);
+	if (entry == nullptr) {
+		return false;
+	}
+	// Read-only opens of files that no VM can write to are served
+	// from descriptors kept open on the host. A deeper writable path
+	// may be below a read-only one, so writability is looked up too.
+	if (cache_open && !entry->writable && this->lookup_path(original, PathIndex::Writable) == nullptr) {
+		m_file_cache->substitute(path);
+	}
+	return true;
+}
+
+bool VirtualMachine::open_writable(std::string& path)
+{
+	// Every path that the guest may change goes through here,
+	// including unlink(), mkdir() and rename()
+	const PathIndex::Entry* entry = this->lookup_path(path, PathIndex::Writable);
+	if (entry == nullptr) {
+		return false;
+	}
+	if (entry->scratch) {
+		m_scratch_dirty = true;
+	}
+	// JIT runtimes write their symbols here for perf, the profiler reads them
+	if (m_profiler != nullptr && Profiler::is_jit_symbol_file(path)) {
+		auto symbols = m_profiler->jit_symbols_for(path);
+		if (std::find(m_jit_files.begin(), m_jit_files.end(), symbols) == m_jit_files.end()) {
+			m_jit_files.push_back(std::move(symbols));
+		}
+	}
+	return true;
+}
+
+void VirtualMachine::reset_scratch()
+{
+	// Requests that did not write to a scratch path leave nothing to undo
+	if (m_config.scratch_paths.empty() || !m_scratch_dirty) {
+		return;
+	}
+	static std::atomic<unsigned> scratch_counter = 0;
+	if (m_scratch_dir.empty()) {
+		m_scratch_dir = m_config.scratch_root + "/" + std::to_string(scratch_counter++);
+	}
+	std::error_code ec;
+	std::filesystem::remove_all(m_scratch_dir, ec);
+	// Every request starts out with what the main VM left behind
+	if (!ec && m_master_instance != nullptr) {
+		std::filesystem::copy(m_master_instance->m_scratch_dir, m_scratch_dir,
+			std::filesystem::copy_options::recursive | std::filesystem::copy_options::copy_symlinks, ec);
+	}
+	for (const auto& path : m_config.scratch_paths) {
+		if (ec)
+			break;
+		std::filesystem::create_directories(m_scratch_dir + path.string(), ec);
+	}
+	if (ec) {
+		throw std::runtime_error("Unable to reset scratch directory " + m_scratch_dir + ": " + ec.message());
+	}
+	m_scratch_dirty = false;
+}
+
+int VirtualMachine::persist_range(gaddr_t addr, size_t size)
+{
+	if (m_is_storage || size == 0) {
+		return -EINVAL;
+	}
+	// A range allocated during a request is free memory in the main VM,
+	// and restoring it after a reset would corrupt the guest allocator
+	if (m_master_instance != nullptr || is_waiting_for_requests()) {
+		return -EPERM;
+	}
+	for (const auto& range : m_persistent_ranges) {
+		if (range.addr == addr && range.size == size) {
+			return 0; // Already registered
+		}
+	}
+	if (m_persistent_data.size() > config().max_persistent_mem
+		|| size > config().max_persistent_mem - m_persistent_data.size()) {
+		Logger::log(Logger::Debug, "VM %s: persistent memory limit reached (%zu bytes)\n",
+			name().c_str(), m_persistent_data.size());
+		return -ENOMEM;
+	}
+	// Validate the range by reading it once
+	const size_t offset = m_persistent_data.size();
+	m_persistent_data.resize(offset + size);
+	try {
+		machine().copy_from_guest(&m_persistent_data[offset], addr, size);
+	} catch (const tinykvm::MemoryException&) {
+		m_persistent_data.resize(offset);
+		return -EFAULT;
+	}
+	m_persistent_ranges.push_back(PersistentRange{addr, size});
+	return 0;
+}
+
+static constexpr size_t SHARED_CACHE_MAX_KEY = 4096;
+
+long VirtualMachine::cache_get(gaddr_t key, size_t keylen, gaddr_t buffer, size_t buflen)
+{
+	if (m_shared_cache == nullptr) {
+		return -ENOSYS;
+	}
+	if (keylen > SHARED_CACHE_MAX_KEY) {
+		return -EINVAL;
+	}
+	try {
+		std::string keybuf(keylen, '\0');
+		machine().copy_from_guest(keybuf.data(), key, keylen);
+		auto value = m_shared_cache->get(keybuf);
+		if (value == nullptr) {
+			return -ENOENT;
+		}
+		// Copy as much as fits, and let the guest retry with a larger buffer
+		machine().copy_to_guest(buffer, value->data(), std::min(buflen, value->size()));
+		return value->size();
+	} catch (const tinykvm::MemoryException&) {
+		return -EFAULT;
+	}
+}
+
+long VirtualMachine::cache_put(gaddr_t key, size_t keylen, gaddr_t value, size_t len, uint32_t ttl_ms)
+{
+	if (m_shared_cache == nullptr) {
+		return -ENOSYS;
+	}
+	if (keylen > SHARED_CACHE_MAX_KEY) {
+		return -EINVAL;
+	}
+	if (len > m_shared_cache->max_bytes()) {
+		return -ENOSPC; // The same as SharedCache::put()
+	}
+	try {
+		std::string keybuf(keylen, '\0');
+		machine().copy_from_guest(keybuf.data(), key, keylen);
+		std::string valuebuf(len, '\0');
+		machine().copy_from_guest(valuebuf.data(), value, len);
+		return m_shared_cache->put(keybuf, std::move(valuebuf), ttl_ms);
+	} catch (const tinykvm::MemoryException&) {
+		return -EFAULT;
+	}
+}
+
+long VirtualMachine::cache_invalidate(gaddr_t key, size_t keylen)
+{
+	if (m_shared_cache == nullptr) {
+		return -ENOSYS;
+	}
+	if (keylen > SHARED_CACHE_MAX_KEY) {
+		return -EINVAL;
+	}
+	try {
+		std::string keybuf(keylen, '\0');
+		machine().copy_from_guest(keybuf.data(), key, keylen);
+		return m_shared_cache->invalidate(keybuf) ? 0 : -ENOENT;
+	} catch (const tinykvm::MemoryException&) {
+		return -EFAULT;
+	}
+}
+
+int VirtualMachine::checkpoint()
+{
+	if (m_is_storage) {
+		return -EINVAL;
+	}
+	// Forks are created after the checkpoint, so it has already happened
+	if (m_master_instance != nullptr || m_checkpoint_reached) {
+		return -EALREADY;
+	}
+	Logger::log(Logger::Info, "VM %s reached its checkpoint\n", name().c_str());
+	this->m_checkpoint_reached = true;
+	// Without a listening socket yet, the main VM is captured the first
+	// time it waits on one. Otherwise it is captured here, and forks
+	// start by returning from this call.
+	if (config().wait_for_checkpoint && m_tracked_client_vfd != -1) {
+		this->m_poll_method = PollMethod::Checkpoint;
+		this->set_waiting_for_requests(true);
+		this->machine().stop();
+	}
+	return 0;
+}
+
+void VirtualMachine::record_connection(std::chrono::steady_clock::time_point reset_end)
+{
+	const auto& events = m_connection_events;
+	auto record = [&] (ForkMetrics::Phase phase, std::chrono::steady_clock::time_point from,
+		std::chrono::steady_clock::time_point to)
+	{
+		// Events that did not happen, such as a close after a timeout, are left out
+		if (from != std::chrono::steady_clock::time_point{} && to != std::chrono::steady_clock::time_point{}) {
+			m_metrics->phase(phase, std::chrono::nanoseconds(to - from).count());
+		}
+	};
+	record(ForkMetrics::AcceptToRead, events[Accepted], events[FirstRead]);
+	record(ForkMetrics::ReadToWrite, events[FirstRead], events[FirstWrite]);
+	record(ForkMetrics::WriteToClose, events[FirstWrite], events[Closed]);
+	record(ForkMetrics::CloseToReset, events[Closed], reset_end);
+	record(ForkMetrics::Total, events[Accepted], reset_end);
+	m_connection_events = {};
+}
+
+void VirtualMachine::record_storage_call(std::chrono::steady_clock::time_point start,
+	std::chrono::steady_clock::time_point entered)
+{
+	if (m_metrics != nullptr) {
+		const auto end = std::chrono::steady_clock::now();
+		m_metrics->storage_call(std::chrono::nanoseconds(end - start).count(),
+			std::chrono::nanoseconds(entered - start).count());
+	}
+}
+
+int VirtualMachine::clock_calibrate(gaddr_t params, uint64_t guest_tsc)
+{
+	if (!config().paravirt_clock || !ParavirtClock::available()) {
+		return -ENOTSUP;
+	}
+	const auto result = ParavirtClock::calibrate(guest_tsc);
+	try {
+		machine().copy_to_guest(params, &result, sizeof(result));
+	} catch (const tinykvm::MemoryException&) {
+		return -EFAULT;
+	}
+	this->m_clock_params = params;
+	return 0;
+}
+
+void VirtualMachine::invalidate_clock()
+{
+	// Forks have their own TSC offset, and a reset rolls back to the
+	// parameters of the main VM, so the guest must calibrate again.
+	if (m_clock_params != 0) {
+		const uint64_t expired = 0;
+		try {
+			machine().copy_to_guest(m_clock_params + offsetof(ParavirtClock::Params, tsc_valid_until),
+				&expired, sizeof(expired));
+		} catch (const tinykvm::MemoryException&) {
+			// The guest unmapped its parameters, and will calibrate again
+			this->m_clock_params = 0;
+		}
+	}
 }
 
 VirtualMachine::InitResult VirtualMachine::initialize_from_file()
 {
 	InitResult result;
 	auto start = std::chrono::high_resolution_clock::now();
+	auto phase = [this] (const char* name) {
+		return (m_is_storage) ? std::string("storage ") + name : std::string(name);
+	};
+	auto trace_start = StartupTrace::clock::now();
 	this->set_waiting_for_requests(true);
 	this->machine().prepare_copy_on_write();
+	StartupTrace::record(phase("prepare copy-on-write"), trace_start);
 	if (this->machine().has_snapshot_state()) {
+		trace_start = StartupTrace::clock::now();
 		this->load_state();
+		StartupTrace::record(phase("load snapshot state"), trace_start);
 	}
 	auto end = std::chrono::high_resolution_clock::now();
 	result.initialization_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
@@ -438,6 +968,11 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 	}
 
 	auto start = std::chrono::high_resolution_clock::now();
+	// Phases of the storage VM are told apart by name in startup traces
+	auto phase = [this] (const char* name) {
+		return (m_is_storage) ? std::string("storage ") + name : std::string(name);
+	};
+	auto trace_start = StartupTrace::clock::now();
 	try {
 		// Use constrained working memory
 		machine().prepare_copy_on_write(config().max_main_memory);
@@ -472,6 +1007,7 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 
 		// Build stack, auxvec, envp and program arguments
 		machine().setup_linux(args, envp);
+		StartupTrace::record(phase("setup linux"), trace_start);
 
 		// If verbose pagetables, print them just before running
 		if (config().verbose_pagetable) {
@@ -487,11 +1023,12 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 			}
 			this->m_tracked_client_vfd = vfd;
 			this->m_tracked_client_fd = fd;
+			this->m_listener_found = StartupTrace::clock::now();
 			return true;
 		};
 		machine().fds().epoll_wait_callback =
 		[this](int vfd, int epfd, int timeout) {
-			if (this->m_tracked_client_vfd != -1) {
+			if (this->m_tracked_client_vfd != -1 && !this->checkpoint_pending()) {
 				// Find the listening socket in the epoll set
 				const auto& entry = machine().fds().get_epoll_entry_for_vfd(vfd);
 				if (entry.epoll_fds.find(m_tracked_client_vfd) == entry.epoll_fds.end()) {
@@ -509,7 +1046,7 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 		};
 		machine().fds().poll_callback =
 		[this](struct pollfd* fds, unsigned nfds, int timeout) {
-			if (this->m_tracked_client_vfd != -1) {
+			if (this->m_tracked_client_vfd != -1 && !this->checkpoint_pending()) {
 				// Find the listening socket in the poll set
 				for (unsigned i = 0; i < nfds; i++) {
 					if (fds[i].fd == this->m_tracked_client_vfd) {
@@ -524,7 +1061,8 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 		};
 		machine().fds().accept_callback =
 		[this](int vfd, int fd, int flags) {
-			if (this->m_tracked_client_vfd != -1 && this->m_poll_method == PollMethod::Undefined) {
+			if (this->m_tracked_client_vfd != -1 && this->m_poll_method == PollMethod::Undefined
+				&& !this->checkpoint_pending()) {
 				if (vfd == this->m_tracked_client_vfd) {
 					// Check whether the listening socket has been set non-blocking.
 					int fdflags = fcntl(fd, F_GETFL);
@@ -541,6 +1079,7 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 			return true; // Call accept4
 		};
 		// Continue/resume or run through main()
+		const auto run_start = StartupTrace::clock::now();
 		if (getenv("DEBUG") != nullptr) {
 			open_debugger();
 		} else if (getenv("SAMPLING") != nullptr) {
@@ -588,6 +1127,7 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 			// If running with multiple VMs, startup should be fast
 			machine().run( config().max_boot_time );
 		}
+		this->trace_startup_run(run_start);
 
 		// Make sure the program is waiting for requests
 		if (!is_waiting_for_requests()) {
@@ -604,7 +1144,9 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 		if (warmup_callback) {
 			// Measure the time taken to warmup the VM
 			start = std::chrono::high_resolution_clock::now();
+			trace_start = StartupTrace::clock::now();
 			warmup_callback();
+			StartupTrace::record(phase("warmup"), trace_start);
 			end = std::chrono::high_resolution_clock::now();
 			result.warmup_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 		}
@@ -620,7 +1162,20 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 		machine().fds().accept_callback = nullptr;
 		machine().fds().set_preempt_epoll_wait(false);
 
-		if (!just_one_vm && !m_is_storage)
+		if (m_poll_method == PollMethod::Checkpoint)
+		{
+			// Skip over OUT instruction, returning 0 from the checkpoint
+			auto& regs = machine().registers();
+			regs.rip += 2;
+			regs.rax = 0;
+			machine().set_registers(regs);
+			if (!just_one_vm) {
+				trace_start = StartupTrace::clock::now();
+				machine().prepare_copy_on_write();
+				StartupTrace::record(phase("prepare copy-on-write"), trace_start);
+			}
+		}
+		else if (!just_one_vm && !m_is_storage)
 		{
 			// The VM is currently paused in kernel mode in a system call handler
 			// so we need manully return to user mode
@@ -632,7 +1187,9 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 			machine().set_registers(regs);
 
 			// Make forkable (with *NO* working memory)
+			trace_start = StartupTrace::clock::now();
 			machine().prepare_copy_on_write();
+			StartupTrace::record(phase("prepare copy-on-write"), trace_start);
 		} else if (is_storage()) {
 			// Skip over OUT instruction
 			auto& regs = machine().registers();
@@ -641,7 +1198,9 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 		}
 
 		if (!m_is_storage && machine().main_memory().has_snapshot_area()) {
+			trace_start = StartupTrace::clock::now();
 			this->save_state();
+			StartupTrace::record("save snapshot", trace_start);
 		}
 
 		// Finish measuring initialization time
@@ -688,6 +1247,49 @@ VirtualMachine::InitResult VirtualMachine::initialize(std::function<void()> warm
 	return result;
 }
 
+void VirtualMachine::prefault_memory(bool lock)
+{
+	const auto trace_start = StartupTrace::clock::now();
+	char* memory = machine().main_memory().ptr;
+	const size_t size = machine().main_memory().size;
+	const size_t chunks = (size + settings::PREFAULT_CHUNK - 1) / settings::PREFAULT_CHUNK;
+	const size_t page_size = getpagesize();
+	// Threads take chunks in order until all of the memory is populated
+	std::atomic<size_t> next_chunk = 0;
+	auto populate = [&] {
+		for (size_t chunk = next_chunk++; chunk < chunks; chunk = next_chunk++) {
+			char* begin = memory + chunk * settings::PREFAULT_CHUNK;
+			const size_t len = std::min(settings::PREFAULT_CHUNK, size - chunk * settings::PREFAULT_CHUNK);
+			// Read faults map untouched memory to the zero page, allocating nothing
+			if (madvise(begin, len, MADV_POPULATE_READ) == 0) {
+				continue;
+			}
+			// Older kernels do not have MADV_POPULATE_READ
+			for (size_t offset = 0; offset < len; offset += page_size) {
+				(void)*(volatile const char*)&begin[offset];
+			}
+		}
+	};
+	const size_t thread_count = std::min<size_t>({chunks,
+		std::max(1u, std::thread::hardware_concurrency()), settings::PREFAULT_MAX_THREADS});
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < thread_count; i++) {
+		threads.emplace_back(populate);
+	}
+	populate();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	StartupTrace::record(m_is_storage ? "storage prefault memory" : "prefault memory", trace_start);
+
+	// Lock what is populated now, and pages faulted in later, without
+	// allocating memory that the guest has never written to
+	if (lock && mlock2(memory, size, MLOCK_ONFAULT) < 0) {
+		fprintf(stderr, "Warning: Unable to lock the memory of %s: %s (see ulimit -l)\n",
+			name().c_str(), strerror(errno));
+	}
+}
+
 void VirtualMachine::restart_poll_syscall()
 {
 	switch (this->m_poll_method)
@@ -701,6 +1303,9 @@ void VirtualMachine::restart_poll_syscall()
 	case PollMethod::Blocking:
 		machine().system_call(machine().cpu(), SYS_accept4);
 		break;
+	case PollMethod::Checkpoint:
+		// The program continues from its checkpoint to its next wait
+		break;
 	case PollMethod::Undefined:
 		// This should never happen
 		fprintf(stderr, "VM %s does not have a known polling method\n", name().c_str());
@@ -718,7 +1323,7 @@ void VirtualMachine::resume_fork()
 		while (true)
 		{
 			this->restart_poll_syscall();
-			machine().vmresume();
+			this->vmresume_sampled();
 
 			if (this->m_reset_needed)
 			{
@@ -727,13 +1332,84 @@ void VirtualMachine::resume_fork()
 				this->m_reset_needed = false;
 				continue;
 			}
-			fprintf(stderr, "VM %s did not need reset\n", name().c_str());
+			Logger::log(Logger::Warning, "VM %s did not need reset\n", name().c_str());
 			break;
 		}
 	}
 	else
 	{
+		this->vmresume_sampled();
+	}
+}
+
+void VirtualMachine::vmresume_sampled()
+{
+	if (m_profiler == nullptr) {
 		machine().vmresume();
+		return;
+	}
+	// Resume with a short timeout, and take a sample every time it expires
+	const std::string_view binary = (m_binary_type != BinaryType::Dynamic) ? m_original_binary : std::string_view();
+	const auto max_request_time = std::chrono::duration<float>(config().max_req_time);
+	std::chrono::steady_clock::time_point request_start {};
+	while (true) {
+		try {
+			machine().vmresume(m_profiler->period());
+			return;
+		} catch (const tinykvm::MachineTimeoutException&) {
+			m_profiler->sample(machine(), m_exec_mappings, m_jit_files, binary);
+			// The slices add up to the time limit of the request being
+			// handled, but waiting for a connection is not counted
+			if (m_tracked_client_vfd == -1) {
+				request_start = {};
+				continue;
+			}
+			const auto now = std::chrono::steady_clock::now();
+			if (request_start == std::chrono::steady_clock::time_point{}) {
+				request_start = now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<float>(m_profiler->period()));
+			}
+			if (now - request_start >= max_request_time) {
+				throw;
+			}
+		}
+	}
+}
+
+void VirtualMachine::add_exec_mapping(uint64_t addr, uint64_t len, uint64_t offset, int vfd)
+{
+	const int fd = machine().fds().translate(vfd);
+	if (fd < 0) {
+		return;
+	}
+	auto symbols = m_profiler->symbols_for(fd);
+	if (symbols == nullptr) {
+		return;
+	}
+	// A new mapping replaces anything it overlaps
+	std::erase_if(m_exec_mappings, [&] (const Profiler::Mapping& mapping) {
+		return mapping.begin < addr + len && addr < mapping.end;
+	});
+	m_exec_mappings.push_back({addr, addr + len, offset, std::move(symbols)});
+}
+
+void VirtualMachine::trace_startup_run(StartupTrace::clock::time_point start)
+{
+	if (!StartupTrace::enabled()) {
+		return;
+	}
+	const auto end = StartupTrace::clock::now();
+	const std::string prefix = (m_is_storage) ? "storage " : "";
+	// The dynamic linker is done when the last shared object is mapped
+	auto main_start = start;
+	if (m_binary_type == BinaryType::Dynamic && m_library_mapped > start) {
+		StartupTrace::record(prefix + "dynamic linking", start, m_library_mapped);
+		main_start = m_library_mapped;
+	}
+	const auto main_end = (m_listener_found > main_start) ? m_listener_found : end;
+	StartupTrace::record(prefix + "program main", main_start, main_end);
+	if (main_end < end) {
+		StartupTrace::record(prefix + "listener to waiting for requests", main_end, end);
 	}
 }
 
@@ -757,6 +1433,9 @@ void VirtualMachine::init_kvm()
 
 	// Initialize the KVM subsystem
 	tinykvm::Machine::init();
+
+	// Override system calls that kvmserver handles itself
+	install_system_calls();
 }
 
 #include <tinykvm/rsp_client.hpp>
@@ -810,6 +1489,5 @@ bool VirtualMachine::validate_listener(int fd)
 	}
 
 	// Validate network addresses against allow listen lists
-	return validate_network_access(
-		addr, m_config.allowed_listen_ipv4, m_config.allowed_listen_ipv6);
+	return m_config.allowed_listen.contains(addr);
 }
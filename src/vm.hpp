@@ -1,8 +1,21 @@
 #pragma once
+#include <poll.h>
 #include <sys/socket.h>
 #include <chrono>
+#include <vector>
 #include <tinykvm/machine.hpp>
 #include "config.hpp"
+#include "memory_trimmer.hpp"
+#include "output_capture.hpp"
+#include "path_index.hpp"
+#include "profiler.hpp"
+#include "startup_trace.hpp"
+#include "syscall_stats.hpp"
+struct SharedCache;
+struct UpstreamPool;
+struct DnsCache;
+struct FileCache;
+struct ForkMetrics;
 
 struct VirtualMachine
 {
@@ -19,6 +32,7 @@ struct VirtualMachine
 		Blocking,
 		Poll,
 		Epoll,
+		Checkpoint, /* Stopped in kvmserverguest_checkpoint() */
 	};
 
 	void wait_for_requests_paused();
@@ -35,11 +49,24 @@ struct VirtualMachine
 	BinaryType binary_type() const noexcept { return m_binary_type; }
 	std::string binary_type_string() const noexcept;
 	void set_on_reset_callback(on_reset_t callback) noexcept { m_on_reset_callback = std::move(callback); }
+	void set_shared_cache(SharedCache* cache) noexcept { m_shared_cache = cache; }
+	void set_upstream_pool(UpstreamPool* pool) noexcept { m_upstream_pool = pool; }
+	void set_dns_cache(DnsCache* cache) noexcept { m_dns_cache = cache; }
+	void set_file_cache(FileCache* cache) noexcept { m_file_cache = cache; }
+	void set_profiler(Profiler* profiler) noexcept { m_profiler = profiler; }
+	void set_metrics(ForkMetrics* metrics) noexcept { m_metrics = metrics; m_phase_start = std::chrono::steady_clock::now(); }
+	void record_storage_call(std::chrono::steady_clock::time_point start,
+		std::chrono::steady_clock::time_point entered);
+	/* Executable file mappings, for symbolizing profiler samples */
+	bool is_profiling() const noexcept { return m_profiler != nullptr; }
+	void add_exec_mapping(uint64_t addr, uint64_t len, uint64_t offset, int vfd);
 	void set_ephemeral(bool ephemeral) noexcept { m_ephemeral = ephemeral; }
 	bool is_ephemeral() const noexcept { return m_ephemeral; }
 	bool is_storage() const noexcept { return m_is_storage; }
 	unsigned reqid() const noexcept { return m_reqid; }
 	PollMethod poll_method() const noexcept { return m_poll_method; }
+	/* The host socket the program listens on, in the main VM */
+	int listening_fd() const noexcept { return m_tracked_client_fd; }
 
 	void warmup();
 	void open_debugger();
@@ -52,14 +79,71 @@ struct VirtualMachine
 		std::chrono::milliseconds warmup_time;
 	};
 	InitResult initialize(std::function<void()> warmup, bool just_one_vm);
-	void reset_to(const VirtualMachine&);
+	void reset_to(const VirtualMachine&, bool keep_persistent = true);
+	/* Fault in all of the main memory in parallel, and optionally lock it */
+	void prefault_memory(bool lock);
 	static void init_kvm();
+	static void install_system_calls();
+
+	/* Guest memory ranges that survive ephemeral resets of this VM */
+	int persist_range(gaddr_t addr, size_t size);
+	/* Host-side cache shared by all VMs */
+	long cache_get(gaddr_t key, size_t keylen, gaddr_t buffer, size_t buflen);
+	long cache_put(gaddr_t key, size_t keylen, gaddr_t value, size_t len, uint32_t ttl_ms);
+	long cache_invalidate(gaddr_t key, size_t keylen);
+	/* The guest signals that it is fully initialized */
+	int checkpoint();
+	/* Scaling from the guest TSC to host clocks, see ParavirtClock */
+	int clock_calibrate(gaddr_t params, uint64_t guest_tsc);
+
+	/* Small writes to the tracked client are coalesced on the host and
+	   sent before the guest makes any other system call */
+	struct GuestBuffer {
+		gaddr_t addr;
+		size_t len;
+	};
+	SyscallStats& syscall_stats() noexcept { return *m_syscall_stats; }
+
+	bool is_tracked_client(int vfd) const noexcept { return vfd >= 0 && vfd == m_tracked_client_vfd; }
+	/* Returns false when the write should be made directly instead,
+	   otherwise result is what the write returns to the guest */
+	bool append_client_output(const GuestBuffer* buffers, size_t count, long& result);
+	bool flush_client_output() { return m_client_output.empty() || send_client_output(); }
+	bool has_client_output() const noexcept { return !m_client_output.empty(); }
+	/* The total length of guest buffers, or false when it is too large */
+	static bool total_length(const GuestBuffer* buffers, size_t count, size_t& total);
+	/* Writes to stdout and stderr are buffered with --buffer-guest-output */
+	bool captures_output(int vfd) const;
+	bool capture_output(int vfd, const GuestBuffer* buffers, size_t count);
+
+	/* The first time each event happens on the tracked client, for the
+	   per-connection latency breakdown in the metrics */
+	enum ConnectionEvent { Accepted, FirstRead, FirstWrite, Closed, CONNECTION_EVENTS };
+	bool traces_connections() const noexcept { return m_metrics != nullptr; }
+	void trace_connection(ConnectionEvent event) noexcept {
+		if (m_metrics != nullptr && m_connection_events[event] == std::chrono::steady_clock::time_point{}) {
+			m_connection_events[event] = std::chrono::steady_clock::now();
+		}
+	}
 
 private:
 	void begin_warmup_client();
 	void stop_warmup_client();
 	bool connect_and_send_requests(const sockaddr* serv_addr, socklen_t serv_addr_len);
 	bool validate_listener(int fd);
+	const PathIndex::Entry* lookup_path(std::string& path, PathIndex::Access access);
+	bool open_readable(std::string& path);
+	bool open_writable(std::string& path);
+	bool send_client_output();
+	/* Bytes the client socket accepts without blocking */
+	size_t client_send_space() const;
+	void reset_scratch();
+	void invalidate_clock();
+	void vmresume_sampled();
+	void record_connection(std::chrono::steady_clock::time_point reset_end);
+	void trace_startup_run(StartupTrace::clock::time_point start);
+	bool checkpoint_pending() const noexcept { return m_config.wait_for_checkpoint && !m_checkpoint_reached; }
+	bool stop_for_trim(std::vector<struct pollfd>& wait_fds, int timeout);
 	InitResult initialize_from_file();
 	void save_state();
 	void load_state();
@@ -74,10 +158,52 @@ private:
 	bool m_reset_needed = false;
 	bool m_waiting_for_requests = false;
 	bool m_blocking_connections = false;
+	bool m_checkpoint_reached = false;
+	bool m_readonly_open = false; // Inside a read-only open() system call
 	// The tracked client fd for ephemeral VMs
 	int m_tracked_client_fd = -1;
 	int m_tracked_client_vfd = -1;
+	std::string m_client_output;
+	size_t m_client_output_space = 0; /* Buffered at most, set when the buffer is empty */
+	int m_client_output_error = 0; /* From sending, for the next client write */
 	PollMethod m_poll_method = Undefined;
 	on_reset_t m_on_reset_callback = nullptr;
 	const VirtualMachine* m_master_instance = nullptr;
+	struct PersistentRange {
+		gaddr_t addr;
+		size_t size;
+	};
+	std::vector<PersistentRange> m_persistent_ranges;
+	std::vector<uint8_t> m_persistent_data;
+	SharedCache* m_shared_cache = nullptr;
+	UpstreamPool* m_upstream_pool = nullptr;
+	DnsCache* m_dns_cache = nullptr;
+	FileCache* m_file_cache = nullptr;
+	ForkMetrics* m_metrics = nullptr;
+	OutputCapture::Buffers* m_output = nullptr;
+	MemoryTrimmer::Fork* m_trim = nullptr; /* Idle state for --memory-budget and --memory-pressure */
+	Profiler* m_profiler = nullptr;
+	Profiler::Mappings m_exec_mappings;
+	Profiler::JitFiles m_jit_files;
+	std::chrono::steady_clock::time_point m_phase_start; /* Start of the current busy or idle period */
+	std::array<std::chrono::steady_clock::time_point, CONNECTION_EVENTS> m_connection_events {};
+	/* Phase boundaries of the initial run, for --trace-startup */
+	StartupTrace::clock::time_point m_library_mapped {};
+	StartupTrace::clock::time_point m_listener_found {};
+	std::shared_ptr<const PathIndex> m_path_index;
+	std::string m_scratch_dir;
+	bool m_scratch_dirty = true; /* A writable scratch path was used since the last reset */
+	gaddr_t m_clock_params = 0; /* Guest copy of ParavirtClock::Params */
+	std::unique_ptr<SyscallStats> m_syscall_stats = std::make_unique<SyscallStats>();
+	// Per-VM direct-mapped cache of path lookups, cleared on reset by
+	// moving to a new generation. Slots keep the capacity of their
+	// strings, so that lookups stop allocating once the cache is warm.
+	struct PathLookup {
+		std::string key;
+		std::string path;
+		const PathIndex::Entry* entry = nullptr;
+		uint32_t generation = 0;
+	};
+	std::array<std::vector<PathLookup>, 3> m_path_cache;
+	uint32_t m_path_cache_generation = 1;
 };